@@ -0,0 +1,164 @@
+// Allocation budget checks for the hot paths.
+//
+// Runs real command handlers against an in-process server (objects built with
+// AllocTrace) and fails when one invocation allocates more than its budget.
+// Budgets are "base + perMember * members".
+//
+// A channel PRIVMSG to idle members costs 2 allocations per member. Idle
+// clients hold no output buffer (Client::appendOutput creates the string on
+// demand and flushOutput frees it once drained), so each recipient's buffer
+// and its storage are allocated again per message. That is the intended
+// trade: memory per idle client over allocations per delivery. The relay
+// itself must not grow with the channel, so the same message is also measured
+// against backlogged members, whose buffers already exist, with a flat budget.
+// A row naming another in `notAbove` also fails if it allocates more than
+// that row did, which holds the 10000-member relay to the 1000-member cost.
+//
+//   ./bench/alloc_budget        (or: make alloc-check)
+
+#include "fixtures.hpp"
+
+#define BUDGET_WARMUP_RUNS 3
+#define BUDGET_MEASURED_RUNS 10
+// Pending output given to every backlogged member: large enough that the
+// runs' appends fit in the buffer once it has grown during warm-up.
+#define BUDGET_BACKLOG_BYTES 4096
+
+typedef void (*Handler)(std::list<std::string>, Client*, Server*);
+
+struct Budget {
+    const char* name;
+    const char* line;
+    Handler handler;
+    size_t members;
+    bool backlogged;
+    unsigned long base;
+    unsigned long perMember;
+    const char* notAbove;
+};
+
+// Current costs. Lower these when an optimization lands; never raise them to
+// make a regression pass. The flat "K regardless of member count" budget
+// holds only for backlogged members: relaying to idle members stays at
+// 2 allocations per member for as long as drained clients free their output
+// buffers (see above).
+static const Budget budgets[] = {
+    { "PRIVMSG #channel, 10 idle members",          "PRIVMSG #budget :hello everyone", handlePrivmsg, 10,    false, 48, 2, NULL },
+    { "PRIVMSG #channel, 1000 idle members",        "PRIVMSG #budget :hello everyone", handlePrivmsg, 1000,  false, 48, 2, NULL },
+    { "PRIVMSG #channel, 10000 idle members",       "PRIVMSG #budget :hello everyone", handlePrivmsg, 10000, false, 48, 2, NULL },
+    { "PRIVMSG #channel, 10 backlogged members",    "PRIVMSG #budget :hello everyone", handlePrivmsg, 10,    true,  32, 0, NULL },
+    { "PRIVMSG #channel, 1000 backlogged members",  "PRIVMSG #budget :hello everyone", handlePrivmsg, 1000,  true,  32, 0, NULL },
+    { "PRIVMSG #channel, 10000 backlogged members", "PRIVMSG #budget :hello everyone", handlePrivmsg, 10000, true,  32, 0, "PRIVMSG #channel, 1000 backlogged members" },
+    { "PRIVMSG nick",                               "PRIVMSG Nick1 :hello there",      handlePrivmsg, 2,     false, 32, 0, NULL },
+    { "PING",                                       "PING :token",                     handlePing,    1,     false, 16, 0, NULL },
+};
+
+class Scenario {
+private:
+    Server& server;
+    SimTransport& transport;
+    std::vector<Client*> clients;
+    bool backlogged;
+
+public:
+    Scenario(Server& server, SimTransport& transport, size_t members, bool backlogged)
+        : server(server), transport(transport), backlogged(backlogged) {
+        for (size_t i = 0; i < members; ++i) {
+            Client* client = makeClient(transport, i);
+            server.getClients()[client->getFd()] = client;
+            server.setClientNickname(client, client->getNickname());
+            std::list<std::string> join;
+            join.push_back("JOIN");
+            join.push_back("#budget");
+            handleJoin(join, client, &server);
+            clients.push_back(client);
+        }
+        drainClients(transport, clients);
+        if (backlogged) {
+            std::string backlog(BUDGET_BACKLOG_BYTES, 'x');
+            for (size_t i = 0; i < clients.size(); ++i) {
+                clients[i]->queueOutput(backlog);
+            }
+            std::vector<int> pending;
+            Client::takePendingFlush(pending);
+        }
+    }
+
+    ~Scenario() {
+        server.removeChannel("#budget");
+        for (size_t i = 0; i < clients.size(); ++i) {
+            server.forgetNickname(clients[i]);
+            server.getClients().erase(clients[i]->getFd());
+            delete clients[i];
+        }
+        std::vector<int> pending;
+        Client::takePendingFlush(pending);
+    }
+
+    // Most allocations any single invocation made after warm-up.
+    unsigned long run(const Budget& budget) {
+        std::list<std::string> cmdList = server.parseMessage(budget.line);
+        unsigned long worst = 0;
+        for (int i = 0; i < BUDGET_WARMUP_RUNS + BUDGET_MEASURED_RUNS; ++i) {
+            AllocCounters before = AllocTrace::threadCounters();
+            budget.handler(cmdList, clients.front(), &server);
+            AllocCounters after = AllocTrace::threadCounters();
+            if (i >= BUDGET_WARMUP_RUNS) {
+                worst = std::max(worst, after.allocs - before.allocs);
+            }
+            if (!backlogged) {
+                drainClients(transport, clients);
+            }
+        }
+        return worst;
+    }
+};
+
+int main() {
+    if (!AllocTrace::enabled()) {
+        std::cerr << "alloc_budget must be linked against objects built with -DIRCSERV_ALLOC_TRACE" << std::endl;
+        return 2;
+    }
+
+    // Worker threads allocate on their own counters; keep fan-out on this one.
+    FanoutPool::instance().configure(0, 0, FANOUT_DEFAULT_SLICE);
+
+    int failures = 0;
+    {
+        QuietLogs quiet;
+        std::ostream out(quiet.stdoutBuffer());
+        Server server("6667", "budget");
+        SimTransport transport(false);
+
+        std::vector<unsigned long> used;
+        for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); ++i) {
+            const Budget& budget = budgets[i];
+            unsigned long limit = budget.base + budget.perMember * budget.members;
+            {
+                Scenario scenario(server, transport, budget.members, budget.backlogged);
+                used.push_back(scenario.run(budget));
+            }
+            bool ok = used.back() <= limit;
+            failures += !ok;
+            out << (ok ? "ok   " : "FAIL ") << budget.name << ": " << used.back() << " allocations (budget "
+                << limit << " = " << budget.base << " + " << budget.perMember << "/member)" << std::endl;
+            if (budget.notAbove) {
+                size_t other = 0;
+                while (other < i && std::strcmp(budgets[other].name, budget.notAbove) != 0) {
+                    ++other;
+                }
+                bool found = other < i;
+                ok = found && used.back() <= used[other];
+                failures += !ok;
+                out << (ok ? "ok   " : "FAIL ") << budget.name << ": no more than \"" << budget.notAbove << "\" ("
+                    << (found ? Utils::intToString(static_cast<int>(used[other])) : "no earlier row") << ")"
+                    << std::endl;
+            }
+        }
+    }
+    if (failures) {
+        std::cerr << failures << " allocation budget(s) exceeded" << std::endl;
+        return 1;
+    }
+    return 0;
+}
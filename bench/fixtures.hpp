@@ -0,0 +1,59 @@
+#pragma once
+
+// Helpers shared by the in-process bench tools that link the server objects.
+
+#include "Includes.hpp"
+#include <fstream>
+
+// The server logs every state change; route that to /dev/null for the
+// lifetime of the object so tool output stays machine readable.
+class QuietLogs {
+private:
+    std::ofstream devnull;
+    std::streambuf* out;
+    std::streambuf* err;
+
+    QuietLogs(const QuietLogs& other);
+    QuietLogs& operator=(const QuietLogs& other);
+
+public:
+    QuietLogs() : devnull("/dev/null"), out(std::cout.rdbuf()), err(std::cerr.rdbuf()) {
+        std::cout.rdbuf(devnull.rdbuf());
+        std::cerr.rdbuf(devnull.rdbuf());
+    }
+
+    ~QuietLogs() {
+        std::cout.rdbuf(out);
+        std::cerr.rdbuf(err);
+    }
+
+    std::streambuf* stdoutBuffer() const { return out; }
+};
+
+inline std::string numbered(const std::string& base, size_t index) {
+    return base + Utils::intToString(static_cast<int>(index));
+}
+
+// Fake clients live on a SimTransport; what the server writes to them is
+// counted and dropped when the transport does not record output.
+inline Client* makeClient(SimTransport& transport, size_t index) {
+    Client* client = new Client();
+    client->setFd(transport.connect(htonl(INADDR_LOOPBACK)));
+    client->setIPAddress("127.0.0.1");
+    client->setNickname(numbered("Nick", index));
+    client->setUsername(numbered("user", index));
+    client->setHostname("127.0.0.1");
+    client->setAuthenticated(true);
+    client->setRegistered(true);
+    return client;
+}
+
+// Sends whatever the clients queued and forgets the pending-flush list, as
+// the end of an event loop tick would.
+inline void drainClients(SimTransport& transport, const std::vector<Client*>& clients) {
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i]->flushOutput(transport);
+    }
+    std::vector<int> pending;
+    Client::takePendingFlush(pending);
+}
@@ -0,0 +1,250 @@
+// Scaling check for idle connections: opens N registered clients against a
+// local ircserv, leaves them idle and reports the server RSS per connection.
+//
+//   ./bench/idle_clients <port> <password> <count> [server-pid]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define CONNECTIONS_PER_SOURCE 30000
+#define CONNECT_BATCH 512
+#define REGISTER_TIMEOUT_SEC 60
+
+enum ConnState { CONNECTING, REGISTERING, IDLE, FAILED };
+
+struct Connection {
+    int fd;
+    ConnState state;
+    std::string pending;
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void raiseFdLimit() {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+}
+
+static pid_t findServerPid() {
+    DIR* proc = opendir("/proc");
+    if (!proc) {
+        return 0;
+    }
+    pid_t found = 0;
+    struct dirent* entry;
+    while (!found && (entry = readdir(proc)) != NULL) {
+        pid_t pid = static_cast<pid_t>(std::atoi(entry->d_name));
+        if (pid <= 0) {
+            continue;
+        }
+        std::ifstream comm(("/proc/" + std::string(entry->d_name) + "/comm").c_str());
+        std::string name;
+        if (comm >> name && name == "ircserv") {
+            found = pid;
+        }
+    }
+    closedir(proc);
+    return found;
+}
+
+// Kept open for the whole run: once every descriptor is used by a client
+// connection we could no longer open /proc to take the final sample.
+static int openStatm(pid_t pid) {
+    std::ostringstream path;
+    path << "/proc/" << pid << "/statm";
+    return open(path.str().c_str(), O_RDONLY);
+}
+
+static long residentBytes(int statmFd) {
+    char buffer[128];
+    ssize_t n = pread(statmFd, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    buffer[n] = '\0';
+    std::istringstream statm(buffer);
+    long pages = 0;
+    long resident = 0;
+    if (!(statm >> pages >> resident)) {
+        return -1;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static std::string nickFor(size_t index) {
+    static const char digits[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::string nick = "i";
+    do {
+        nick += digits[index % 36];
+        index /= 36;
+    } while (index);
+    return nick;
+}
+
+static int openConnection(int port, size_t index) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    struct sockaddr_in source;
+    std::memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + static_cast<in_addr_t>(index / CONNECTIONS_PER_SOURCE));
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&source), sizeof(source)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server;
+    std::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <port> <password> <count> [server-pid]" << std::endl;
+        return 1;
+    }
+    int port = std::atoi(argv[1]);
+    std::string password = argv[2];
+    size_t count = static_cast<size_t>(std::strtoul(argv[3], NULL, 10));
+    pid_t serverPid = argc == 5 ? static_cast<pid_t>(std::atoi(argv[4])) : findServerPid();
+    if (serverPid <= 0) {
+        std::cerr << "Cannot find a running ircserv; pass its pid explicitly" << std::endl;
+        return 1;
+    }
+
+    int statmFd = openStatm(serverPid);
+    if (statmFd < 0) {
+        std::cerr << "Cannot read memory usage of pid " << serverPid << std::endl;
+        return 1;
+    }
+
+    raiseFdLimit();
+    int epfd = epoll_create1(0);
+    std::vector<Connection> conns(count);
+    long rssBefore = residentBytes(statmFd);
+    double start = nowSeconds();
+
+    size_t opened = 0;
+    size_t idle = 0;
+    size_t failed = 0;
+    std::vector<struct epoll_event> events(1024);
+    char buffer[4096];
+
+    while (idle + failed < count && nowSeconds() - start < REGISTER_TIMEOUT_SEC) {
+        size_t inFlight = opened - idle - failed;
+        while (opened < count && inFlight < CONNECT_BATCH) {
+            Connection& conn = conns[opened];
+            conn.fd = openConnection(port, opened);
+            if (conn.fd < 0) {
+                conn.state = FAILED;
+                ++failed;
+            } else {
+                conn.state = CONNECTING;
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.u64 = opened;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+                ++inFlight;
+            }
+            ++opened;
+        }
+
+        int nfds = epoll_wait(epfd, &events[0], static_cast<int>(events.size()), 100);
+        for (int i = 0; i < nfds; ++i) {
+            size_t index = static_cast<size_t>(events[i].data.u64);
+            Connection& conn = conns[index];
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, NULL);
+                close(conn.fd);
+                conn.state = FAILED;
+                ++failed;
+                continue;
+            }
+            if (conn.state == CONNECTING && (events[i].events & EPOLLOUT)) {
+                std::string nick = nickFor(index);
+                std::string reg = "PASS " + password + "\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :idle\r\n";
+                send(conn.fd, reg.c_str(), reg.size(), MSG_NOSIGNAL);
+                conn.state = REGISTERING;
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.u64 = index;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+            }
+            if (events[i].events & EPOLLIN) {
+                ssize_t n;
+                while ((n = recv(conn.fd, buffer, sizeof(buffer), 0)) > 0) {
+                    if (conn.state == REGISTERING) {
+                        conn.pending.append(buffer, n);
+                    }
+                }
+                if (conn.state == REGISTERING && conn.pending.find(" 001 ") != std::string::npos) {
+                    conn.state = IDLE;
+                    std::string().swap(conn.pending);
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, NULL);
+                    ++idle;
+                }
+            }
+        }
+    }
+    double elapsed = nowSeconds() - start;
+
+    sleep(1);
+    long rssAfter = residentBytes(statmFd);
+    std::cout << "connections requested: " << count << "\n"
+              << "registered idle:       " << idle << "\n"
+              << "failed:                " << failed << "\n"
+              << "setup time:            " << elapsed << " s ("
+              << (elapsed > 0 ? idle / elapsed : 0) << " registrations/s)\n"
+              << "server RSS before:     " << rssBefore << " bytes\n"
+              << "server RSS after:      " << rssAfter << " bytes\n";
+    if (idle > 0) {
+        std::cout << "RSS per connection:    " << (rssAfter - rssBefore) / static_cast<long>(idle) << " bytes" << std::endl;
+    }
+
+    for (size_t i = 0; i < opened; ++i) {
+        if (conns[i].state != FAILED) {
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    close(statmFd);
+    return idle == count ? 0 : 2;
+}
@@ -0,0 +1,527 @@
+// Load generator for ircserv: simulates thousands of IRC clients over loopback.
+//
+// Every client registers (PASS/NICK/USER), joins channels drawn from a Zipf
+// distribution and then the whole population sends PRIVMSG at a fixed total
+// rate. Each payload carries its send timestamp, so every delivery yields an
+// end-to-end latency sample. With -u, the server is sent SIGUSR2 halfway
+// through the measurement, so a hot upgrade can be checked under load: the
+// report then counts the clients that were disconnected and compares the
+// deliveries with the number expected from the channel memberships.
+//
+//   ./bench/loadgen -p <port> -w <password> [options]
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define CONNECTIONS_PER_SOURCE 30000
+#define PAYLOAD_TAG "lg"
+
+struct Options {
+    std::string host;
+    int port;
+    std::string password;
+    size_t clients;
+    size_t channels;
+    size_t joinsPerClient;
+    double zipf;
+    double rate;
+    double duration;
+    size_t connectBatch;
+    double timeout;
+    pid_t upgradePid;
+
+    Options()
+        : host("127.0.0.1"), port(6667), password(""), clients(1000), channels(100),
+          joinsPerClient(3), zipf(1.0), rate(1000), duration(10), connectBatch(256), timeout(60), upgradePid(0) {}
+};
+
+enum ClientState { CONNECTING, REGISTERING, JOINING, READY, FAILED };
+
+struct LoadClient {
+    int fd;
+    ClientState state;
+    std::vector<size_t> channels;
+    size_t joinsPending;
+    size_t readySlot;
+    std::string in;
+    std::string out;
+};
+
+struct Report {
+    unsigned long sent;
+    unsigned long delivered;
+    unsigned long expected;
+    unsigned long bytesIn;
+    size_t disconnects;
+    std::vector<long long> latencies;
+
+    Report() : sent(0), delivered(0), expected(0), bytesIn(0), disconnects(0) {}
+};
+
+static long long nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// xorshift64*: cheap and good enough to pick senders and channels.
+static unsigned long long rngState = 0x9E3779B97F4A7C15ULL;
+
+static double uniform() {
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return static_cast<double>((rngState * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+class Zipf {
+private:
+    std::vector<double> cdf;
+
+public:
+    Zipf(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+            cdf[i] = sum;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            cdf[i] /= sum;
+        }
+    }
+
+    size_t sample() const {
+        return static_cast<size_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform()) - cdf.begin());
+    }
+};
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " -p <port> -w <password> [options]\n"
+              << "  -h <host>      server address (default 127.0.0.1)\n"
+              << "  -c <clients>   connections to open (default 1000)\n"
+              << "  -m <channels>  channel population (default 100)\n"
+              << "  -j <joins>     channels joined per client, at least 1 (default 3)\n"
+              << "  -z <s>         Zipf exponent for channel popularity (default 1.0)\n"
+              << "  -r <rate>      total PRIVMSG per second (default 1000)\n"
+              << "  -d <seconds>   measurement duration (default 10)\n"
+              << "  -b <batch>     connections in flight while connecting (default 256)\n"
+              << "  -t <seconds>   setup timeout (default 60)\n"
+              << "  -u <pid>       send SIGUSR2 (hot upgrade) to this server pid halfway through" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, Options& opts) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:w:c:m:j:z:r:d:b:t:u:")) != -1) {
+        switch (opt) {
+            case 'h': opts.host = optarg; break;
+            case 'p': opts.port = std::atoi(optarg); break;
+            case 'w': opts.password = optarg; break;
+            case 'c': opts.clients = std::strtoul(optarg, NULL, 10); break;
+            case 'm': opts.channels = std::strtoul(optarg, NULL, 10); break;
+            case 'j': opts.joinsPerClient = std::strtoul(optarg, NULL, 10); break;
+            case 'z': opts.zipf = std::atof(optarg); break;
+            case 'r': opts.rate = std::atof(optarg); break;
+            case 'd': opts.duration = std::atof(optarg); break;
+            case 'b': opts.connectBatch = std::strtoul(optarg, NULL, 10); break;
+            case 't': opts.timeout = std::atof(optarg); break;
+            case 'u': opts.upgradePid = static_cast<pid_t>(std::atol(optarg)); break;
+            default: return false;
+        }
+    }
+    if (opts.password.empty() || opts.clients == 0 || opts.channels == 0 || opts.joinsPerClient == 0 ||
+        opts.connectBatch == 0) {
+        return false;
+    }
+    opts.joinsPerClient = std::min(opts.joinsPerClient, opts.channels);
+    return true;
+}
+
+static void raiseFdLimit() {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+}
+
+static std::string channelName(size_t index) {
+    std::ostringstream oss;
+    oss << "#lg" << index;
+    return oss.str();
+}
+
+static std::string nickFor(size_t index) {
+    std::ostringstream oss;
+    oss << "lg" << index;
+    return oss.str();
+}
+
+class LoadGenerator {
+private:
+    Options opts;
+    Zipf zipf;
+    int epfd;
+    std::vector<LoadClient> clients;
+    std::vector<size_t> ready;
+    std::vector<size_t> channelMembers;
+    size_t opened;
+    size_t registered;
+    size_t joined;
+    size_t failed;
+    bool measuring;
+    Report report;
+
+    int openSocket(size_t index) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct sockaddr_in server;
+        std::memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(opts.port);
+        inet_pton(AF_INET, opts.host.c_str(), &server.sin_addr);
+
+        if (ntohl(server.sin_addr.s_addr) >> 24 == 127) {
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+            struct sockaddr_in source;
+            std::memset(&source, 0, sizeof(source));
+            source.sin_family = AF_INET;
+            source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + static_cast<in_addr_t>(index / CONNECTIONS_PER_SOURCE));
+            bind(fd, reinterpret_cast<struct sockaddr*>(&source), sizeof(source));
+        }
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void watch(size_t index, bool wantWrite, int op) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        if (wantWrite) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.u64 = index;
+        epoll_ctl(epfd, op, clients[index].fd, &ev);
+    }
+
+    void fail(size_t index) {
+        LoadClient& client = clients[index];
+        if (client.state == FAILED) {
+            return;
+        }
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client.fd, NULL);
+        close(client.fd);
+        if (client.state == READY) {
+            for (size_t i = 0; i < client.channels.size(); ++i) {
+                --channelMembers[client.channels[i]];
+            }
+            ready[client.readySlot] = ready.back();
+            clients[ready.back()].readySlot = client.readySlot;
+            ready.pop_back();
+        }
+        if (measuring) {
+            ++report.disconnects;
+        }
+        client.state = FAILED;
+        ++failed;
+    }
+
+    void queue(size_t index, const std::string& data) {
+        LoadClient& client = clients[index];
+        bool wasEmpty = client.out.empty();
+        client.out += data;
+        if (wasEmpty) {
+            flush(index);
+        }
+    }
+
+    void flush(size_t index) {
+        LoadClient& client = clients[index];
+        while (!client.out.empty()) {
+            ssize_t n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(index, true, EPOLL_CTL_MOD);
+                    return;
+                }
+                fail(index);
+                return;
+            }
+            client.out.erase(0, n);
+        }
+        if (client.state != CONNECTING) {
+            watch(index, false, EPOLL_CTL_MOD);
+        }
+    }
+
+    void openMore() {
+        while (opened < clients.size() && opened - registered - failed < opts.connectBatch) {
+            LoadClient& client = clients[opened];
+            client.fd = openSocket(opened);
+            if (client.fd < 0) {
+                client.state = FAILED;
+                ++failed;
+            } else {
+                client.state = CONNECTING;
+                watch(opened, true, EPOLL_CTL_ADD);
+            }
+            ++opened;
+        }
+    }
+
+    void onConnected(size_t index) {
+        LoadClient& client = clients[index];
+        client.state = REGISTERING;
+        std::string nick = nickFor(index);
+        queue(index, "PASS " + opts.password + "\r\nNICK " + nick + "\r\nUSER " + nick + " 0 * :loadgen\r\n");
+    }
+
+    void onRegistered(size_t index) {
+        LoadClient& client = clients[index];
+        ++registered;
+        client.state = JOINING;
+        while (client.channels.size() < opts.joinsPerClient) {
+            size_t channel = zipf.sample();
+            if (std::find(client.channels.begin(), client.channels.end(), channel) == client.channels.end()) {
+                client.channels.push_back(channel);
+            }
+        }
+        client.joinsPending = client.channels.size();
+        std::string join = "JOIN ";
+        for (size_t i = 0; i < client.channels.size(); ++i) {
+            join += (i ? "," : "") + channelName(client.channels[i]);
+        }
+        queue(index, join + "\r\n");
+    }
+
+    void onLine(size_t index, const std::string& line, long long now) {
+        LoadClient& client = clients[index];
+        if (client.state == REGISTERING && line.find(" 001 ") != std::string::npos) {
+            onRegistered(index);
+            return;
+        }
+        if (client.state == JOINING && line.find(" 366 ") != std::string::npos) {
+            if (--client.joinsPending == 0) {
+                client.state = READY;
+                client.readySlot = ready.size();
+                ready.push_back(index);
+                ++joined;
+                for (size_t i = 0; i < client.channels.size(); ++i) {
+                    ++channelMembers[client.channels[i]];
+                }
+            }
+            return;
+        }
+        if (client.state == REGISTERING && line.find(" 433 ") != std::string::npos) {
+            fail(index);
+            return;
+        }
+        size_t tag = line.find(" :" PAYLOAD_TAG " ");
+        if (tag == std::string::npos || line.find(" PRIVMSG ") == std::string::npos) {
+            return;
+        }
+        long long sentAt = std::atoll(line.c_str() + tag + 2 + sizeof(PAYLOAD_TAG));
+        if (measuring && sentAt > 0) {
+            ++report.delivered;
+            report.latencies.push_back(now - sentAt);
+        }
+    }
+
+    void onReadable(size_t index) {
+        char buffer[16384];
+        LoadClient& client = clients[index];
+        for (;;) {
+            ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (n == 0) {
+                fail(index);
+                return;
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail(index);
+                }
+                break;
+            }
+            report.bytesIn += n;
+            client.in.append(buffer, n);
+        }
+
+        long long now = nowMicros();
+        size_t start = 0;
+        size_t end;
+        while (client.state != FAILED && (end = client.in.find('\n', start)) != std::string::npos) {
+            onLine(index, client.in.substr(start, end - start), now);
+            start = end + 1;
+        }
+        if (client.state != FAILED) {
+            client.in.erase(0, start);
+        }
+    }
+
+    void poll(int timeoutMs) {
+        struct epoll_event events[1024];
+        int nfds = epoll_wait(epfd, events, 1024, timeoutMs);
+        for (int i = 0; i < nfds; ++i) {
+            size_t index = static_cast<size_t>(events[i].data.u64);
+            LoadClient& client = clients[index];
+            if (client.state == FAILED) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                fail(index);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (client.state == CONNECTING) {
+                    onConnected(index);
+                } else {
+                    flush(index);
+                }
+            }
+            if (client.state != FAILED && (events[i].events & EPOLLIN)) {
+                onReadable(index);
+            }
+        }
+    }
+
+    void sendMessage() {
+        size_t index = ready[static_cast<size_t>(uniform() * ready.size())];
+        LoadClient& client = clients[index];
+        size_t channel = client.channels[static_cast<size_t>(uniform() * client.channels.size())];
+        std::ostringstream line;
+        line << "PRIVMSG " << channelName(channel) << " :" PAYLOAD_TAG " " << nowMicros() << "\r\n";
+        queue(index, line.str());
+        ++report.sent;
+        report.expected += channelMembers[channel];
+    }
+
+public:
+    LoadGenerator(const Options& options)
+        : opts(options), zipf(options.channels, options.zipf), epfd(epoll_create1(0)),
+          clients(options.clients), channelMembers(options.channels, 0), opened(0), registered(0), joined(0), failed(0), measuring(false) {}
+
+    ~LoadGenerator() {
+        for (size_t i = 0; i < opened; ++i) {
+            if (clients[i].state != FAILED) {
+                close(clients[i].fd);
+            }
+        }
+        close(epfd);
+    }
+
+    bool setup() {
+        long long start = nowMicros();
+        long long deadline = start + static_cast<long long>(opts.timeout * 1e6);
+        long long registeredAt = 0;
+        while (joined + failed < clients.size() && nowMicros() < deadline) {
+            openMore();
+            poll(10);
+            if (!registeredAt && registered + failed == clients.size()) {
+                registeredAt = nowMicros();
+            }
+        }
+        double connectSeconds = ((registeredAt ? registeredAt : nowMicros()) - start) / 1e6;
+        double joinSeconds = (nowMicros() - start) / 1e6;
+        std::cout << "clients:       " << registered << "/" << clients.size() << " registered, "
+                  << failed << " failed\n"
+                  << "registration:  " << connectSeconds << " s (" << registered / connectSeconds << " clients/s)\n"
+                  << "joins:         " << joined << " clients in " << joinSeconds << " s" << std::endl;
+        return !ready.empty();
+    }
+
+    // Returns false when every client was disconnected before the end.
+    bool measure() {
+        measuring = true;
+        long long start = nowMicros();
+        long long end = start + static_cast<long long>(opts.duration * 1e6);
+        long long upgradeAt = opts.upgradePid > 0 ? start + (end - start) / 2 : 0;
+        while (nowMicros() < end) {
+            if (upgradeAt && nowMicros() >= upgradeAt) {
+                upgradeAt = 0;
+                if (kill(opts.upgradePid, SIGUSR2) < 0) {
+                    std::cerr << "kill(" << opts.upgradePid << ", SIGUSR2): " << strerror(errno) << std::endl;
+                } else {
+                    std::cout << "upgrade:       SIGUSR2 sent to pid " << opts.upgradePid << std::endl;
+                }
+            }
+            double due = (nowMicros() - start) / 1e6 * opts.rate;
+            while (report.sent < due && !ready.empty()) {
+                sendMessage();
+            }
+            if (ready.empty()) {
+                break;
+            }
+            poll(1);
+        }
+        bool completed = !ready.empty();
+        double seconds = completed ? opts.duration : (nowMicros() - start) / 1e6;
+        long long drainEnd = nowMicros() + 1000000;
+        while (nowMicros() < drainEnd) {
+            poll(10);
+        }
+        measuring = false;
+        print(seconds);
+        if (!completed) {
+            std::cerr << "All clients were disconnected after " << seconds << " s; the run failed" << std::endl;
+        }
+        return completed;
+    }
+
+    void print(double seconds) {
+        std::vector<long long>& lat = report.latencies;
+        std::sort(lat.begin(), lat.end());
+        std::cout << "sent:          " << report.sent << " PRIVMSG (" << report.sent / seconds << "/s)\n"
+                  << "delivered:     " << report.delivered << " lines (" << report.delivered / seconds << "/s, "
+                  << report.bytesIn / seconds / 1048576 << " MiB/s received)\n"
+                  << "expected:      " << report.expected << " lines, " << report.disconnects
+                  << " clients disconnected during the run\n";
+        if (!lat.empty()) {
+            std::cout << "latency p50:   " << lat[lat.size() * 50 / 100] << " us\n"
+                      << "latency p99:   " << lat[lat.size() * 99 / 100] << " us\n"
+                      << "latency p999:  " << lat[lat.size() * 999 / 1000] << " us\n"
+                      << "latency max:   " << lat.back() << " us" << std::endl;
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parseOptions(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+    raiseFdLimit();
+
+    LoadGenerator generator(opts);
+    if (!generator.setup()) {
+        std::cerr << "No client finished joining; is ircserv running on " << opts.host << ":" << opts.port << "?" << std::endl;
+        return 1;
+    }
+    return generator.measure() ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+// Stress test and throughput numbers for the event loop mailbox.
+//
+// 1, 2, 4 and 8 producer threads post (fd, serial, line) items into one
+// Mailbox while the main thread plays the event loop: it sleeps in poll()
+// on the eventfd, acknowledges and drains. Every producer posts increasing
+// serials and the consumer checks they arrive complete and in order per
+// producer. Lines are shared by batches of posts, as a broadcast would.
+// A full mailbox makes the producer yield and retry.
+//
+//   ./bench/mailbox_stress [items-per-producer] [capacity]
+
+#include "Includes.hpp"
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+
+#define STRESS_LINE_BATCH 64
+#define STRESS_MAX_PRODUCERS 8
+
+struct Producer {
+    Mailbox* mailbox;
+    int id;
+    unsigned long items;
+    unsigned long retries;
+    pthread_t thread;
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* produce(void* arg) {
+    Producer* producer = static_cast<Producer*>(arg);
+    SharedLine* line = NULL;
+    for (unsigned long i = 0; i < producer->items; ++i) {
+        if (i % STRESS_LINE_BATCH == 0) {
+            if (line) {
+                line->release();
+            }
+            line = SharedLine::create(":server NOTICE * :stress line shared by a batch of posts\r\n");
+        }
+        MailItem item;
+        item.fd = producer->id;
+        item.serial = i;
+        item.line = line;
+        line->retain();
+        while (!producer->mailbox->post(item)) {
+            ++producer->retries;
+            sched_yield();
+        }
+    }
+    if (line) {
+        line->release();
+    }
+    return NULL;
+}
+
+// Returns false if an item was lost, duplicated or reordered.
+static bool run(size_t producerCount, unsigned long items, size_t capacity) {
+    Mailbox mailbox(capacity);
+    std::vector<Producer> producers(producerCount);
+    std::vector<unsigned long> expected(producerCount, 0);
+    unsigned long total = items * producerCount;
+    unsigned long received = 0;
+    unsigned long drains = 0;
+    bool ordered = true;
+
+    double start = nowSeconds();
+    for (size_t i = 0; i < producerCount; ++i) {
+        producers[i].mailbox = &mailbox;
+        producers[i].id = static_cast<int>(i);
+        producers[i].items = items;
+        producers[i].retries = 0;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+    while (received < total) {
+        struct pollfd wake;
+        wake.fd = mailbox.getWakeFd();
+        wake.events = POLLIN;
+        poll(&wake, 1, 100);
+        if (!mailbox.hasWork()) {
+            continue;
+        }
+        mailbox.acknowledge();
+        ++drains;
+        MailItem item;
+        while (mailbox.take(item)) {
+            if (item.serial != expected[item.fd]++) {
+                ordered = false;
+            }
+            if (item.line->str().empty()) {
+                ordered = false;
+            }
+            item.line->release();
+            ++received;
+        }
+    }
+    double elapsed = nowSeconds() - start;
+    unsigned long retries = 0;
+    for (size_t i = 0; i < producerCount; ++i) {
+        pthread_join(producers[i].thread, NULL);
+        retries += producers[i].retries;
+        if (expected[i] != items) {
+            ordered = false;
+        }
+    }
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << producerCount << " producer(s): " << received << " items in " << elapsed * 1000 << " ms, "
+        << received / elapsed / 1e6 << " M items/s, " << drains << " drains, " << retries
+        << " full retries, " << (ordered ? "ok" : "FAILED: lost or reordered items");
+    std::cout << out.str() << std::endl;
+    return ordered;
+}
+
+int main(int argc, char** argv) {
+    unsigned long items = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 2000000;
+    size_t capacity = argc > 2 ? std::strtoul(argv[2], NULL, 10) : MAILBOX_DEFAULT_CAPACITY;
+    if (items == 0 || capacity < 2) {
+        std::cerr << "Usage: " << argv[0] << " [items-per-producer] [capacity]" << std::endl;
+        return 1;
+    }
+
+    std::cout << items << " items per producer, capacity " << Mailbox(capacity).getCapacity() << std::endl;
+    bool ok = true;
+    for (size_t producers = 1; producers <= STRESS_MAX_PRODUCERS; producers *= 2) {
+        ok = run(producers, items, capacity) && ok;
+    }
+    return ok ? 0 : 1;
+}
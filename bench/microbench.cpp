@@ -0,0 +1,466 @@
+// In-process microbenchmarks for the server hot paths.
+//
+// Links the server objects and times the parser, reply formatting, channel
+// fan-out, NAMES list building, registry snapshots, the channel state file
+// and nickname lookup. Every benchmark reports
+// ns/op and heap allocations/op (the objects are built with AllocTrace), and
+// the results are printed as JSON so runs can be diffed across versions.
+// Channel fan-out runs serially and, for large channels, split across
+// IRCSERV_FANOUT_THREADS workers (default 3). Allocations made by worker
+// threads are not counted.
+//
+//   ./bench/microbench [name-filter] [min-seconds]
+
+#include "fixtures.hpp"
+
+#define BROADCAST_BATCH 16
+#define BENCH_FANOUT_THREADS 3
+#define BENCH_FANOUT_SLICE 256
+#define SNAPSHOT_BENCH_MEMBERS 10
+#define STATE_BENCH_CHANNELS 100000
+
+// Harness -------------------------------------------------------------------
+
+static long long nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Measures elapsed time and allocations; benchmarks pause it around set-up
+// work that must not be charged to the operation (e.g. flushing queued output).
+class Stopwatch {
+private:
+    long long started;
+    unsigned long allocsAtStart;
+    unsigned long bytesAtStart;
+
+public:
+    long long nanos;
+    unsigned long allocs;
+    unsigned long bytes;
+
+    Stopwatch() : started(0), allocsAtStart(0), bytesAtStart(0), nanos(0), allocs(0), bytes(0) {}
+
+    void start() {
+        AllocCounters counters = AllocTrace::threadCounters();
+        allocsAtStart = counters.allocs;
+        bytesAtStart = counters.bytes;
+        started = nowNanos();
+    }
+
+    void stop() {
+        nanos += nowNanos() - started;
+        AllocCounters counters = AllocTrace::threadCounters();
+        allocs += counters.allocs - allocsAtStart;
+        bytes += counters.bytes - bytesAtStart;
+    }
+};
+
+class Benchmark {
+public:
+    virtual ~Benchmark() {}
+    virtual std::string name() const = 0;
+    virtual void run(unsigned long iterations, Stopwatch& watch) = 0;
+};
+
+struct Result {
+    std::string name;
+    unsigned long iterations;
+    double nsPerOp;
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+static volatile size_t sink = 0;
+
+static Result measure(Benchmark& bench, double minSeconds) {
+    Stopwatch warmup;
+    bench.run(1, warmup);
+
+    unsigned long iterations = 1;
+    for (;;) {
+        Stopwatch watch;
+        bench.run(iterations, watch);
+        if (watch.nanos >= minSeconds * 1e9 || iterations >= 1000000000UL) {
+            Result result;
+            result.name = bench.name();
+            result.iterations = iterations;
+            result.nsPerOp = static_cast<double>(watch.nanos) / iterations;
+            result.allocsPerOp = static_cast<double>(watch.allocs) / iterations;
+            result.bytesPerOp = static_cast<double>(watch.bytes) / iterations;
+            return result;
+        }
+        double scale = watch.nanos > 0 ? minSeconds * 1e9 / watch.nanos * 1.2 : 100;
+        iterations = static_cast<unsigned long>(iterations * std::min(std::max(scale, 2.0), 100.0));
+    }
+}
+
+// Fixtures ------------------------------------------------------------------
+
+static const std::string privmsgLine = "PRIVMSG #general :hello everyone, this is a typical chat line";
+static const std::string relayedLine = ":Nick1!user1@127.0.0.1 PRIVMSG #general :hello everyone, this is a typical chat line";
+
+// Benchmarks ----------------------------------------------------------------
+
+class ParseMessageBench : public Benchmark {
+private:
+    Server& server;
+
+public:
+    ParseMessageBench(Server& server) : server(server) {}
+    std::string name() const { return "parse/parseMessage"; }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            sink += server.parseMessage(privmsgLine).size();
+        }
+        watch.stop();
+    }
+};
+
+class SplitCommandBench : public Benchmark {
+public:
+    std::string name() const { return "parse/splitCommand"; }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        std::string line = privmsgLine + CRLF;
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            sink += Utils::splitCommand(line).size();
+        }
+        watch.stop();
+    }
+};
+
+class FormatReplyBench : public Benchmark {
+private:
+    Client* client;
+
+public:
+    FormatReplyBench(Client* client) : client(client) {}
+    std::string name() const { return "reply/formatReply"; }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            sink += client->formatReply(relayedLine).size();
+        }
+        watch.stop();
+    }
+};
+
+class ChannelFixture {
+protected:
+    SimTransport& transport;
+    Channel channel;
+    std::vector<Client*> members;
+
+public:
+    ChannelFixture(SimTransport& transport, size_t count) : transport(transport), channel("#general", NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            members.push_back(makeClient(transport, i));
+            channel.addMember(members.back());
+        }
+        channel.addOperator(members.front()->getFd());
+    }
+
+    virtual ~ChannelFixture() {
+        for (size_t i = 0; i < members.size(); ++i) {
+            channel.removeMember(members[i]);
+            delete members[i];
+        }
+    }
+
+    void drain() {
+        drainClients(transport, members);
+    }
+};
+
+class BroadcastBench : public Benchmark, private ChannelFixture {
+private:
+    size_t threads;
+
+public:
+    BroadcastBench(SimTransport& transport, size_t count, size_t threads)
+        : ChannelFixture(transport, count), threads(threads) {}
+    std::string name() const {
+        if (threads == 0) {
+            return numbered("channel/broadcast/", members.size());
+        }
+        return numbered(numbered("channel/broadcast-", threads) + "threads/", members.size());
+    }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        FanoutPool::instance().configure(threads, 0, BENCH_FANOUT_SLICE);
+        for (unsigned long done = 0; done < iterations;) {
+            unsigned long batch = std::min<unsigned long>(BROADCAST_BATCH, iterations - done);
+            watch.start();
+            for (unsigned long i = 0; i < batch; ++i) {
+                channel.broadcast(relayedLine, members.front());
+            }
+            watch.stop();
+            drain();
+            done += batch;
+        }
+    }
+};
+
+class MemberListBench : public Benchmark, private ChannelFixture {
+public:
+    MemberListBench(SimTransport& transport, size_t count) : ChannelFixture(transport, count) {}
+    std::string name() const { return numbered("channel/getMemberList/", members.size()); }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            sink += channel.getMemberList().size();
+        }
+        watch.stop();
+    }
+};
+
+// One channel changes between snapshots, as under JOIN/PART traffic, so
+// each acquire builds a new snapshot that reuses every other channel view.
+class SnapshotBench : public Benchmark {
+private:
+    std::vector<Client*> members;
+    std::map<int, Client*> clients;
+    std::map<std::string, Channel*> channels;
+    SnapshotCache cache;
+
+public:
+    SnapshotBench(SimTransport& transport, size_t count) {
+        for (size_t i = 0; i < SNAPSHOT_BENCH_MEMBERS; ++i) {
+            members.push_back(makeClient(transport, i));
+            clients[members.back()->getFd()] = members.back();
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Channel* channel = new Channel(numbered("#channel", i), NULL);
+            for (size_t j = 0; j < members.size(); ++j) {
+                channel->addMember(members[j]);
+            }
+            channels[channel->getName()] = channel;
+        }
+        cache.acquire(channels, clients)->release();
+    }
+
+    ~SnapshotBench() {
+        for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+            delete it->second;
+        }
+        for (size_t i = 0; i < members.size(); ++i) {
+            delete members[i];
+        }
+    }
+
+    std::string name() const { return numbered("registry/snapshot-after-change/", channels.size()); }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        std::map<std::string, Channel*>::iterator changed = channels.begin();
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            changed->second->touch();
+            RegistrySnapshot* snapshot = cache.acquire(channels, clients);
+            sink += snapshot->size();
+            snapshot->release();
+            if (++changed == channels.end()) {
+                changed = channels.begin();
+            }
+        }
+        watch.stop();
+    }
+};
+
+// Writes the channel state file, as the forked writer does, or loads it as
+// a restart does. Channels carry a topic, a key and one operator. The file
+// lives in $TMPDIR (default /tmp).
+class StateFileBench : public Benchmark {
+private:
+    bool loading;
+    Client* op;
+    std::map<std::string, Channel*> channels;
+    std::string path;
+
+public:
+    StateFileBench(SimTransport& transport, size_t count, bool loading) : loading(loading) {
+        const char* tmp = getenv("TMPDIR");
+        path = std::string(tmp && *tmp ? tmp : "/tmp") + (loading ? "/ircserv-microbench-load.state" : "/ircserv-microbench-save.state");
+        op = makeClient(transport, 0);
+        for (size_t i = 0; i < count; ++i) {
+            Channel* channel = new Channel(numbered("#channel", i), NULL);
+            channel->addMember(op);
+            channel->setTopic(numbered("Topic of channel ", i), op);
+            channel->setKey("sesame");
+            channels[channel->getName()] = channel;
+        }
+        ChannelStore(path).save(channels);
+    }
+
+    ~StateFileBench() {
+        for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+            delete it->second;
+        }
+        delete op;
+        unlink(path.c_str());
+    }
+
+    std::string name() const {
+        return numbered(loading ? "state/load/" : "state/save/", channels.size());
+    }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        for (unsigned long i = 0; i < iterations; ++i) {
+            ChannelStore store(path);
+            watch.start();
+            if (loading) {
+                store.load();
+                sink += store.size();
+            } else {
+                sink += store.save(channels);
+            }
+            watch.stop();
+        }
+    }
+};
+
+// Startup with no state file and a change log of four records per channel.
+class WalReplayBench : public Benchmark {
+private:
+    size_t count;
+    std::string path;
+
+public:
+    WalReplayBench(SimTransport& transport, size_t count) : count(count) {
+        const char* tmp = getenv("TMPDIR");
+        path = std::string(tmp && *tmp ? tmp : "/tmp") + "/ircserv-microbench-wal.state";
+        Client* op = makeClient(transport, 0);
+        std::vector<Channel*> channels;
+        {
+            ChannelStore store(path, true);
+            store.load();
+            for (size_t i = 0; i < count; ++i) {
+                Channel* channel = new Channel(numbered("#channel", i), NULL);
+                channel->addMember(op);
+                channel->setTopic(numbered("Topic of channel ", i), op);
+                channel->setKey("sesame");
+                channels.push_back(channel);
+            }
+            store.commitLog();
+        }
+        for (size_t i = 0; i < channels.size(); ++i) {
+            delete channels[i];
+        }
+        delete op;
+    }
+
+    ~WalReplayBench() {
+        unlink((path + ".wal.00000000").c_str());
+        unlink((path + ".wal.00000001").c_str());
+    }
+
+    std::string name() const { return numbered("wal/replay/", count); }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        for (unsigned long i = 0; i < iterations; ++i) {
+            ChannelStore store(path, true);
+            watch.start();
+            store.load();
+            sink += store.size();
+            watch.stop();
+            unlink((path + ".wal.00000001").c_str());
+        }
+    }
+};
+
+class NickLookupBench : public Benchmark {
+private:
+    Server& server;
+    std::vector<Client*> clients;
+    std::vector<std::string> queries;
+
+public:
+    NickLookupBench(Server& server, SimTransport& transport, size_t count) : server(server) {
+        for (size_t i = 0; i < count; ++i) {
+            clients.push_back(makeClient(transport, i));
+            server.setClientNickname(clients.back(), numbered("Nick", i));
+            queries.push_back(numbered("nICK", (i * 7919) % count));
+        }
+    }
+
+    ~NickLookupBench() {
+        for (size_t i = 0; i < clients.size(); ++i) {
+            server.forgetNickname(clients[i]);
+            delete clients[i];
+        }
+    }
+
+    std::string name() const { return numbered("nick/lookup/", clients.size()); }
+    void run(unsigned long iterations, Stopwatch& watch) {
+        watch.start();
+        for (unsigned long i = 0; i < iterations; ++i) {
+            sink += server.getClientByNickname(queries[i % queries.size()]) != NULL;
+        }
+        watch.stop();
+    }
+};
+
+// Driver --------------------------------------------------------------------
+
+static void printJson(std::ostream& os, const std::vector<Result>& results) {
+    os << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        os << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+           << ", \"ns_per_op\": " << r.nsPerOp << ", \"allocs_per_op\": " << r.allocsPerOp
+           << ", \"bytes_per_op\": " << r.bytesPerOp << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    double minSeconds = argc > 2 ? std::atof(argv[2]) : 0.5;
+    if (minSeconds <= 0) {
+        minSeconds = 0.5;
+    }
+
+    std::vector<Result> results;
+    {
+        QuietLogs quiet;
+        Server server("6667", "microbench");
+        SimTransport transport(false);
+        Client* single = makeClient(transport, 0);
+
+        static const size_t sizes[] = { 10, 1000, 10000 };
+        static const size_t fanoutSizes[] = { 1000, 10000, 100000 };
+        size_t threads = std::max<size_t>(1, Utils::envToSize("IRCSERV_FANOUT_THREADS", BENCH_FANOUT_THREADS));
+        std::vector<Benchmark*> benches;
+        benches.push_back(new ParseMessageBench(server));
+        benches.push_back(new SplitCommandBench());
+        benches.push_back(new FormatReplyBench(single));
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            benches.push_back(new BroadcastBench(transport, sizes[i], 0));
+        }
+        benches.push_back(new BroadcastBench(transport, 100000, 0));
+        for (size_t i = 0; i < sizeof(fanoutSizes) / sizeof(fanoutSizes[0]); ++i) {
+            benches.push_back(new BroadcastBench(transport, fanoutSizes[i], threads));
+        }
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            benches.push_back(new MemberListBench(transport, sizes[i]));
+        }
+        for (size_t i = 1; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            benches.push_back(new SnapshotBench(transport, sizes[i]));
+        }
+        benches.push_back(new StateFileBench(transport, STATE_BENCH_CHANNELS, false));
+        benches.push_back(new StateFileBench(transport, STATE_BENCH_CHANNELS, true));
+        benches.push_back(new WalReplayBench(transport, STATE_BENCH_CHANNELS));
+        benches.push_back(new NickLookupBench(server, transport, 10000));
+
+        for (size_t i = 0; i < benches.size(); ++i) {
+            if (benches[i]->name().find(filter) != std::string::npos) {
+                results.push_back(measure(*benches[i], minSeconds));
+            }
+            delete benches[i];
+        }
+        delete single;
+    }
+
+    std::cout.precision(6);
+    std::cout.setf(std::ios::fixed);
+    printJson(std::cout, results);
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Connection-churn benchmark: slab pools against the global allocator.
+//
+// Mimics clients connecting and leaving: Client-, Channel- and membership
+// node-sized objects are allocated and freed at random while variable-sized
+// buffers come and go around them. Each allocator runs in its own child
+// process so the reported RSS growth is not shared.
+//
+//   ./bench/pool_churn [operations] [live-objects]
+
+#include "Pool.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define CLIENT_SIZE 64
+#define CHANNEL_SIZE 336
+#define NODE_SIZE 48
+
+struct Slot {
+    void* object;
+    int kind;
+    char* buffer;
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0;
+    long resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static const size_t kindSizes[] = { CLIENT_SIZE, CHANNEL_SIZE, NODE_SIZE };
+
+static void run(bool usePools, unsigned long operations, size_t liveObjects) {
+    SlabPool clientPool("client", CLIENT_SIZE, POOL_CACHE_LINE);
+    SlabPool channelPool("channel", CHANNEL_SIZE, POOL_CACHE_LINE);
+    SlabPool nodePool("membership", NODE_SIZE, sizeof(void*));
+    SlabPool* pools[] = { &clientPool, &channelPool, &nodePool };
+
+    std::vector<Slot> slots(liveObjects);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        slots[i].object = NULL;
+        slots[i].buffer = NULL;
+    }
+    srand(42);
+    long rssBefore = residentBytes();
+    double start = nowSeconds();
+
+    for (unsigned long op = 0; op < operations; ++op) {
+        Slot& slot = slots[static_cast<size_t>(rand()) % slots.size()];
+        if (slot.object) {
+            if (usePools) {
+                pools[slot.kind]->deallocate(slot.object);
+            } else {
+                ::operator delete(slot.object);
+            }
+            delete[] slot.buffer;
+            slot.object = NULL;
+            slot.buffer = NULL;
+        } else {
+            int roll = rand() % 100;
+            slot.kind = roll < 60 ? 2 : (roll < 95 ? 0 : 1);
+            if (usePools) {
+                slot.object = pools[slot.kind]->allocate();
+            } else {
+                slot.object = ::operator new(kindSizes[slot.kind]);
+            }
+            if (slot.kind == 0) {
+                slot.buffer = new char[16 + rand() % 1024];
+            }
+        }
+    }
+
+    double elapsed = nowSeconds() - start;
+    long rssAfter = residentBytes();
+    std::cout << (usePools ? "slab pools     " : "global new     ")
+              << (elapsed * 1e9 / operations) << " ns/op, RSS growth "
+              << (rssAfter - rssBefore) / 1024 << " KiB" << std::endl;
+
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i].object) {
+            if (usePools) {
+                pools[slots[i].kind]->deallocate(slots[i].object);
+            } else {
+                ::operator delete(slots[i].object);
+            }
+            delete[] slots[i].buffer;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned long operations = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 20000000;
+    size_t liveObjects = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 200000;
+    if (operations == 0 || liveObjects == 0) {
+        std::cerr << "Usage: " << argv[0] << " [operations] [live-objects]" << std::endl;
+        return 1;
+    }
+
+    std::cout << operations << " operations over " << liveObjects << " live slots" << std::endl;
+    for (int mode = 0; mode < 2; ++mode) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(mode == 1, operations, liveObjects);
+            return 0;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
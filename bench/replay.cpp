@@ -0,0 +1,347 @@
+// Replays a traffic capture (IRCSERV_CAPTURE) against a running server.
+//
+// Every captured connection is re-opened, its inbound bytes are re-sent in
+// the captured chunks and closed where the original client disconnected.
+// By default records are paced by their original timestamps (optionally
+// scaled with -s); -f sends everything as fast as the server accepts it.
+// Server output is read and discarded.
+//
+//   ./bench/replay -p <port> [-h host] [-f | -s <speed>] <capture-file>
+
+#include "Includes.hpp"
+#include <fstream>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+#define CONNECTIONS_PER_SOURCE 30000
+#define DRAIN_US 1000000
+
+struct Record {
+    int event;
+    unsigned int id;
+    long long timestampUs;
+    std::string payload;
+};
+
+struct Connection {
+    int fd;
+    bool connected;
+    bool closing;
+    std::string out;
+};
+
+static long long nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static unsigned long long getLittleEndian(const unsigned char* in, size_t bytes) {
+    unsigned long long value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<unsigned long long>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+class CaptureReader {
+private:
+    std::ifstream in;
+
+public:
+    CaptureReader(const char* path) : in(path, std::ios::binary) {}
+
+    bool open() {
+        char magic[CAPTURE_MAGIC_LENGTH];
+        return in.read(magic, sizeof(magic)) && std::memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool next(Record& record) {
+        unsigned char header[CAPTURE_RECORD_HEADER];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            return false;
+        }
+        record.event = header[0];
+        record.id = static_cast<unsigned int>(getLittleEndian(header + 1, 4));
+        record.timestampUs = static_cast<long long>(getLittleEndian(header + 5, 8));
+        record.payload.resize(static_cast<size_t>(getLittleEndian(header + 13, 4)));
+        return record.payload.empty() || in.read(&record.payload[0], record.payload.size());
+    }
+};
+
+class Replayer {
+private:
+    struct sockaddr_in server;
+    int epfd;
+    std::map<unsigned int, Connection> connections;
+    unsigned long opened;
+    unsigned long failed;
+    unsigned long long bytesOut;
+    unsigned long long bytesIn;
+
+    void watch(int fd, unsigned int id, bool wantWrite, int op) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        if (wantWrite) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.u64 = id;
+        epoll_ctl(epfd, op, fd, &ev);
+    }
+
+    void closeConnection(unsigned int id) {
+        std::map<unsigned int, Connection>::iterator it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        epoll_ctl(epfd, EPOLL_CTL_DEL, it->second.fd, NULL);
+        close(it->second.fd);
+        connections.erase(it);
+    }
+
+    void flush(unsigned int id) {
+        Connection& conn = connections[id];
+        while (conn.connected && !conn.out.empty()) {
+            ssize_t n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(conn.fd, id, true, EPOLL_CTL_MOD);
+                    return;
+                }
+                ++failed;
+                closeConnection(id);
+                return;
+            }
+            bytesOut += n;
+            conn.out.erase(0, n);
+        }
+        if (!conn.connected) {
+            return;
+        }
+        if (conn.closing) {
+            closeConnection(id);
+        } else {
+            watch(conn.fd, id, false, EPOLL_CTL_MOD);
+        }
+    }
+
+    void onConnect(unsigned int id) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            ++failed;
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (ntohl(server.sin_addr.s_addr) >> 24 == 127) {
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+            struct sockaddr_in source;
+            std::memset(&source, 0, sizeof(source));
+            source.sin_family = AF_INET;
+            source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + static_cast<in_addr_t>(opened / CONNECTIONS_PER_SOURCE));
+            bind(fd, reinterpret_cast<struct sockaddr*>(&source), sizeof(source));
+        }
+        if (::connect(fd, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            ++failed;
+            return;
+        }
+        Connection conn;
+        conn.fd = fd;
+        conn.connected = false;
+        conn.closing = false;
+        connections[id] = conn;
+        watch(fd, id, true, EPOLL_CTL_ADD);
+        ++opened;
+    }
+
+    void onData(unsigned int id, const std::string& payload) {
+        std::map<unsigned int, Connection>::iterator it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        bool wasEmpty = it->second.out.empty();
+        it->second.out += payload;
+        if (wasEmpty) {
+            flush(id);
+        }
+    }
+
+    void onDisconnect(unsigned int id) {
+        std::map<unsigned int, Connection>::iterator it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        it->second.closing = true;
+        if (it->second.connected && it->second.out.empty()) {
+            closeConnection(id);
+        }
+    }
+
+public:
+    Replayer(const struct sockaddr_in& address)
+        : server(address), epfd(epoll_create1(0)), opened(0), failed(0), bytesOut(0), bytesIn(0) {}
+
+    ~Replayer() {
+        while (!connections.empty()) {
+            closeConnection(connections.begin()->first);
+        }
+        close(epfd);
+    }
+
+    void apply(const Record& record) {
+        switch (record.event) {
+            case CAPTURE_CONNECT: onConnect(record.id); break;
+            case CAPTURE_DATA: onData(record.id, record.payload); break;
+            case CAPTURE_DISCONNECT: onDisconnect(record.id); break;
+            default: break;
+        }
+    }
+
+    void poll(int timeoutMs) {
+        struct epoll_event events[1024];
+        char buffer[65536];
+        int nfds = epoll_wait(epfd, events, 1024, timeoutMs);
+        for (int i = 0; i < nfds; ++i) {
+            unsigned int id = static_cast<unsigned int>(events[i].data.u64);
+            std::map<unsigned int, Connection>::iterator it = connections.find(id);
+            if (it == connections.end()) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!it->second.connected) {
+                    int error = 0;
+                    socklen_t len = sizeof(error);
+                    getsockopt(it->second.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                    if (error) {
+                        ++failed;
+                        closeConnection(id);
+                        continue;
+                    }
+                    it->second.connected = true;
+                }
+                flush(id);
+                it = connections.find(id);
+                if (it == connections.end()) {
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t n;
+                while ((n = recv(it->second.fd, buffer, sizeof(buffer), 0)) > 0) {
+                    bytesIn += n;
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    closeConnection(id);
+                }
+            }
+        }
+    }
+
+    bool hasPendingOutput() const {
+        for (std::map<unsigned int, Connection>::const_iterator it = connections.begin(); it != connections.end(); ++it) {
+            if (!it->second.connected || !it->second.out.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned long getOpened() const { return opened; }
+    unsigned long getFailed() const { return failed; }
+    unsigned long long getBytesOut() const { return bytesOut; }
+    unsigned long long getBytesIn() const { return bytesIn; }
+};
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " -p <port> [-h host] [-f | -s <speed>] <capture-file>\n"
+              << "  -f          send as fast as possible, ignoring the captured pacing\n"
+              << "  -s <speed>  scale the captured pacing (2 = twice as fast, default 1)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1";
+    int port = 0;
+    double speed = 1.0;
+    bool fast = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:f")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = std::atoi(optarg); break;
+            case 's': speed = std::atof(optarg); break;
+            case 'f': fast = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || port <= 0 || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CaptureReader reader(argv[optind]);
+    if (!reader.open()) {
+        std::cerr << argv[optind] << ": not an ircserv capture file" << std::endl;
+        return 1;
+    }
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        std::cerr << "Invalid host: " << host << std::endl;
+        return 1;
+    }
+
+    Replayer replayer(address);
+    Record record;
+    unsigned long records = 0;
+    long long capturedUs = 0;
+    long long maxLagUs = 0;
+    long long start = nowMicros();
+    while (reader.next(record)) {
+        if (!fast) {
+            long long due = start + static_cast<long long>(record.timestampUs / speed);
+            long long now;
+            while ((now = nowMicros()) < due) {
+                replayer.poll(static_cast<int>(std::min<long long>((due - now + 999) / 1000, 100)));
+            }
+            maxLagUs = std::max(maxLagUs, now - due);
+        } else {
+            replayer.poll(0);
+        }
+        replayer.apply(record);
+        capturedUs = record.timestampUs;
+        ++records;
+    }
+    while (replayer.hasPendingOutput()) {
+        replayer.poll(10);
+    }
+    long long sent = nowMicros();
+    while (nowMicros() - sent < DRAIN_US) {
+        replayer.poll(10);
+    }
+
+    double elapsed = (sent - start) / 1e6;
+    std::cout << "records:      " << records << " (" << replayer.getOpened() << " connections, "
+              << replayer.getFailed() << " failed)\n"
+              << "captured:     " << capturedUs / 1e6 << " s\n"
+              << "replayed:     " << elapsed << " s (" << (elapsed > 0 ? capturedUs / 1e6 / elapsed : 0) << "x)\n"
+              << "sent:         " << replayer.getBytesOut() << " bytes\n"
+              << "received:     " << replayer.getBytesIn() << " bytes" << std::endl;
+    if (!fast) {
+        std::cout << "max lag:      " << maxLagUs << " us behind the captured schedule" << std::endl;
+    }
+    return replayer.getFailed() ? 1 : 0;
+}
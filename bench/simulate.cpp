@@ -0,0 +1,190 @@
+// Scale simulation of the protocol core on the in-memory transport.
+//
+// Drives the real Server through a SimTransport: N virtual clients connect
+// and register, join channels, talk, and quit, without opening a socket.
+// Each phase runs the event loop until the transport goes idle and reports
+// wall time, loop ticks and bytes written, followed by the profiler totals,
+// so the cost of the command logic can be studied at sizes a real network
+// test cannot reach.
+//
+//   ./bench/simulate [-c clients] [-j channels] [-m messages-per-client]
+
+#include "fixtures.hpp"
+#include <sys/resource.h>
+
+#define SIM_PASSWORD "simulate"
+
+struct SimOptions {
+    size_t clients;
+    size_t channels;
+    size_t messages;
+};
+
+static void usage(const char* program) {
+    std::cerr << "usage: " << program << " [-c clients] [-j channels] [-m messages-per-client]" << std::endl;
+    std::exit(2);
+}
+
+static size_t parseCount(const char* value, const char* program) {
+    char* end = NULL;
+    unsigned long parsed = std::strtoul(value, &end, 10);
+    if (!end || *end != '\0') {
+        usage(program);
+    }
+    return static_cast<size_t>(parsed);
+}
+
+static SimOptions parseOptions(int argc, char** argv) {
+    SimOptions options;
+    options.clients = 100000;
+    options.channels = 1000;
+    options.messages = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:j:m:")) != -1) {
+        switch (opt) {
+            case 'c': options.clients = parseCount(optarg, argv[0]); break;
+            case 'j': options.channels = parseCount(optarg, argv[0]); break;
+            case 'm': options.messages = parseCount(optarg, argv[0]); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (options.clients == 0 || options.channels == 0) {
+        usage(argv[0]);
+    }
+    return options;
+}
+
+static long maxRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+class Simulation {
+private:
+    Server& server;
+    SimTransport& transport;
+    std::vector<int> handles;
+    std::ostream& out;
+
+    unsigned long long totalBytesWritten() const {
+        unsigned long long total = 0;
+        for (size_t i = 0; i < handles.size(); ++i) {
+            total += transport.getBytesWritten(handles[i]);
+        }
+        return total;
+    }
+
+    // Ticks the loop until nothing is left to accept, read, run or write.
+    unsigned long runUntilIdle() {
+        unsigned long ticks = 0;
+        while (transport.hasActivity() || server.hasPendingWork()) {
+            server.runOnce(0);
+            ++ticks;
+        }
+        return ticks;
+    }
+
+    void report(const std::string& phase, long long startedUs, unsigned long ticks,
+                unsigned long long bytesBefore) {
+        long long elapsedUs = Utils::nowMicros() - startedUs;
+        double seconds = static_cast<double>(elapsedUs) / 1e6;
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "%-9s %9.3f s %10lu ticks %12.0f clients/s %14llu bytes out %9zu connected %8ld KiB maxrss",
+                      phase.c_str(), seconds, ticks,
+                      seconds > 0 ? static_cast<double>(handles.size()) / seconds : 0.0,
+                      totalBytesWritten() - bytesBefore, server.getClients().size(), maxRssKb());
+        out << line << std::endl;
+    }
+
+    template <typename Feed>
+    void phase(const std::string& name, Feed feed) {
+        unsigned long long bytesBefore = totalBytesWritten();
+        long long started = Utils::nowMicros();
+        for (size_t i = 0; i < handles.size(); ++i) {
+            feed(*this, i);
+        }
+        unsigned long ticks = runUntilIdle();
+        report(name, started, ticks, bytesBefore);
+    }
+
+public:
+    size_t channels;
+    size_t messages;
+
+    Simulation(Server& server, SimTransport& transport, std::ostream& out, const SimOptions& options)
+        : server(server), transport(transport), out(out), channels(options.channels),
+          messages(options.messages) {
+        handles.reserve(options.clients);
+    }
+
+    void send(size_t index, const std::string& data) { transport.send(handles[index], data); }
+
+    static std::string channelOf(const Simulation& sim, size_t index) {
+        return numbered("#sim", index % sim.channels);
+    }
+
+    static void registerClient(Simulation& sim, size_t index) {
+        sim.send(index, "PASS " SIM_PASSWORD "\r\nNICK " + numbered("sim", index) +
+                            "\r\nUSER u 0 * :Simulated client\r\n");
+    }
+
+    static void joinChannel(Simulation& sim, size_t index) {
+        sim.send(index, "JOIN " + channelOf(sim, index) + "\r\n");
+    }
+
+    static void talk(Simulation& sim, size_t index) {
+        std::string lines;
+        for (size_t m = 0; m < sim.messages; ++m) {
+            lines += "PRIVMSG " + channelOf(sim, index) + " :simulated traffic\r\n";
+        }
+        sim.send(index, lines);
+    }
+
+    static void quit(Simulation& sim, size_t index) {
+        sim.send(index, "QUIT :done\r\n");
+    }
+
+    void connect(size_t count) {
+        long long started = Utils::nowMicros();
+        for (size_t i = 0; i < count; ++i) {
+            handles.push_back(transport.connect(htonl(INADDR_LOOPBACK)));
+        }
+        unsigned long ticks = runUntilIdle();
+        report("connect", started, ticks, 0);
+    }
+
+    void run() {
+        phase("register", registerClient);
+        phase("join", joinChannel);
+        phase("privmsg", talk);
+        phase("quit", quit);
+    }
+};
+
+int main(int argc, char** argv) {
+    SimOptions options = parseOptions(argc, argv);
+    // Measure the command logic, not flood control delays; every virtual
+    // client shares the loopback address.
+    setenv("IRCSERV_FLOOD_RATE", "0", 0);
+    setenv("IRCSERV_MAX_PER_IP", "0", 0);
+    SimTransport transport(false);
+    TickWindow totals;
+    {
+        QuietLogs quiet;
+        std::ostream out(quiet.stdoutBuffer());
+        Server server("6667", SIM_PASSWORD);
+        server.serverInit(transport);
+
+        out << "simulating " << options.clients << " clients, " << options.channels << " channels, "
+            << options.messages << " message(s) per client" << std::endl;
+        Simulation sim(server, transport, out, options);
+        sim.connect(options.clients);
+        sim.run();
+        totals = server.getProfiler().getTotals();
+    }
+    std::cout << TickProfiler::formatWindow(totals, "totals") << std::endl;
+    return 0;
+}
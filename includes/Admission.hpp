@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define ADMISSION_DEFAULT_MAX_PER_IP 256
+#define ADMISSION_DEFAULT_ACCEPT_RATE 0
+#define ADMISSION_DEFAULT_ACCEPT_BURST 100
+
+class MetricsWriter;
+
+enum AdmissionVerdict {
+    ADMIT_OK,
+    ADMIT_PER_IP,
+    ADMIT_RATE,
+    ADMIT_FD_LIMIT,
+    ADMIT_VERDICT_COUNT
+};
+
+// Decides, right after accept(), whether a connection may become a Client.
+// Live connections are counted per source address and new ones are paced by
+// a global token bucket (kept as a clock, like FloodControl). The listener
+// is IPv4-only, so the key is the full address; an IPv6 listener would key
+// on the /64 prefix instead, since one host usually owns the whole /64.
+class AdmissionControl {
+private:
+    std::map<in_addr_t, unsigned int> perAddress;
+    size_t maxPerAddress;
+    long long usPerAccept;
+    long long burstUs;
+    long long acceptClock;
+    unsigned long long admitted;
+    unsigned long long rejected[ADMIT_VERDICT_COUNT];
+
+    AdmissionControl(const AdmissionControl& other);
+    AdmissionControl& operator=(const AdmissionControl& other);
+
+public:
+    AdmissionControl();
+    ~AdmissionControl();
+
+    AdmissionVerdict admit(in_addr_t address, long long nowUs);
+    void release(in_addr_t address);
+    void adopt(in_addr_t address);
+    void reject(AdmissionVerdict verdict);
+
+    size_t getConnectionCount(in_addr_t address) const;
+    static const char* verdictName(AdmissionVerdict verdict);
+    void appendMetrics(MetricsWriter& writer) const;
+};
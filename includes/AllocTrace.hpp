@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Includes.hpp"
+
+class MetricsWriter;
+
+struct AllocCounters {
+    unsigned long allocs;
+    unsigned long bytes;
+};
+
+struct AllocScopeStats {
+    unsigned long calls;
+    unsigned long allocs;
+    unsigned long bytes;
+    unsigned long maxAllocs;
+};
+
+// Heap allocation counting for hot-path regression checks. Only compiled in
+// with -DIRCSERV_ALLOC_TRACE (make ALLOC_TRACE=1): global operator new/delete
+// are then replaced to bump per-thread counters, and each AllocScope charges
+// the allocations made while it is alive to its name. Scopes nest and are
+// inclusive, so "command/PRIVMSG" also contains its "broadcast".
+class AllocTrace {
+private:
+    AllocTrace();
+    AllocTrace(const AllocTrace& other);
+    AllocTrace& operator=(const AllocTrace& other);
+    ~AllocTrace();
+
+public:
+    static bool enabled();
+    static AllocCounters threadCounters();
+    static void record(const char* name, const std::string* detail, const AllocCounters& used);
+    static std::map<std::string, AllocScopeStats> snapshot();
+    static void reset();
+    static void appendMetrics(MetricsWriter& writer);
+};
+
+class AllocScope {
+private:
+#ifdef IRCSERV_ALLOC_TRACE
+    const char* name;
+    const std::string* detail;
+    AllocCounters start;
+#endif
+
+    AllocScope(const AllocScope& other);
+    AllocScope& operator=(const AllocScope& other);
+
+public:
+#ifdef IRCSERV_ALLOC_TRACE
+    AllocScope(const char* name, const std::string* detail = NULL);
+    ~AllocScope();
+#else
+    AllocScope(const char*, const std::string* = NULL) {}
+#endif
+};
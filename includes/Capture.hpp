@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Includes.hpp"
+#include <cstdio>
+
+#define CAPTURE_MAGIC "IRCCAP1\n"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_RECORD_HEADER 17
+#define CAPTURE_DEFAULT_MAX_BYTES 1073741824ULL
+#define CAPTURE_FLUSH_INTERVAL_US 1000000
+
+class MetricsWriter;
+
+enum CaptureEvent {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_DATA = 2,
+    CAPTURE_DISCONNECT = 3
+};
+
+// Records inbound traffic for offline replay (bench/replay). Enabled by
+// IRCSERV_CAPTURE=<file>. The file starts with CAPTURE_MAGIC, followed by
+// records of: u8 event, u32 connection id, u64 microseconds since capture
+// start, u32 payload length (all little endian) and the payload. CONNECT
+// carries the IPv4 address, DATA the bytes exactly as read from the socket.
+// Connection ids are never reused, unlike fds.
+class TrafficCapture {
+private:
+    FILE* file;
+    long long startUs;
+    long long lastFlushUs;
+    unsigned int nextId;
+    std::map<int, unsigned int> connections;
+    unsigned long long bytesWritten;
+    unsigned long long maxBytes;
+    unsigned long records;
+
+    TrafficCapture(const TrafficCapture& other);
+    TrafficCapture& operator=(const TrafficCapture& other);
+
+    void write(CaptureEvent event, unsigned int id, const char* data, size_t length);
+
+public:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    bool isActive() const;
+    void connect(int fd, in_addr_t address);
+    void data(int fd, const char* data, size_t length);
+    void disconnect(int fd);
+    void tick();
+    void stop(const std::string& reason);
+    void appendMetrics(MetricsWriter& writer) const;
+};
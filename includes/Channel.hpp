@@ -4,10 +4,20 @@
 #include "Client.hpp"
 #include "Utils.hpp"
 #include "Logger.hpp"
+#include "Pool.hpp"
 
 #define MAX_MESSAGE_LENGTH 512
 
 class Client;
+class ChannelView;
+class StateWriter;
+class StateReader;
+class StateFileWriter;
+struct ChannelRecord;
+
+typedef std::map<int, Client*, std::less<int>,
+                 PoolAllocator<std::pair<const int, Client*>, MembershipPoolTag> > MemberMap;
+typedef std::set<int, std::less<int>, PoolAllocator<int, MembershipPoolTag> > OperatorSet;
 
 class Channel {
 private:
@@ -18,9 +28,10 @@ private:
     std::string topicSetter;
     time_t topicTime;
 
-    std::map<int, Client*> members;
-    std::set<int> operators;
+    MemberMap members;
+    OperatorSet operators;
     std::vector<int> inviteList;
+    std::vector<std::string> savedOperators;
 
     bool inviteOnly;
     bool topicRestricted;
@@ -30,10 +41,22 @@ private:
 
     std::string createdTime;
 
+    size_t accountedStrings;
+    size_t accountedMembership;
+    size_t accountedInvites;
+
+    ChannelView* view;
+    bool joined;
+
+    void syncMemory();
+
 public:
     Channel(const std::string& channelName, Client* creator);
     ~Channel();
 
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+
     const std::string& getName() const;
     const std::string& getTopic() const;
     const std::string& getKey() const;
@@ -46,10 +69,12 @@ public:
     bool getKeyProtected() const;
     size_t getMemberCount() const;
     bool getSecret() const;
+    const std::string& getCreatedTime() const;
 
     bool isMember(Client* client) const;
     bool isOperator(Client* client) const;
     bool isInvited(int fd) const;
+    bool isSavedOperator(const std::string& nickname) const;
 
     void setTopic(const std::string& newTopic, Client* setter);
     void setKey(const std::string& newKey);
@@ -68,6 +93,17 @@ public:
     void removeOperator(int fd);
 
     void broadcast(const std::string& message, Client* sender);
+    size_t deliverOnce(const std::string& formatted, unsigned long generation);
 
     std::string getMemberList() const;
+    void touch();
+    void memberRenamed(Client* client, const std::string& oldNickname);
+    ChannelView* getView();
+    void markMembers(std::vector<bool>& onChannel) const;
+
+    void saveState(StateWriter& writer) const;
+    static Channel* restoreState(StateReader& reader, const std::map<int, Client*>& byOldFd);
+    void putOperators(StateFileWriter& writer) const;
+    void toRecord(ChannelRecord& record) const;
+    void restoreRecord(const ChannelRecord& record);
 };
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "WriteAheadLog.hpp"
+#include <sys/types.h>
+
+#define STATE_MAGIC "IRCSTAT2"
+#define STATE_MAGIC_V1 "IRCSTAT1"
+#define STATE_MAGIC_LENGTH 8
+#define STATE_RECORD_CHANNEL 'C'
+#define STATE_RECORD_END 'E'
+#define STATE_DEFAULT_INTERVAL 60
+#define STATE_BUFFER_SIZE 65536
+#define STATE_POLL_INTERVAL_MS 1000
+#define STATE_FLAG_INVITE_ONLY 1
+#define STATE_FLAG_TOPIC_RESTRICTED 2
+#define STATE_FLAG_LIMITED 4
+#define STATE_FLAG_SECRET 8
+
+class Channel;
+class MetricsWriter;
+
+// The part of a channel that outlives its members: what a snapshot keeps
+// and a restart brings back. Operators are kept by nickname.
+struct ChannelRecord {
+    std::string name;
+    std::string topic;
+    std::string topicSetter;
+    time_t topicTime;
+    std::string key;
+    std::string createdTime;
+    size_t limit;
+    bool inviteOnly;
+    bool topicRestricted;
+    bool limited;
+    bool secret;
+    std::vector<std::string> operators;
+
+    ChannelRecord();
+};
+
+// Writes a state file through a fixed buffer with plain write() calls. It
+// never allocates, so a forked child can use it while another thread of
+// the parent held the allocator lock at fork time.
+class StateFileWriter {
+private:
+    int fd;
+    size_t used;
+    unsigned long long written;
+    unsigned long long checksum;
+    bool failed;
+    char buffer[STATE_BUFFER_SIZE];
+
+    StateFileWriter(const StateFileWriter& other);
+    StateFileWriter& operator=(const StateFileWriter& other);
+
+    void putBytes(const char* data, size_t length);
+
+public:
+    explicit StateFileWriter(int fd);
+
+    void putByte(unsigned char value);
+    void putNumber(unsigned long long value, size_t bytes);
+    void putString(const std::string& value);
+    void putString(const char* data, size_t length);
+    void putChecksum();
+    bool finish();
+    unsigned long long getWritten() const;
+};
+
+// Reads what StateFileWriter (or the change log) wrote; throws if the data
+// ends early.
+class StateFileReader {
+private:
+    const std::string& data;
+    size_t pos;
+
+    void need(size_t length) const;
+
+public:
+    StateFileReader(const std::string& data, size_t pos);
+
+    unsigned char getByte();
+    unsigned long long getNumber(size_t bytes);
+    void getString(std::string& value);
+    bool atEnd() const;
+};
+
+// Channel metadata on disk, for a restart that does not lose every topic,
+// key and mode. Enabled by IRCSERV_STATE_FILE=<file>. Every
+// IRCSERV_STATE_INTERVAL seconds, if a channel changed, the server forks
+// and the child writes the registry as it was at fork time, copy-on-write,
+// while the parent keeps serving; the parent renames the file into place
+// once the child succeeds. The file starts with STATE_MAGIC, the save time
+// and the first change log segment it does not cover (see WriteAheadLog),
+// then one record per channel and an end record carrying the channel count
+// and an FNV-1a checksum of everything before it (little endian throughout).
+//
+// At startup the records are loaded but no channel is created: a channel
+// comes back when someone joins it. Until one of its saved operators has
+// rejoined, a saved operator gets ops on join and passes +i.
+class ChannelStore {
+private:
+    static unsigned long long changes;
+
+    std::string path;
+    std::string tempPath;
+    long long intervalUs;
+    long long lastSaveUs;
+    unsigned long long savedChanges;
+    unsigned long long writerChanges;
+    pid_t writerPid;
+    long long writerStartUs;
+    unsigned long writerSegment;
+    WriteAheadLog wal;
+    std::map<std::string, ChannelRecord> records;
+
+    unsigned long long saves;
+    unsigned long long failures;
+    long long lastSaveDurationUs;
+    long long lastForkUs;
+    unsigned long long lastSaveBytes;
+    unsigned long long savedBytes;
+    size_t loaded;
+    long long loadDurationUs;
+
+    ChannelStore(const ChannelStore& other);
+    ChannelStore& operator=(const ChannelStore& other);
+
+    bool write(int fd, const std::map<std::string, Channel*>& channels, unsigned long segment,
+               unsigned long long& bytes) const;
+    unsigned long parse(const std::string& data, time_t& savedAt);
+    bool commit();
+    void reapWriter(bool block);
+    void startWriter(const std::map<std::string, Channel*>& channels);
+
+public:
+    ChannelStore();
+    explicit ChannelStore(const std::string& path, bool withLog = false);
+    ~ChannelStore();
+
+    static void noteChange();
+    static void readRecordBody(StateFileReader& reader, ChannelRecord& record);
+
+    bool isEnabled() const;
+    void load();
+    const ChannelRecord* find(const std::string& name) const;
+    void claim(const std::string& name);
+    size_t size() const;
+    void tick(const std::map<std::string, Channel*>& channels);
+    bool save(const std::map<std::string, Channel*>& channels);
+    void commitLog();
+    WriteAheadLog& getLog();
+    const std::map<std::string, ChannelRecord>& getRecords() const;
+    void adopt(std::map<std::string, ChannelRecord>& replica);
+    void appendMetrics(MetricsWriter& writer) const;
+};
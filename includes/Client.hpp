@@ -2,8 +2,16 @@
 
 #include "Includes.hpp"
 
+class Transport;
+class MetricsWriter;
+class StateWriter;
+class StateReader;
+
 #define MAX_MESSAGE_LENGTH 512
 #define MAX_MESSAGE_BODY 510
+#define SENDQ_DEFAULT_REGISTERED 1048576
+#define SENDQ_DEFAULT_UNREGISTERED 65536
+#define SENDQ_EXCEEDED_ERROR "ERROR :Closing link: SendQ exceeded\r\n"
 
 #define LOG_CLIENT_CREATED "Client instance created."
 #define LOG_CLIENT_DISCONNECTED(fd) ("Client disconnected, fd: " + Utils::intToString(fd))
@@ -28,34 +36,87 @@ inline std::string LOG_REG_STATUS(bool status) {
 #define LOG_SEND_FAILED(fd, err) ("Failed to send reply to fd " + Utils::intToString(fd) + ": " + err)
 #define LOG_SEND_TRUNCATED(fd) ("Reply too long for fd " + Utils::intToString(fd) + ", truncating to 510 bytes + CRLF")
 
+enum IdentityField {
+    IDENTITY_NICKNAME,
+    IDENTITY_USERNAME,
+    IDENTITY_HOSTNAME,
+    IDENTITY_REALNAME,
+    IDENTITY_FIELD_COUNT
+};
+
+// What appending output changed outside the client itself. A fan-out
+// worker fills one per slice and the loop thread commits it afterwards
+// (see FanoutPool); queueOutput commits its own right away.
+struct OutputTally {
+    std::vector<int>* flush;
+    long long outputBytes;
+    size_t highWater;
+    unsigned long long evictions;
+
+    OutputTally();
+};
+
+// Kept small for large numbers of idle connections: identity strings share a
+// single length-prefixed heap block, and the input/output buffers only exist
+// while they hold data.
 class Client {
 private:
     int fd;
-    bool registered;
-    bool authenticated;
-    bool nickSet;
-    bool userSet;
-    std::string IPAddress;
-    std::string nickname;
-    std::string username;
-    std::string hostname;
-    std::string realname;
-    std::string commandBuffer;
-    bool greeted;
+    in_addr_t address;
+    bool registered : 1;
+    bool authenticated : 1;
+    bool nickSet : 1;
+    bool userSet : 1;
+    bool greeted : 1;
+    bool ircOperator : 1;
+    bool writeArmed : 1;
+    bool backlogged : 1;
+    bool throttled : 1;
+    bool sendqExceeded : 1;
+    bool closing : 1;
+    char* identity;
+    std::string* commandBuffer;
+    std::string* outBuffer;
+
+    long long floodClock;
+    unsigned long fanoutStamp;
+    unsigned long serial;
+
+    size_t accountedIdentity;
+    size_t accountedInput;
+    size_t accountedOutput;
+
+    static std::vector<int> pendingFlush;
+    static unsigned long nextSerial;
+    static size_t sendqLimits[2];
+    static size_t sendqHighWater;
+    static unsigned long long sendqEvictions;
 
     Client(const Client& other);
     Client& operator=(const Client& other);
 
-    std::string formatReply(const std::string& reply);
-    void handleSendResult(ssize_t bytesSent, const std::string& formattedReply);
+    bool handleSendError();
+    void syncMemory();
+    const char* findIdentityField(IdentityField field, size_t& length) const;
+    std::string getIdentityField(IdentityField field) const;
+    void setIdentityField(IdentityField field, const std::string& value);
+    size_t identityBytes() const;
+    void releaseCommandBuffer();
+    void releaseOutBuffer();
 
 public:
     Client();
     ~Client();
 
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+
     int getFd() const;
+    unsigned long getSerial() const;
     std::string getIPAddress() const;
+    in_addr_t getAddress() const;
     std::string getNickname() const;
+    const char* peekNickname(size_t& length) const;
     std::string getUsername() const;
     std::string getHostname() const;
     std::string getRealname() const;
@@ -64,7 +125,8 @@ public:
     bool isAuthenticated() const;
     bool isNickSet() const;
     bool isUserSet() const;
-    std::string& getCommandBuffer();
+    bool hasCompleteLine() const;
+    std::string popLine();
 
     void setFd(int fd);
     void setIPAddress(const std::string& ipAddress);
@@ -79,7 +141,42 @@ public:
     bool isGreeted() const;
     void setGreeted(bool greeted);
 
+    bool isIrcOperator() const;
+    void setIrcOperator(bool status);
+
     void appendToCommandBuffer(const std::string& data);
+    void appendToCommandBuffer(const char* data, size_t length);
+    std::string formatReply(const std::string& reply);
     void sendReply(const std::string& reply);
-    static void sendWelcomeHowTo(int fd);
+    void queueOutput(const std::string& data);
+    void appendOutput(const std::string& data, OutputTally& tally);
+    static void commitOutput(OutputTally& tally);
+    bool flushOutput(Transport& transport);
+    bool hasPendingOutput() const;
+    size_t getInputBufferSize() const;
+    size_t getOutputBufferSize() const;
+    size_t getBufferedBytes() const;
+    bool isWriteArmed() const;
+    void setWriteArmed(bool armed);
+    bool isBacklogged() const;
+    void setBacklogged(bool queued);
+    bool isThrottled() const;
+    void setThrottled(bool paused);
+    long long getFloodClock() const;
+    void setFloodClock(long long clockUs);
+    bool isClosing() const;
+    unsigned long getFanoutStamp() const;
+    void setFanoutStamp(unsigned long generation);
+    void markClosing();
+    static void takePendingFlush(std::vector<int>& fds);
+
+    bool isSendqExceeded() const;
+    size_t getSendqLimit() const;
+    static void setSendqLimits(size_t registered, size_t unregistered);
+    static size_t getSendqHighWater();
+    static unsigned long long getSendqEvictions();
+    static void appendMetrics(MetricsWriter& writer);
+    void sendWelcomeHowTo();
+    void saveState(StateWriter& writer) const;
+    void restoreState(StateReader& reader);
 };
@@ -13,6 +13,7 @@ namespace CommandUtils {
     Channel* getChannel(Server* server, const std::string& channelName, Client* client);
     Client* getTargetClient(Server* server, Client* sender, const std::string& targetNick);
     std::string getNicknameOrDefault(Client* client, const std::string& defaultNick = "*");
+    bool validateIrcOperator(Client* client);
 }
 
 void handlePass(std::list<std::string> cmdList, Client* client, Server* server);
@@ -20,11 +21,17 @@ void handleNick(std::list<std::string> cmdList, Client* client, Server* server);
 void handleUser(std::list<std::string> cmdList, Client* client, Server* server);
 void handleJoin(std::list<std::string> cmdList, Client* client, Server* server);
 void handlePrivmsg(std::list<std::string> cmdList, Client* client, Server* server);
+void handleNotice(std::list<std::string> cmdList, Client* client, Server* server);
 void handlePart(std::list<std::string> cmdList, Client* client, Server* server);
 void handleMode(std::list<std::string> cmdList, Client* client, Server* server);
 void handleInvite(std::list<std::string> cmdList, Client* client, Server* server);
 void handleTopic(std::list<std::string> cmdList, Client* client, Server* server);
 void handleKick(std::list<std::string> cmdList, Client* client, Server* server);
 void handleNames(std::list<std::string> cmdList, Client* client, Server* server);
+void handleList(std::list<std::string> cmdList, Client* client, Server* server);
 void handlePing(std::list<std::string> cmdList, Client* client, Server* server);
 void handleQuit(std::list<std::string> cmdList, Client* client, Server* server);
+void handleOper(std::list<std::string> cmdList, Client* client, Server* server);
+void handleSlowlog(std::list<std::string> cmdList, Client* client, Server* server);
+void handleMemory(std::list<std::string> cmdList, Client* client, Server* server);
+void handleStats(std::list<std::string> cmdList, Client* client, Server* server);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "Transport.hpp"
+#include <sys/epoll.h>
+
+// Non-blocking TCP sockets multiplexed with level-triggered epoll.
+class EpollTransport : public Transport {
+private:
+    int sock_fd;
+    int epfd;
+    int spareFd;
+    struct sockaddr_in serverAddress;
+    std::vector<struct epoll_event> epollEvents;
+
+    EpollTransport(const EpollTransport& other);
+    EpollTransport& operator=(const EpollTransport& other);
+
+    void createSocket();
+    void configureServerAddress(int port);
+    void setReuseAddr();
+    void bindSocket();
+    void listenOnSocket();
+    void initEpoll();
+    int shedConnection(struct sockaddr_in& address);
+
+public:
+    EpollTransport();
+    ~EpollTransport();
+
+    void listen(int port);
+    void adopt(int listenFd);
+    bool isListener(int fd) const;
+    int getListenFd() const;
+    int wait(std::vector<TransportEvent>& events, int timeoutMs);
+
+    int accept(struct sockaddr_in& address);
+    bool watch(int fd);
+    bool watchWakeup(int fd);
+    bool setWritable(int fd, bool enabled);
+    ssize_t read(int fd, char* buffer, size_t length);
+    ssize_t write(int fd, const char* data, size_t length);
+    void close(int fd);
+};
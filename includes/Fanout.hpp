@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Includes.hpp"
+
+class Channel;
+class Client;
+class Server;
+
+// Delivers an event about one client (QUIT, NICK, and later AWAY/ACCOUNT)
+// to everyone who shares a channel with it, exactly once per recipient.
+// Each fan-out takes a new generation number and stamps the clients it
+// reaches, so a peer met again in another shared channel is skipped
+// without building a recipient set. The line is formatted once.
+class PeerFanout {
+private:
+    static unsigned long generation;
+
+public:
+    static unsigned long nextGeneration();
+    static std::vector<Channel*> sharedChannels(Server* server, Client* source);
+    static size_t send(const std::vector<Channel*>& channels, Client* source, const std::string& line, bool echo);
+    static size_t send(Server* server, Client* source, const std::string& line, bool echo);
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "Client.hpp"
+#include <pthread.h>
+#include <deque>
+
+#define FANOUT_DEFAULT_THRESHOLD 4096
+#define FANOUT_DEFAULT_SLICE 1024
+#define FANOUT_MAX_THREADS 8
+
+class MetricsWriter;
+
+// Worker threads that help the event loop thread append one line to the
+// output buffers of a very large recipient list. The list is cut into
+// slices and each thread keeps a deque of them: it works from the back of
+// its own and steals from the front of the others' when it runs dry. The
+// loop thread takes part and does not return before every slice is done,
+// so client state is never touched concurrently with the rest of the
+// server, and each recipient belongs to exactly one slice. Process-wide
+// bookkeeping (memory accounting, the flush list) is gathered per slice and
+// committed by the loop thread afterwards.
+class FanoutPool {
+public:
+    typedef void (*SliceFn)(void* context, size_t slice);
+
+private:
+    struct Task {
+        SliceFn fn;
+        void* context;
+        size_t slice;
+    };
+
+    struct Queue {
+        pthread_mutex_t lock;
+        std::deque<Task> tasks;
+    };
+
+    struct Worker {
+        FanoutPool* pool;
+        size_t index;
+        pthread_t thread;
+    };
+
+    struct SliceResult {
+        std::vector<int> flush;
+        OutputTally tally;
+        size_t reached;
+    };
+
+    size_t threads;
+    size_t threshold;
+    size_t sliceSize;
+    bool started;
+    bool stopping;
+    std::vector<Queue*> queues;
+    std::vector<Worker*> workers;
+    pthread_mutex_t stateLock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned long jobs;
+    size_t pending;
+
+    std::vector<Client*> recipients;
+    std::vector<SliceResult> results;
+    const std::string* line;
+    unsigned long generation;
+
+    unsigned long long parallelFanouts;
+    unsigned long long slicesRun;
+    unsigned long long steals;
+
+    FanoutPool();
+    FanoutPool(const FanoutPool& other);
+    FanoutPool& operator=(const FanoutPool& other);
+
+    void start();
+    void stop();
+    static void* workerMain(void* arg);
+    void workerLoop(size_t index);
+    void runTasks(size_t index);
+    bool takeTask(size_t index, Task& task);
+    void finishTask();
+    static void deliverSlice(void* context, size_t slice);
+
+public:
+    ~FanoutPool();
+
+    static FanoutPool& instance();
+
+    void configure(size_t threads, size_t threshold, size_t sliceSize);
+    bool accepts(size_t recipientCount) const;
+    void parallelFor(size_t slices, SliceFn fn, void* context);
+
+    std::vector<Client*>& recipientBuffer();
+    size_t deliver(const std::string& formatted, unsigned long generation);
+
+    size_t getThreads() const;
+    void appendMetrics(MetricsWriter& writer) const;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define FLOOD_DEFAULT_RATE 10
+#define FLOOD_DEFAULT_BURST 20
+#define FLOOD_DEFAULT_MAX_QUEUE 8192
+#define FLOOD_MAX_RATE 1000000
+// A day of tokens: far past any useful burst, far below overflowing the clock.
+#define FLOOD_MAX_BURST_US 86400000000LL
+#define FLOOD_DEFAULT_COSTS "NAMES=5,LIST=5,JOIN=3,PART=2,KICK=2,INVITE=2,TOPIC=2,MODE=2"
+
+class Client;
+class MetricsWriter;
+
+// Per-client token bucket, kept as a penalty clock so a client needs one
+// timestamp instead of a token count plus a refill time. Every command
+// pushes the clock forward by its cost divided by the refill rate; the clock
+// may run at most `burst` costs ahead of now. A client past that point is
+// not parsed until its clock falls back, so commands are delayed, not
+// dropped. Rate 0 turns flood control off.
+class FloodControl {
+private:
+    std::map<std::string, unsigned int> costs;
+    long long usPerToken;
+    long long burstUs;
+    size_t maxQueue;
+    unsigned long long throttles;
+    unsigned long long excessFloods;
+
+    FloodControl(const FloodControl& other);
+    FloodControl& operator=(const FloodControl& other);
+
+    void parseCosts(const std::string& spec);
+
+public:
+    FloodControl();
+    ~FloodControl();
+
+    bool isEnabled() const;
+    unsigned int costOf(const std::string& command) const;
+    void charge(Client* client, const std::string& command, long long nowUs);
+    long long throttledUntil(const Client* client) const;
+    bool isThrottled(const Client* client, long long nowUs);
+    bool isFlooding(const Client* client);
+
+    void appendMetrics(MetricsWriter& writer) const;
+};
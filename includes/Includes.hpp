@@ -25,11 +25,31 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include "AllocTrace.hpp"
+#include "Capture.hpp"
+#include "Admission.hpp"
 #include "Channel.hpp"
+#include "ChannelStore.hpp"
 #include "Client.hpp"
 #include "Command.hpp"
+#include "EpollTransport.hpp"
+#include "Fanout.hpp"
+#include "FanoutPool.hpp"
+#include "FloodControl.hpp"
 #include "Logger.hpp"
+#include "Mailbox.hpp"
+#include "Memory.hpp"
 #include "Message.hpp"
+#include "Metrics.hpp"
+#include "Pool.hpp"
+#include "Replication.hpp"
 #include "Replies.hpp"
 #include "Server.hpp"
+#include "SimTransport.hpp"
+#include "SlowLog.hpp"
+#include "Snapshot.hpp"
+#include "TickProfiler.hpp"
+#include "Transport.hpp"
+#include "Upgrade.hpp"
 #include "Utils.hpp"
+#include "WriteAheadLog.hpp"
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "Pool.hpp"
+
+#define MAILBOX_DEFAULT_CAPACITY 65536
+
+class MetricsWriter;
+
+// An immutable line shared by every mailbox item that carries it, so a
+// broadcast posts one copy of the text. The last release() frees it.
+class SharedLine {
+private:
+    int refs;
+    std::string text;
+
+    explicit SharedLine(const std::string& text);
+    SharedLine(const SharedLine& other);
+    SharedLine& operator=(const SharedLine& other);
+    ~SharedLine();
+
+public:
+    static SharedLine* create(const std::string& text);
+    void retain();
+    void release();
+    const std::string& str() const;
+};
+
+// Identifies a connection across fd reuse: the serial is taken from the
+// Client the line was meant for.
+struct MailItem {
+    int fd;
+    unsigned long serial;
+    SharedLine* line;
+};
+
+// Bounded multi-producer/single-consumer queue through which other threads
+// hand lines to the event loop thread. Producers claim a cell with one
+// compare-and-swap on the tail and publish it through the cell's sequence
+// number, so there is no lock on either side; a full queue rejects the post
+// instead of blocking. The first post after the consumer has caught up
+// writes the eventfd, which the event loop watches, and later posts skip
+// the syscall until the next drain.
+class Mailbox {
+private:
+    struct Cell {
+        size_t sequence;
+        MailItem item;
+    };
+
+    Cell* cells;
+    size_t mask;
+    int wakeFd;
+    char padProducers[POOL_CACHE_LINE];
+    size_t enqueuePos;
+    int armed;
+    unsigned long long posted;
+    unsigned long long rejected;
+    unsigned long long wakeups;
+    char padConsumer[POOL_CACHE_LINE];
+    size_t dequeuePos;
+    unsigned long long delivered;
+    unsigned long long stale;
+
+    Mailbox(const Mailbox& other);
+    Mailbox& operator=(const Mailbox& other);
+
+public:
+    explicit Mailbox(size_t capacity);
+    ~Mailbox();
+
+    bool post(const MailItem& item);
+
+    bool hasWork() const;
+    void acknowledge();
+    bool take(MailItem& item);
+    void countDelivered(bool reachedClient);
+
+    int getWakeFd() const;
+    size_t getCapacity() const;
+    size_t getDepth() const;
+    void appendMetrics(MetricsWriter& writer) const;
+};
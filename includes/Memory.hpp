@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define MEMORY_DEFAULT_TOP_CLIENTS 5
+
+enum MemoryCategory {
+    MEM_CLIENTS,
+    MEM_INPUT_BUFFERS,
+    MEM_OUTPUT_BUFFERS,
+    MEM_CHANNELS,
+    MEM_MEMBERSHIP,
+    MEM_INVITES,
+    MEM_CATEGORY_COUNT
+};
+
+class MetricsWriter;
+
+// Process-wide byte counters per subsystem. Owners report deltas whenever
+// the heap footprint of what they hold changes, so reading is O(1).
+class MemoryAccounting {
+private:
+    static long long bytes[MEM_CATEGORY_COUNT];
+    static long long peakBytes[MEM_CATEGORY_COUNT];
+
+    MemoryAccounting();
+    MemoryAccounting(const MemoryAccounting& other);
+    MemoryAccounting& operator=(const MemoryAccounting& other);
+    ~MemoryAccounting();
+
+public:
+    static void add(MemoryCategory category, long long delta);
+    static void update(MemoryCategory category, size_t& accounted, size_t current);
+    static long long get(MemoryCategory category);
+    static long long getPeak(MemoryCategory category);
+    static long long total();
+    static const char* categoryName(MemoryCategory category);
+
+    static size_t stringBytes(const std::string& str);
+    static size_t residentBytes();
+    static void appendMetrics(MetricsWriter& writer);
+
+    // Size of one red-black tree node (color + parent/left/right links) holding a Value.
+    template <typename Value>
+    static size_t treeNodeBytes() {
+        size_t header = sizeof(int) > sizeof(void*) ? sizeof(int) : sizeof(void*);
+        size_t node = header + 3 * sizeof(void*) + sizeof(Value);
+        return (node + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    }
+};
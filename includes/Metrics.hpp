@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Includes.hpp"
+
+// Builds a Prometheus text exposition served on GET /metrics.
+class MetricsWriter {
+private:
+    std::ostringstream out;
+    std::set<std::string> described;
+
+    MetricsWriter(const MetricsWriter& other);
+    MetricsWriter& operator=(const MetricsWriter& other);
+
+    void describe(const std::string& name, const std::string& type, const std::string& help);
+
+public:
+    MetricsWriter();
+    ~MetricsWriter();
+
+    void counter(const std::string& name, const std::string& help, double value, const std::string& labels = "");
+    void gauge(const std::string& name, const std::string& help, double value, const std::string& labels = "");
+    std::string str() const;
+};
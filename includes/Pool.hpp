@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <functional>
+#include <utility>
+
+#define POOL_CACHE_LINE 64
+#define POOL_SLAB_BYTES 65536
+
+class MetricsWriter;
+
+struct PoolStats {
+    const char* name;
+    size_t objectSize;
+    size_t slotSize;
+    size_t slabs;
+    size_t capacity;
+    size_t inUse;
+    size_t peak;
+    unsigned long allocations;
+    unsigned long frees;
+};
+
+// Fixed-size slab allocator: memory is carved from aligned slabs and freed
+// slots are reused through an intrusive free list. Slabs are never returned
+// to the system, which keeps connection churn from fragmenting the heap.
+class SlabPool {
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    const char* name;
+    size_t objectSize;
+    size_t slotSize;
+    size_t alignment;
+    size_t slotsPerSlab;
+    std::vector<void*> slabs;
+    FreeSlot* freeList;
+    size_t inUse;
+    size_t peak;
+    unsigned long allocations;
+    unsigned long frees;
+
+    SlabPool(const SlabPool& other);
+    SlabPool& operator=(const SlabPool& other);
+
+    void grow();
+
+public:
+    SlabPool(const char* name, size_t objectSize, size_t alignment);
+    ~SlabPool();
+
+    void* allocate();
+    void deallocate(void* ptr);
+    PoolStats stats() const;
+
+    static std::vector<SlabPool*>& registry();
+    static void appendMetrics(MetricsWriter& writer);
+};
+
+// STL allocator drawing single-node allocations (tree nodes) from a slab pool
+// shared by every container instantiated with the same Tag and node type.
+template <typename T, typename Tag>
+class PoolAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, Tag> other;
+    };
+
+    PoolAllocator() {}
+    PoolAllocator(const PoolAllocator&) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, Tag>&) {}
+    ~PoolAllocator() {}
+
+    static SlabPool& pool() {
+        static SlabPool instance(Tag::name(), sizeof(T), sizeof(void*));
+        return instance;
+    }
+
+    pointer address(reference value) const { return &value; }
+    const_pointer address(const_reference value) const { return &value; }
+
+    pointer allocate(size_type n, const void* = 0) {
+        if (n == 1) {
+            return static_cast<pointer>(pool().allocate());
+        }
+        return static_cast<pointer>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(pointer ptr, size_type n) {
+        if (n == 1) {
+            pool().deallocate(ptr);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+    void construct(pointer ptr, const T& value) { new (ptr) T(value); }
+    void destroy(pointer ptr) { ptr->~T(); }
+
+    bool operator==(const PoolAllocator&) const { return true; }
+    bool operator!=(const PoolAllocator&) const { return false; }
+};
+
+struct MembershipPoolTag {
+    static const char* name() { return "membership"; }
+};
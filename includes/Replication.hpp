@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "ChannelStore.hpp"
+
+#define REPLICATION_DEFAULT_BUFFER 67108864
+#define REPLICATION_HEARTBEAT_US 1000000
+#define REPLICATION_LISTEN_RETRY_US 1000000
+#define REPLICATION_CONNECT_RETRY_US 200000
+#define REPLICATION_POLL_INTERVAL_MS 100
+#define REPLICATION_READ_SIZE 65536
+#define STANDBY_DEFAULT_TIMEOUT_MS 5000
+
+class Channel;
+class MetricsWriter;
+class Transport;
+
+struct ReplicationSubscriber {
+    int fd;
+    std::string output;
+    size_t sent;
+};
+
+// The primary's side of replication (IRCSERV_REPLICATION_LISTEN=<path> for
+// a Unix socket, or [<IPv4 address>:]<port> for TCP on 127.0.0.1 unless an
+// address is given). Each standby that connects first gets a snapshot:
+// RESET, one CHANNEL record per live or saved channel, then SYNC. After
+// that it gets every tick's committed change log records (WriteAheadLog)
+// followed by a SYNC carrying the primary's clock, and a SYNC at least once
+// a second when nothing changes. Sockets are polled once per tick and never
+// block; a standby whose unsent stream passes IRCSERV_REPLICATION_BUFFER
+// bytes is dropped and gets a new snapshot when it reconnects. The stream
+// is not authenticated: keep it on a Unix socket or a private address.
+class ReplicationFeed {
+private:
+    std::string address;
+    size_t bufferLimit;
+    bool started;
+    int listenFd;
+    std::vector<ReplicationSubscriber> subscribers;
+    std::string batch;
+    long long lastListenAttemptUs;
+    long long lastSyncUs;
+
+    unsigned long long accepted;
+    unsigned long long dropped;
+    unsigned long long bytesSent;
+    long long lastSnapshotUs;
+    size_t lastSnapshotBytes;
+
+    ReplicationFeed(const ReplicationFeed& other);
+    ReplicationFeed& operator=(const ReplicationFeed& other);
+
+    void listenSocket(Transport& transport);
+    void acceptSubscribers(const std::map<std::string, Channel*>& channels,
+                           const std::map<std::string, ChannelRecord>& saved);
+    void snapshot(std::string& out, const std::map<std::string, Channel*>& channels,
+                  const std::map<std::string, ChannelRecord>& saved);
+    bool service(ReplicationSubscriber& subscriber);
+
+public:
+    ReplicationFeed();
+    ~ReplicationFeed();
+
+    bool isEnabled() const;
+    bool owns(int fd) const;
+    void start(WriteAheadLog& log);
+    void stop();
+    void tick(Transport& transport, WriteAheadLog& log, const std::map<std::string, Channel*>& channels,
+              const std::map<std::string, ChannelRecord>& saved);
+    void appendMetrics(MetricsWriter& writer) const;
+};
+
+// A read-only standby (IRCSERV_STANDBY_OF=<address of a primary's feed>).
+// It keeps the primary's channels as ChannelRecords, applying the stream as
+// it arrives; a snapshot is applied to a side map and swapped in at its
+// SYNC, so a primary dying mid-snapshot leaves the previous replica whole.
+// Until it is promoted the server refuses IRC clients but answers /metrics.
+// It is promoted once it has had a replica and heard no SYNC for
+// IRCSERV_STANDBY_TIMEOUT_MS: the replica becomes the saved channels
+// (ChannelStore::adopt), so failover only has to start accepting clients.
+class StandbyReplica {
+private:
+    std::string address;
+    long long timeoutUs;
+    bool active;
+    int fd;
+    std::string input;
+    std::map<std::string, ChannelRecord> channels;
+    std::map<std::string, ChannelRecord> incoming;
+    bool synced;
+    bool everSynced;
+    bool reportedFailure;
+    long long lastAttemptUs;
+    long long lastHeardUs;
+    long long lastSyncUs;
+    long long lagUs;
+
+    unsigned long long connects;
+    unsigned long long bytesReceived;
+    unsigned long long recordsApplied;
+    unsigned long long streamErrors;
+
+    StandbyReplica(const StandbyReplica& other);
+    StandbyReplica& operator=(const StandbyReplica& other);
+
+    void connectToPrimary(Transport& transport);
+    void disconnect(const std::string& reason);
+    void receive();
+
+public:
+    StandbyReplica();
+    ~StandbyReplica();
+
+    bool isActive() const;
+    bool owns(int fd) const;
+    void disable();
+    void tick(Transport& transport);
+    bool shouldPromote() const;
+    void promote(std::map<std::string, ChannelRecord>& replica);
+    void appendMetrics(MetricsWriter& writer) const;
+};
@@ -9,16 +9,23 @@
 #define RPL_YOURHOST        "002"
 #define RPL_CREATED         "003"
 #define RPL_MYINFO          "004"
+#define RPL_ISUPPORT        "005"
+#define RPL_ENDOFSTATS      "219"
+#define RPL_STATSDEBUG      "249"
+#define RPL_LIST            "322"
+#define RPL_LISTEND         "323"
 #define RPL_NOTOPIC         "331"
 #define RPL_TOPIC           "332"
 #define RPL_TOPICWHOTIME    "303"
 #define RPL_NAMREPLY        "353"
 #define RPL_ENDOFNAMES      "366"
+#define RPL_YOUREOPER       "381"
 
 #define ERR_NOSUCHNICK      "401"
 #define ERR_NOSUCHCHANNEL   "403"
 #define ERR_CANNOTSENDTOCHAN "404"
 #define ERR_TOOMANYCHANNELS "405"
+#define ERR_TOOMANYTARGETS  "407"
 #define ERR_NORECIPIENT     "411"
 #define ERR_NOTEXTTOSEND    "412"
 #define ERR_UNKNOWNCOMMAND  "421"
@@ -4,11 +4,27 @@
 #include "Replies.hpp"
 #include "Command.hpp"
 #include "Channel.hpp"
-#include <sys/epoll.h>
+#include "ChannelStore.hpp"
+#include "SlowLog.hpp"
+#include "TickProfiler.hpp"
+#include "Memory.hpp"
+#include "Capture.hpp"
+#include "FloodControl.hpp"
+#include "Admission.hpp"
+#include "Transport.hpp"
+#include "Mailbox.hpp"
+#include "Snapshot.hpp"
+#include "Upgrade.hpp"
+#include "Replication.hpp"
 #include <sys/resource.h>
+#include <deque>
 
 #define BUFFER_SIZE 1024
-#define MAX_EVENTS 1000
+#define MAX_EVENTS 1024
+#define DEFAULT_FD_LIMIT 1048576
+#define DEFAULT_LINE_BUDGET 16
+#define DEFAULT_TICK_LINE_BUDGET 4096
+#define DEFAULT_MAX_TARGETS 4
 
 class Client;
 
@@ -17,20 +33,43 @@ private:
     std::string                     name;
     int                             port;
     std::string                     password;
+    std::string                     operPassword;
     static bool                     signal;
-    int                             sock_fd;
-    int                             epfd;
-    struct sockaddr_in              serverAddress;
+    static bool                     dumpRequested;
+    static bool                     upgradeRequested;
+    Transport*                      transport;
+    bool                            ownsTransport;
     std::string                     createdtime;
     std::map<int, Client*>          clients;
-    std::set<int>                   processedFds;
+    std::map<std::string, Client*>  nicknames;
     std::map<std::string, Channel*> channels;
+    std::vector<TransportEvent>     events;
+    std::deque<int>                 backlog;
+    std::vector<Client*>            closing;
+    std::multimap<long long, int>   throttled;
+    size_t                          lineBudget;
+    size_t                          tickLineBudget;
+    size_t                          tickLines;
+    unsigned long long              deferrals;
+    size_t                          maxTargets;
+    char                            readBuffer[BUFFER_SIZE];
+    SlowLog                         slowLog;
+    TickProfiler                    profiler;
+    TrafficCapture                  capture;
+    FloodControl                    floodControl;
+    AdmissionControl                admission;
+    Mailbox                         mailbox;
+    bool                            mailboxWatched;
+    SnapshotCache                   snapshots;
+    ListingQueue                    listings;
+    ChannelStore                    channelStore;
+    ReplicationFeed                 replication;
+    StandbyReplica                  standby;
+    std::string                     executable;
+    int                             upgradeTimeoutMs;
+    bool                            handedOver;
+    long long                       upgradeWaitStartUs;
 
-    void createSocket();
-    void configureServerAddress();
-    void bindSocket();
-    void listenOnSocket();
-    void initEpoll();
     void increaseFdLimit();
     void logInitialization();
     void validateArgs(const std::string &portStr, const std::string &password);
@@ -38,12 +77,15 @@ private:
     void validatePort(const std::string &portStr);
     void validatePassword(const std::string &password);
     void cleanupAllClients();
-    void closeSocket();
     void logShutdown();
 
-    void waitForEvents(struct epoll_event events[], int& nfds);
-    void processEvents(struct epoll_event events[], int nfds);
-    void handleClientEvent(int fd, uint32_t events);
+    void waitForEvents(int& nfds, int timeoutMs);
+    void processEvents(int nfds);
+    void handleClientEvent(int fd, unsigned int flags);
+    void handleClientWritable(int fd);
+    void flushPendingOutput();
+    void flushClient(Client* client);
+    void updateClientEvents(Client* client);
 
     void acceptNewConnection();
     void handleAcceptResult(int clientFd, sockaddr_in& clientAddr);
@@ -52,29 +94,39 @@ private:
     void logNewConnection(int clientFd, const char* ip, int port);
     bool tryHandleHttpClient(int clientFd);
     void sendIrcGreeting(Client* client);
-    void addClientToEpoll(int clientFd);
+    void watchClient(int clientFd);
 
     void handleClientData(int fd);
     void processReadResult(int fd, char* buffer, int bytesRead);
     void handleReadError(int fd);
     void handleReadSuccess(int fd, char* buffer, int bytesRead);
-    void appendToClientBuffer(int fd, const char* data);
-    void processClientBuffer(int fd);
-    bool hasNextMessage(const std::string& buffer);
-    std::string extractNextMessage(std::string& buffer);
-    std::string extractMessage(const std::string& buffer, size_t pos);
-    std::list<std::string> parseMessage(const std::string& message);
+    void appendToClientBuffer(int fd, const char* data, size_t length);
+    void processClientBuffer(Client* client);
+    void processBacklog();
+    void processThrottled();
+    void processMailbox();
+    void processListings();
+    void processReplication();
+    void promoteStandby();
+    int nextWakeTimeout(int timeoutMs) const;
     void tokenizePrefix(const std::string& prefix, std::list<std::string>& cmdList);
 
-    void executeCommand(int fd, std::list<std::string> cmdList);
-    void sendInvalidCommandError(int fd, const std::string& cmd);
-    void dispatchCommand(const std::string& cmd, std::list<std::string> cmdList, Client* client);
+    void executeCommand(Client* client, const std::list<std::string>& cmdList);
+    void sendInvalidCommandError(Client* client, const std::string& cmd);
+    bool dispatchCommand(const std::string& cmd, std::list<std::string> cmdList, Client* client);
     void sendUnknownCommandError(Client* client, const std::string& cmd);
     bool isUpperCase(const std::string& str);
 
-    void sendHttpResponse(int fd);
+    void sendHttpResponse(int fd, const char* request);
+    std::string renderMetrics();
+    void handleDumpRequest();
+    void handleUpgradeRequest();
+    bool finishListingsForUpgrade();
+    void saveState(StateWriter& writer) const;
+    void restoreState(StateReader& reader, const std::vector<int>& fds);
 
     void cleanupAllChannels();
+    void reapClosingClients();
 
     Server(const Server &server);
     Server &operator=(const Server &server);
@@ -84,18 +136,35 @@ public:
     ~Server();
 
     void serverInit();
+    void serverInit(Transport& external);
+    void serverResume(int link);
     void serverRun();
+    void runOnce(int timeoutMs);
+    bool hasPendingWork() const;
     static void sigHandler(int sig);
-    void setReuseAddr();
+    static void dumpHandler(int sig);
+    static void upgradeHandler(int sig);
 
     const std::string &getName() const;
     const std::string &getCreatedTime() const;
     const std::string &getPassword() const;
+    const std::string &getOperPassword() const;
+    size_t getMaxTargets() const;
+    SlowLog &getSlowLog();
+    TickProfiler &getProfiler();
+    Transport *getTransport();
+    Mailbox &getMailbox();
+    ChannelStore &getChannelStore();
     std::map<int, Client*>& getClients();
 
     std::map<std::string, Channel*>& getChannels();
 
     Client* getClientByNickname(const std::string& nickname) const;
+    void setClientNickname(Client* client, const std::string& nickname);
+    void forgetNickname(Client* client);
     void removeChannel(const std::string& channelName);
+    void startListing(Client* client, ListingKind kind);
     void handleClientDisconnect(int fd);
+    std::list<std::string> parseMessage(const std::string& message);
+    std::vector<Client*> getTopBufferedClients(size_t count) const;
 };
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Includes.hpp"
+#include "Transport.hpp"
+#include <deque>
+
+#define SIM_LISTENER_HANDLE 1
+#define SIM_FIRST_HANDLE 2
+
+// In-memory network for scale tests and for profiling the protocol core on
+// its own. A driver plays the clients: connect() queues a connection for the
+// server to accept, send() makes bytes readable and hangup() closes the
+// client side. Nothing blocks and no sockets are opened, so millions of
+// virtual clients fit in one process and runs are deterministic.
+class SimTransport : public Transport {
+private:
+    struct Connection {
+        std::string inbound;
+        std::string outbound;
+        unsigned long long bytesWritten;
+        in_addr_t address;
+        bool open : 1;
+        bool accepted : 1;
+        bool hungUp : 1;
+        bool writable : 1;
+        bool queued : 1;
+    };
+
+    std::vector<Connection> connections;
+    std::deque<int> pendingAccepts;
+    std::deque<int> ready;
+    bool listening;
+    bool recordOutput;
+
+    SimTransport(const SimTransport& other);
+    SimTransport& operator=(const SimTransport& other);
+
+    Connection* find(int fd);
+    const Connection* find(int fd) const;
+    void markReady(int fd);
+    unsigned int pendingFlags(const Connection& connection) const;
+
+public:
+    explicit SimTransport(bool recordOutput = true);
+    ~SimTransport();
+
+    void listen(int port);
+    bool isListener(int fd) const;
+    int getListenFd() const;
+    int wait(std::vector<TransportEvent>& events, int timeoutMs);
+
+    int accept(struct sockaddr_in& address);
+    bool watch(int fd);
+    bool watchWakeup(int fd);
+    bool setWritable(int fd, bool enabled);
+    ssize_t read(int fd, char* buffer, size_t length);
+    ssize_t write(int fd, const char* data, size_t length);
+    void close(int fd);
+
+    int connect(in_addr_t address);
+    void send(int fd, const std::string& data);
+    void hangup(int fd);
+    std::string takeOutput(int fd);
+    unsigned long long getBytesWritten(int fd) const;
+    bool isOpen(int fd) const;
+    bool hasActivity() const;
+};
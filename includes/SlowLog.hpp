@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Includes.hpp"
+#include <deque>
+
+#define SLOWLOG_DEFAULT_THRESHOLD_US 10000
+#define SLOWLOG_DEFAULT_MAX_ENTRIES 128
+#define SLOWLOG_MAX_ARGS_LENGTH 64
+
+class MetricsWriter;
+
+struct SlowLogEntry {
+    unsigned long id;
+    time_t timestamp;
+    long long durationUs;
+    int fd;
+    std::string nickname;
+    std::string verb;
+    std::string args;
+};
+
+// Bounded in-memory log of command handlers that exceeded the latency budget.
+// The newest entry is kept at the front; the oldest one is dropped when full.
+class SlowLog {
+private:
+    std::deque<SlowLogEntry> entries;
+    long long thresholdUs;
+    size_t maxEntries;
+    unsigned long nextId;
+
+    SlowLog(const SlowLog& other);
+    SlowLog& operator=(const SlowLog& other);
+
+    static std::string truncateArgs(const std::list<std::string>& cmdList);
+
+public:
+    SlowLog();
+    ~SlowLog();
+
+    bool record(const std::list<std::string>& cmdList, int fd, const std::string& nickname, long long durationUs);
+    void reset();
+
+    long long getThresholdUs() const;
+    size_t getMaxEntries() const;
+    const std::deque<SlowLogEntry>& getEntries() const;
+
+    static std::string formatEntry(const SlowLogEntry& entry);
+    void dump() const;
+    void appendMetrics(MetricsWriter& writer) const;
+};
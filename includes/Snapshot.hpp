@@ -0,0 +1,145 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define LISTING_DEFAULT_BATCH 64
+#define LISTING_OUTPUT_LIMIT 65536
+
+class Channel;
+class Client;
+class MetricsWriter;
+
+// What NAMES and LIST show of one channel, frozen when it was built. A
+// channel keeps its latest view until it changes; snapshots and listings
+// still holding an older one keep it alive until they release it.
+class ChannelView {
+private:
+    size_t refs;
+    std::string name;
+    std::string topic;
+    std::string members;
+    size_t memberCount;
+    bool secret;
+
+    static unsigned long long builds;
+    static size_t live;
+
+    explicit ChannelView(const Channel& channel);
+    ChannelView(const ChannelView& other);
+    ChannelView& operator=(const ChannelView& other);
+    ~ChannelView();
+
+public:
+    static ChannelView* create(const Channel& channel);
+    void retain();
+    void release();
+
+    const std::string& getName() const;
+    const std::string& getTopic() const;
+    const std::string& getMembers() const;
+    size_t getMemberCount() const;
+    bool isSecret() const;
+
+    static unsigned long long getBuilds();
+    static size_t getLive();
+};
+
+// The channel registry as of one version: the channel views in name
+// order and the registered users who are on no channel.
+class RegistrySnapshot {
+private:
+    size_t refs;
+    unsigned long version;
+    std::vector<ChannelView*> channels;
+    std::string loneNicks;
+
+    RegistrySnapshot(const RegistrySnapshot& other);
+    RegistrySnapshot& operator=(const RegistrySnapshot& other);
+    ~RegistrySnapshot();
+
+public:
+    RegistrySnapshot(unsigned long version, std::map<std::string, Channel*>& channels,
+                     const std::map<int, Client*>& clients);
+    void retain();
+    void release();
+
+    unsigned long getVersion() const;
+    size_t size() const;
+    const ChannelView& at(size_t index) const;
+    const std::string& getLoneNicks() const;
+};
+
+// Hands out the current registry snapshot. Every change to a channel,
+// nickname or registration bumps the version; the next acquire() after a
+// change builds a new snapshot, reusing the views of unchanged channels,
+// and later acquires share it until the next change. A superseded
+// snapshot is freed once the last listing reading it is done.
+// Reference counts are not atomic: only the event loop thread reads.
+class SnapshotCache {
+private:
+    static unsigned long version;
+
+    RegistrySnapshot* current;
+    unsigned long long builds;
+    unsigned long long reuses;
+
+    SnapshotCache(const SnapshotCache& other);
+    SnapshotCache& operator=(const SnapshotCache& other);
+
+public:
+    SnapshotCache();
+    ~SnapshotCache();
+
+    static void invalidate();
+    RegistrySnapshot* acquire(std::map<std::string, Channel*>& channels, const std::map<int, Client*>& clients);
+    void appendMetrics(MetricsWriter& writer) const;
+};
+
+enum ListingKind {
+    LISTING_NAMES,
+    LISTING_LIST
+};
+
+struct ListingCursor {
+    int fd;
+    unsigned long serial;
+    ListingKind kind;
+    RegistrySnapshot* snapshot;
+    size_t next;
+};
+
+// NAMES and LIST over the whole registry, sent from a snapshot a batch of
+// channels per tick rather than all at once, so a client listing 100k
+// channels does not hold up everyone else's JOIN and PART. A client whose
+// unsent output is above LISTING_OUTPUT_LIMIT is skipped until it drains,
+// and a client's second listing waits for its first. cut() ends every
+// listing early, for a hot upgrade that cannot wait for a stalled reader.
+class ListingQueue {
+private:
+    std::vector<ListingCursor> cursors;
+    size_t batch;
+    unsigned long long started;
+    unsigned long long completed;
+    unsigned long long abandoned;
+    unsigned long long cutShort;
+
+    bool step(ListingCursor& cursor, Client* client, std::map<std::string, Channel*>& channels);
+
+    ListingQueue(const ListingQueue& other);
+    ListingQueue& operator=(const ListingQueue& other);
+
+public:
+    ListingQueue();
+    ~ListingQueue();
+
+    void start(Client* client, ListingKind kind, RegistrySnapshot* snapshot);
+    bool empty() const;
+    bool ready(const std::map<int, Client*>& clients) const;
+    void pump(const std::map<int, Client*>& clients, std::map<std::string, Channel*>& channels);
+    size_t cut(const std::map<int, Client*>& clients);
+    void appendMetrics(MetricsWriter& writer) const;
+
+    static void sendNames(const ChannelView& view, Client* client);
+    static void sendList(const ChannelView& view, Client* client);
+    static void sendListEnd(Client* client);
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define TICK_WINDOW_US 1000000
+#define TICK_WINDOW_COUNT 60
+
+enum LoopPhase {
+    PHASE_WAIT,
+    PHASE_ACCEPT,
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_DISPATCH,
+    PHASE_FLUSH,
+    PHASE_OTHER,
+    PHASE_COUNT
+};
+
+struct TickWindow {
+    long long startUs;
+    unsigned long ticks;
+    long long phaseUs[PHASE_COUNT];
+    unsigned long events;
+    unsigned long maxEvents;
+    unsigned long lines;
+    unsigned long maxLines;
+
+    void clear(long long start);
+    void merge(const TickWindow& other);
+    long long totalUs() const;
+};
+
+class MetricsWriter;
+
+// Per-tick accounting of where the event loop spends its time.
+// Time is always charged to exactly one phase: entering a phase charges the
+// elapsed time to the previous one, so nested phases never double count.
+class TickProfiler {
+private:
+    TickWindow windows[TICK_WINDOW_COUNT];
+    size_t current;
+    TickWindow totals;
+    LoopPhase phase;
+    long long lastSwitchUs;
+    unsigned long tickLines;
+
+    TickProfiler(const TickProfiler& other);
+    TickProfiler& operator=(const TickProfiler& other);
+
+    void charge(long long now);
+    void rotate(long long now);
+
+public:
+    TickProfiler();
+    ~TickProfiler();
+
+    LoopPhase enter(LoopPhase next);
+    void countLine();
+    void endTick(int nfds);
+
+    TickWindow aggregate(size_t seconds) const;
+    const TickWindow& getTotals() const;
+    static const char* phaseName(LoopPhase phase);
+    static std::string formatWindow(const TickWindow& window, const std::string& label);
+    void appendMetrics(MetricsWriter& writer) const;
+};
+
+// Charges the enclosing scope to a loop phase and restores the previous one on exit.
+class PhaseScope {
+private:
+    TickProfiler& profiler;
+    LoopPhase previous;
+
+    PhaseScope(const PhaseScope& other);
+    PhaseScope& operator=(const PhaseScope& other);
+
+public:
+    PhaseScope(TickProfiler& profiler, LoopPhase phase);
+    ~PhaseScope();
+};
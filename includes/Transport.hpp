@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define TRANSPORT_READABLE 0x1
+#define TRANSPORT_WRITABLE 0x2
+#define TRANSPORT_HANGUP 0x4
+
+struct TransportEvent {
+    int fd;
+    unsigned int flags;
+};
+
+// Everything the protocol core needs from the network. Server owns the event
+// loop and the client registry; a transport only reports which connections
+// are ready and moves bytes. Connections are identified by an int handle,
+// which is the socket fd for EpollTransport. read/write/accept follow the
+// POSIX conventions: -1 with errno EAGAIN when nothing can be done now.
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    virtual void listen(int port) = 0;
+    virtual bool isListener(int fd) const = 0;
+    // The listening socket, for handing it to an upgraded process; -1 if
+    // the transport has no real socket.
+    virtual int getListenFd() const = 0;
+    virtual int wait(std::vector<TransportEvent>& events, int timeoutMs) = 0;
+
+    virtual int accept(struct sockaddr_in& address) = 0;
+    virtual bool watch(int fd) = 0;
+    // Reports `fd` (an eventfd owned by the caller) as readable when another
+    // thread signals it. Returns false if the transport has no such notion.
+    virtual bool watchWakeup(int fd) = 0;
+    virtual bool setWritable(int fd, bool enabled) = 0;
+    virtual ssize_t read(int fd, char* buffer, size_t length) = 0;
+    virtual ssize_t write(int fd, const char* data, size_t length) = 0;
+    virtual void close(int fd) = 0;
+};
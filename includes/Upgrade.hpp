@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define UPGRADE_LINK_ENV "IRCSERV_UPGRADE_FD"
+#define UPGRADE_STATE_MAGIC 0x6972637375706772ULL
+#define UPGRADE_STATE_VERSION 1
+#define UPGRADE_FDS_PER_MESSAGE 250
+#define UPGRADE_DEFAULT_READY_TIMEOUT_MS 10000
+#define UPGRADE_LISTING_WAIT_MS 1000
+
+// Flat encoding of the state handed to the next process: numbers are 8
+// bytes in host order (both processes run on the same machine) and strings
+// are length-prefixed.
+class StateWriter {
+private:
+    std::string data;
+
+public:
+    void putNumber(unsigned long long value);
+    void putString(const std::string& value);
+    void putFlag(bool value);
+    const std::string& str() const;
+};
+
+// Reads what StateWriter wrote; throws if the data ends early.
+class StateReader {
+private:
+    const std::string& data;
+    size_t pos;
+
+    void need(size_t length) const;
+
+public:
+    explicit StateReader(const std::string& data);
+    unsigned long long getNumber();
+    std::string getString();
+    bool getFlag();
+};
+
+// SIGUSR2 hot upgrade. The running server execs the binary again, with the
+// other end of a Unix socket pair named in IRCSERV_UPGRADE_FD, and sends it
+// the serialized state followed by the listening and client sockets as
+// SCM_RIGHTS messages. The successor rebuilds the registries, writes one
+// byte back and starts serving; only then does the old process exit, so a
+// failed upgrade leaves the old one running.
+class HotUpgrade {
+public:
+    static std::string currentExecutable();
+    static pid_t spawn(const std::string& executable, const std::vector<std::string>& args, int& link);
+    static bool send(int link, const std::string& state, const std::vector<int>& fds);
+    static bool awaitReady(int link, int timeoutMs);
+
+    static int inheritedLink();
+    static void receive(int link, std::string& state, std::vector<int>& fds);
+    static void signalReady(int link);
+};
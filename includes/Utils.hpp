@@ -21,5 +21,9 @@ public:
     static std::string toLower(const std::string& str);
     static std::list<std::string> split(const std::string& str, char delim);
     static std::string formatTime(time_t t);
+    static long long nowMicros();
+    static size_t envToSize(const char* name, size_t defaultValue);
+    static bool readFile(const std::string& path, std::string& data);
+    static void syncDirectoryOf(const std::string& path);
     static void displayBanner();
 };
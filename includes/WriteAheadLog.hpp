@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Includes.hpp"
+
+#define WAL_RECORD_HEADER 9
+#define WAL_DEFAULT_SEGMENT_BYTES 67108864
+#define WAL_FSYNC_INTERVAL_US 1000000
+
+class Channel;
+class MetricsWriter;
+struct ChannelRecord;
+
+enum WalRecordType {
+    WAL_CHANNEL = 1,
+    WAL_DESTROY = 2,
+    WAL_TOPIC = 3,
+    WAL_KEY = 4,
+    WAL_LIMIT = 5,
+    WAL_MODE = 6,
+    WAL_OPERATOR_ADD = 7,
+    WAL_OPERATOR_REMOVE = 8,
+    WAL_SAVED_OPERATORS_CLEAR = 9,
+    WAL_RESET = 10,
+    WAL_SYNC = 11
+};
+
+enum WalRecordStatus {
+    WAL_RECORD_OK,
+    WAL_RECORD_INCOMPLETE,
+    WAL_RECORD_DAMAGED,
+    WAL_RECORD_MALFORMED
+};
+
+enum WalFsyncPolicy {
+    WAL_FSYNC_NONE,
+    WAL_FSYNC_SECOND,
+    WAL_FSYNC_TICK
+};
+
+// Channel changes since the last state file, so a restart loses none of
+// them (IRCSERV_WAL=1, next to IRCSERV_STATE_FILE). Channel calls the
+// static log*() hooks as it changes; the records of a tick are buffered
+// and written together by commit(), which the server runs before flushing
+// the tick's replies. IRCSERV_WAL_FSYNC picks when commits reach the disk:
+// `tick` (every commit), `second` (default, at most once a second) or
+// `none` (left to the kernel).
+//
+// The log is split into segments <state file>.wal.<n>. Saving the state
+// file starts a new segment and records its number in the file, and a
+// committed state file makes every older segment obsolete. A record is:
+// u8 type, u32 body length, u32 FNV-1a checksum of the body (little
+// endian), then the body, which starts with the channel name. Replay stops
+// at the first record that is cut short or fails its checksum.
+//
+// The same records, framed the same way, make up the replication stream
+// (see ReplicationFeed), which adds two that never reach a segment: RESET
+// (forget every channel; a snapshot follows) and SYNC (the primary's clock,
+// for replication lag).
+class WriteAheadLog {
+private:
+    static WriteAheadLog* active;
+
+    std::string prefix;
+    bool streaming;
+    WalFsyncPolicy fsyncPolicy;
+    size_t segmentLimit;
+    int fd;
+    unsigned long segment;
+    size_t segmentBytes;
+    std::string pending;
+    std::string streamed;
+    bool unsynced;
+    long long lastSyncUs;
+
+    unsigned long long records;
+    unsigned long long payloadBytes;
+    unsigned long long bytesWritten;
+    unsigned long long commits;
+    unsigned long long fsyncs;
+    unsigned long long errors;
+    unsigned long long replayed;
+    long long replayDurationUs;
+
+    WriteAheadLog(const WriteAheadLog& other);
+    WriteAheadLog& operator=(const WriteAheadLog& other);
+
+    std::string segmentPath(unsigned long number) const;
+    std::vector<unsigned long> listSegments() const;
+    bool openSegment(unsigned long number);
+    void sync();
+    void append(WalRecordType type, const std::string& body);
+    static void frame(WalRecordType type, const std::string& body, std::string& out);
+
+public:
+    WriteAheadLog(const std::string& statePath, bool enabled);
+    ~WriteAheadLog();
+
+    bool isEnabled() const;
+    unsigned long replay(std::map<std::string, ChannelRecord>& channels, unsigned long firstSegment);
+    bool open(unsigned long number);
+    void commit();
+    void startStream();
+    void takeStream(std::string& batch);
+    unsigned long rotate();
+    void discardBefore(unsigned long number);
+    unsigned long long getPayloadBytes() const;
+    void appendMetrics(MetricsWriter& writer, unsigned long long stateBytes) const;
+
+    static WalRecordStatus applyRecord(std::map<std::string, ChannelRecord>& channels, const std::string& data,
+                                       size_t& pos, WalRecordType& type, long long& stampUs);
+    static void encodeChannel(const ChannelRecord& record, std::string& out);
+    static void encodeMarker(WalRecordType type, long long stampUs, std::string& out);
+
+    static void logChannel(const Channel& channel);
+    static void logDestroy(const std::string& channel);
+    static void logTopic(const std::string& channel, const std::string& topic, const std::string& setter, time_t when);
+    static void logKey(const std::string& channel, const std::string& key);
+    static void logLimit(const std::string& channel, size_t limit, bool limited);
+    static void logMode(const std::string& channel, char mode, bool enabled);
+    static void logOperator(const std::string& channel, const std::string& nickname, bool added);
+    static void logSavedOperatorsClear(const std::string& channel);
+};
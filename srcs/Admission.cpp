@@ -0,0 +1,95 @@
+#include "Includes.hpp"
+#include "Admission.hpp"
+#include "Metrics.hpp"
+
+AdmissionControl::AdmissionControl()
+    : maxPerAddress(Utils::envToSize("IRCSERV_MAX_PER_IP", ADMISSION_DEFAULT_MAX_PER_IP)), usPerAccept(0),
+      burstUs(0), acceptClock(0), admitted(0)
+{
+    size_t rate = Utils::envToSize("IRCSERV_ACCEPT_RATE", ADMISSION_DEFAULT_ACCEPT_RATE);
+    if (rate > 0) {
+        if (rate > 1000000) {
+            Logger::warning("IRCSERV_ACCEPT_RATE above 1000000 is not supported; using 1000000");
+            rate = 1000000;
+        }
+        size_t burst = Utils::envToSize("IRCSERV_ACCEPT_BURST", ADMISSION_DEFAULT_ACCEPT_BURST);
+        if (burst == 0) {
+            Logger::warning("IRCSERV_ACCEPT_BURST=0 would refuse every connection; using 1");
+            burst = 1;
+        }
+        usPerAccept = 1000000 / static_cast<long long>(rate);
+        burstUs = usPerAccept * static_cast<long long>(burst);
+    }
+    for (int i = 0; i < ADMIT_VERDICT_COUNT; ++i) {
+        rejected[i] = 0;
+    }
+}
+
+AdmissionControl::~AdmissionControl() {}
+
+// On ADMIT_OK the connection is counted against its address until release().
+AdmissionVerdict AdmissionControl::admit(in_addr_t address, long long nowUs) {
+    std::map<in_addr_t, unsigned int>::iterator it = perAddress.find(address);
+    if (maxPerAddress > 0 && it != perAddress.end() && it->second >= maxPerAddress) {
+        reject(ADMIT_PER_IP);
+        return ADMIT_PER_IP;
+    }
+    if (usPerAccept > 0) {
+        long long clock = std::max(acceptClock, nowUs - burstUs);
+        if (clock + usPerAccept > nowUs) {
+            reject(ADMIT_RATE);
+            return ADMIT_RATE;
+        }
+        acceptClock = clock + usPerAccept;
+    }
+    if (it == perAddress.end()) {
+        perAddress.insert(std::make_pair(address, 1u));
+    } else {
+        ++it->second;
+    }
+    ++admitted;
+    return ADMIT_OK;
+}
+
+// Counts a connection taken over from the process this one upgraded,
+// without applying the limits: it was admitted there.
+void AdmissionControl::adopt(in_addr_t address) { ++perAddress[address]; }
+
+void AdmissionControl::release(in_addr_t address) {
+    std::map<in_addr_t, unsigned int>::iterator it = perAddress.find(address);
+    if (it == perAddress.end()) {
+        return;
+    }
+    if (--it->second == 0) {
+        perAddress.erase(it);
+    }
+}
+
+void AdmissionControl::reject(AdmissionVerdict verdict) { ++rejected[verdict]; }
+
+size_t AdmissionControl::getConnectionCount(in_addr_t address) const {
+    std::map<in_addr_t, unsigned int>::const_iterator it = perAddress.find(address);
+    return it == perAddress.end() ? 0 : it->second;
+}
+
+const char* AdmissionControl::verdictName(AdmissionVerdict verdict) {
+    switch (verdict) {
+        case ADMIT_OK: return "ok";
+        case ADMIT_PER_IP: return "per_ip";
+        case ADMIT_RATE: return "accept_rate";
+        case ADMIT_FD_LIMIT: return "fd_limit";
+        default: return "unknown";
+    }
+}
+
+void AdmissionControl::appendMetrics(MetricsWriter& writer) const {
+    writer.counter("ircserv_connections_admitted_total", "Connections accepted and turned into clients", admitted);
+    for (int i = ADMIT_PER_IP; i < ADMIT_VERDICT_COUNT; ++i) {
+        AdmissionVerdict verdict = static_cast<AdmissionVerdict>(i);
+        writer.counter("ircserv_connections_rejected_total", "Connections closed right after accept",
+                       rejected[i], std::string("reason=\"") + verdictName(verdict) + "\"");
+    }
+    writer.gauge("ircserv_connection_addresses", "Distinct source addresses with live connections",
+                 perAddress.size());
+    writer.gauge("ircserv_connections_per_ip_limit", "Live connections allowed per source address", maxPerAddress);
+}
@@ -0,0 +1,159 @@
+#include "Includes.hpp"
+#include "AllocTrace.hpp"
+#include "Metrics.hpp"
+#include <new>
+
+#ifdef IRCSERV_ALLOC_TRACE
+
+static __thread unsigned long threadAllocs = 0;
+static __thread unsigned long threadBytes = 0;
+static __thread int threadPaused = 0;
+static volatile int registryLock = 0;
+
+static void* countedAlloc(size_t size) {
+    if (!threadPaused) {
+        ++threadAllocs;
+        threadBytes += size;
+    }
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+    void* ptr = countedAlloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc) {
+    void* ptr = countedAlloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw() {
+    return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw() {
+    return countedAlloc(size);
+}
+
+// Out of line so GCC does not pair an inlined free() with operator new.
+__attribute__((noinline)) static void release(void* ptr) { std::free(ptr); }
+
+void operator delete(void* ptr) throw() { release(ptr); }
+void operator delete[](void* ptr) throw() { release(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) throw() { release(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) throw() { release(ptr); }
+
+// Bookkeeping allocates too; it must neither be counted nor recurse into itself.
+class RegistryGuard {
+public:
+    RegistryGuard() {
+        ++threadPaused;
+        while (__sync_lock_test_and_set(&registryLock, 1)) {
+        }
+    }
+    ~RegistryGuard() {
+        __sync_lock_release(&registryLock);
+        --threadPaused;
+    }
+};
+
+static std::map<std::string, AllocScopeStats>& scopeStats() {
+    static std::map<std::string, AllocScopeStats> stats;
+    return stats;
+}
+
+bool AllocTrace::enabled() { return true; }
+
+AllocCounters AllocTrace::threadCounters() {
+    AllocCounters counters;
+    counters.allocs = threadAllocs;
+    counters.bytes = threadBytes;
+    return counters;
+}
+
+void AllocTrace::record(const char* name, const std::string* detail, const AllocCounters& used) {
+    RegistryGuard guard;
+    std::string key = name;
+    if (detail) {
+        key += "/" + *detail;
+    }
+    std::map<std::string, AllocScopeStats>::iterator it = scopeStats().find(key);
+    if (it == scopeStats().end()) {
+        AllocScopeStats empty = { 0, 0, 0, 0 };
+        it = scopeStats().insert(std::make_pair(key, empty)).first;
+    }
+    it->second.calls++;
+    it->second.allocs += used.allocs;
+    it->second.bytes += used.bytes;
+    it->second.maxAllocs = std::max(it->second.maxAllocs, used.allocs);
+}
+
+std::map<std::string, AllocScopeStats> AllocTrace::snapshot() {
+    RegistryGuard guard;
+    return scopeStats();
+}
+
+void AllocTrace::reset() {
+    RegistryGuard guard;
+    scopeStats().clear();
+}
+
+AllocScope::AllocScope(const char* name, const std::string* detail)
+    : name(name), detail(detail), start(AllocTrace::threadCounters())
+{
+}
+
+AllocScope::~AllocScope() {
+    AllocCounters now = AllocTrace::threadCounters();
+    AllocCounters used;
+    used.allocs = now.allocs - start.allocs;
+    used.bytes = now.bytes - start.bytes;
+    AllocTrace::record(name, detail, used);
+}
+
+#else
+
+bool AllocTrace::enabled() { return false; }
+
+AllocCounters AllocTrace::threadCounters() {
+    AllocCounters counters = { 0, 0 };
+    return counters;
+}
+
+void AllocTrace::record(const char*, const std::string*, const AllocCounters&) {}
+
+std::map<std::string, AllocScopeStats> AllocTrace::snapshot() {
+    return std::map<std::string, AllocScopeStats>();
+}
+
+void AllocTrace::reset() {}
+
+#endif
+
+void AllocTrace::appendMetrics(MetricsWriter& writer) {
+    std::map<std::string, AllocScopeStats> stats = snapshot();
+    std::map<std::string, AllocScopeStats>::const_iterator it;
+    for (it = stats.begin(); it != stats.end(); ++it) {
+        writer.counter("ircserv_alloc_scope_calls_total", "Times an allocation-traced scope was entered",
+                       it->second.calls, "scope=\"" + it->first + "\"");
+    }
+    for (it = stats.begin(); it != stats.end(); ++it) {
+        writer.counter("ircserv_alloc_scope_allocations_total", "Heap allocations made inside the scope",
+                       it->second.allocs, "scope=\"" + it->first + "\"");
+    }
+    for (it = stats.begin(); it != stats.end(); ++it) {
+        writer.counter("ircserv_alloc_scope_bytes_total", "Heap bytes requested inside the scope",
+                       it->second.bytes, "scope=\"" + it->first + "\"");
+    }
+    for (it = stats.begin(); it != stats.end(); ++it) {
+        writer.gauge("ircserv_alloc_scope_max_allocations", "Most allocations made by one pass through the scope",
+                     it->second.maxAllocs, "scope=\"" + it->first + "\"");
+    }
+}
@@ -0,0 +1,117 @@
+#include "Includes.hpp"
+#include "Capture.hpp"
+#include "Metrics.hpp"
+
+static void putLittleEndian(char* out, unsigned long long value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+TrafficCapture::TrafficCapture()
+    : file(NULL), startUs(Utils::nowMicros()), lastFlushUs(startUs), nextId(1), bytesWritten(0),
+      maxBytes(Utils::envToSize("IRCSERV_CAPTURE_MAX_BYTES", CAPTURE_DEFAULT_MAX_BYTES)), records(0)
+{
+    const char* path = getenv("IRCSERV_CAPTURE");
+    if (!path || !*path) {
+        return;
+    }
+    // Owner-only: the capture holds every password and private message.
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        Logger::warning("Cannot open capture file " + std::string(path) + ": " + strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LENGTH, file);
+    bytesWritten = CAPTURE_MAGIC_LENGTH;
+    Logger::info("Capturing inbound traffic to " + std::string(path));
+}
+
+TrafficCapture::~TrafficCapture() {
+    if (file) {
+        fclose(file);
+    }
+}
+
+bool TrafficCapture::isActive() const { return file != NULL; }
+
+void TrafficCapture::stop(const std::string& reason) {
+    Logger::warning("Traffic capture stopped: " + reason);
+    fclose(file);
+    file = NULL;
+}
+
+void TrafficCapture::write(CaptureEvent event, unsigned int id, const char* data, size_t length) {
+    if (bytesWritten + CAPTURE_RECORD_HEADER + length > maxBytes) {
+        std::ostringstream reason;
+        reason << "size limit of " << maxBytes << " bytes reached";
+        stop(reason.str());
+        return;
+    }
+    char header[CAPTURE_RECORD_HEADER];
+    header[0] = static_cast<char>(event);
+    putLittleEndian(header + 1, id, 4);
+    putLittleEndian(header + 5, static_cast<unsigned long long>(Utils::nowMicros() - startUs), 8);
+    putLittleEndian(header + 13, length, 4);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        (length && fwrite(data, 1, length, file) != length)) {
+        stop(strerror(errno));
+        return;
+    }
+    bytesWritten += sizeof(header) + length;
+    ++records;
+}
+
+void TrafficCapture::connect(int fd, in_addr_t address) {
+    if (!file) {
+        return;
+    }
+    unsigned int id = nextId++;
+    connections[fd] = id;
+    write(CAPTURE_CONNECT, id, reinterpret_cast<const char*>(&address), sizeof(address));
+}
+
+void TrafficCapture::data(int fd, const char* data, size_t length) {
+    if (!file) {
+        return;
+    }
+    std::map<int, unsigned int>::iterator it = connections.find(fd);
+    if (it != connections.end()) {
+        write(CAPTURE_DATA, it->second, data, length);
+    }
+}
+
+void TrafficCapture::disconnect(int fd) {
+    std::map<int, unsigned int>::iterator it = connections.find(fd);
+    if (it == connections.end()) {
+        return;
+    }
+    if (file) {
+        write(CAPTURE_DISCONNECT, it->second, NULL, 0);
+    }
+    connections.erase(it);
+}
+
+// Flushes at most once per second so a killed server leaves a usable file
+// without paying a write per tick.
+void TrafficCapture::tick() {
+    if (!file) {
+        return;
+    }
+    long long now = Utils::nowMicros();
+    if (now - lastFlushUs >= CAPTURE_FLUSH_INTERVAL_US) {
+        fflush(file);
+        lastFlushUs = now;
+    }
+}
+
+void TrafficCapture::appendMetrics(MetricsWriter& writer) const {
+    writer.gauge("ircserv_capture_active", "Whether inbound traffic is being captured", file != NULL);
+    writer.counter("ircserv_capture_records_total", "Records written to the capture file", records);
+    writer.counter("ircserv_capture_bytes_total", "Bytes written to the capture file", bytesWritten);
+}
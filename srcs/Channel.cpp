@@ -11,22 +11,59 @@ Channel::Channel(const std::string& channelName, Client* creator)
       topicRestricted(false),
       limited(false),
       limit(0),
-      secret(false)
+      secret(false),
+      accountedStrings(0),
+      accountedMembership(0),
+      accountedInvites(0),
+      view(NULL),
+      joined(false)
 {
     createdTime = Utils::formatTime(time(NULL));
+    MemoryAccounting::add(MEM_CHANNELS, sizeof(Channel));
+    syncMemory();
+    SnapshotCache::invalidate();
     if (creator) {
         Logger::info("Channel " + name + " created by " + creator->getNickname());
     }
 }
 
 Channel::~Channel() {
+    MemoryAccounting::add(MEM_CHANNELS, -static_cast<long long>(sizeof(Channel) + accountedStrings));
+    MemoryAccounting::add(MEM_MEMBERSHIP, -static_cast<long long>(accountedMembership));
+    MemoryAccounting::add(MEM_INVITES, -static_cast<long long>(accountedInvites));
+    touch();
+    if (joined) {
+        WriteAheadLog::logDestroy(name);
+    }
     Logger::info("Channel " + name + " destroyed");
 }
 
+static SlabPool& channelPool() {
+    static SlabPool pool("channel", sizeof(Channel), POOL_CACHE_LINE);
+    return pool;
+}
+
+void* Channel::operator new(size_t size) {
+    if (size != sizeof(Channel)) {
+        return ::operator new(size);
+    }
+    return channelPool().allocate();
+}
+
+// Sized so that anything operator new passed to the global heap goes back there.
+void Channel::operator delete(void* ptr, size_t size) {
+    if (size != sizeof(Channel)) {
+        ::operator delete(ptr);
+        return;
+    }
+    channelPool().deallocate(ptr);
+}
+
 const std::string& Channel::getName() const { return name; }
 const std::string& Channel::getTopic() const { return topic; }
 const std::string& Channel::getKey() const { return key; }
 bool Channel::getSecret() const { return secret; };
+const std::string& Channel::getCreatedTime() const { return createdTime; }
 const std::string& Channel::getTopicSetter() const { return topicSetter; }
 time_t Channel::getTopicTime() const { return topicTime; }
 size_t Channel::getLimit() const { return limit; }
@@ -36,6 +73,20 @@ bool Channel::getLimited() const { return limited; }
 bool Channel::getKeyProtected() const { return !key.empty(); }
 size_t Channel::getMemberCount() const { return members.size(); }
 
+void Channel::syncMemory() {
+    size_t strings = MemoryAccounting::stringBytes(name) + MemoryAccounting::stringBytes(topic) +
+                     MemoryAccounting::stringBytes(key) + MemoryAccounting::stringBytes(topicSetter) +
+                     MemoryAccounting::stringBytes(createdTime);
+    for (std::vector<std::string>::const_iterator it = savedOperators.begin(); it != savedOperators.end(); ++it) {
+        strings += MemoryAccounting::stringBytes(*it);
+    }
+    size_t membership = members.size() * MemoryAccounting::treeNodeBytes<std::pair<const int, Client*> >() +
+                        operators.size() * MemoryAccounting::treeNodeBytes<int>();
+    MemoryAccounting::update(MEM_CHANNELS, accountedStrings, strings);
+    MemoryAccounting::update(MEM_MEMBERSHIP, accountedMembership, membership);
+    MemoryAccounting::update(MEM_INVITES, accountedInvites, inviteList.capacity() * sizeof(int));
+}
+
 bool Channel::isMember(Client* client) const {
     if (!client) return false;
     return members.find(client->getFd()) != members.end();
@@ -50,6 +101,13 @@ bool Channel::isInvited(int fd) const {
     return std::find(inviteList.begin(), inviteList.end(), fd) != inviteList.end();
 }
 
+// Whether `nickname` was an operator when the channel was saved and no
+// saved operator has rejoined since (see ChannelStore).
+bool Channel::isSavedOperator(const std::string& nickname) const {
+    return !savedOperators.empty() &&
+           std::find(savedOperators.begin(), savedOperators.end(), Utils::toLower(nickname)) != savedOperators.end();
+}
+
 void Channel::setTopic(const std::string& newTopic, Client* setter) {
     if (setter && (!topicRestricted || isOperator(setter))) {
         for (std::string::const_iterator it = newTopic.begin(); it != newTopic.end(); ++it) {
@@ -62,6 +120,9 @@ void Channel::setTopic(const std::string& newTopic, Client* setter) {
         topic = newTopic;
         topicSetter = setter->getNickname();
         topicTime = time(NULL);
+        syncMemory();
+        touch();
+        WriteAheadLog::logTopic(name, topic, topicSetter, topicTime);
         Logger::info("Topic set for " + name + " by " + topicSetter + ": " + newTopic);
     } else {
         Logger::warning("Topic change failed for " + name + ": Permission denied");
@@ -70,6 +131,9 @@ void Channel::setTopic(const std::string& newTopic, Client* setter) {
 
 void Channel::setKey(const std::string& newKey) {
     key = newKey;
+    syncMemory();
+    ChannelStore::noteChange();
+    WriteAheadLog::logKey(name, key);
     std::string action;
     if (key.empty()) {
         action = "removed from ";
@@ -81,6 +145,8 @@ void Channel::setKey(const std::string& newKey) {
 
 void Channel::setSecret(bool flag) {
     secret = flag;
+    touch();
+    WriteAheadLog::logMode(name, 's', flag);
     std::string status;
     if (flag) {
         status = "enabled";
@@ -93,6 +159,8 @@ void Channel::setSecret(bool flag) {
 void Channel::setLimit(size_t newLimit) {
     limit = newLimit;
     limited = (newLimit > 0);
+    ChannelStore::noteChange();
+    WriteAheadLog::logLimit(name, limit, limited);
     std::string info;
     if (limited) {
         info = "set to " + Utils::intToString(newLimit);
@@ -105,10 +173,14 @@ void Channel::setLimit(size_t newLimit) {
 void Channel::setLimited(bool flag)
 {
     limited = flag;
+    ChannelStore::noteChange();
+    WriteAheadLog::logLimit(name, limit, limited);
 }
 
 void Channel::setInviteOnly(bool flag) {
     inviteOnly = flag;
+    ChannelStore::noteChange();
+    WriteAheadLog::logMode(name, 'i', flag);
     std::string status;
     if (flag) {
         status = "enabled";
@@ -120,6 +192,8 @@ void Channel::setInviteOnly(bool flag) {
 
 void Channel::setTopicRestricted(bool flag) {
     topicRestricted = flag;
+    ChannelStore::noteChange();
+    WriteAheadLog::logMode(name, 't', flag);
     std::string status;
     if (flag) {
         status = "enabled";
@@ -132,6 +206,7 @@ void Channel::setTopicRestricted(bool flag) {
 void Channel::addInvite(int fd) {
     if (!isInvited(fd)) {
         inviteList.push_back(fd);
+        syncMemory();
         Logger::info("Client fd " + Utils::intToString(fd) + " invited to " + name);
     }
 }
@@ -140,6 +215,7 @@ void Channel::removeInvite(int fd) {
     std::vector<int>::iterator it = std::find(inviteList.begin(), inviteList.end(), fd);
     if (it != inviteList.end()) {
         inviteList.erase(it);
+        syncMemory();
         Logger::info("Invite removed for fd " + Utils::intToString(fd) + " from " + name);
     }
 }
@@ -148,8 +224,18 @@ void Channel::addMember(Client* client) {
     if (client && !isMember(client)) {
         int fd = client->getFd();
         members[fd] = client;
+        syncMemory();
+        touch();
+        if (!joined) {
+            joined = true;
+            WriteAheadLog::logChannel(*this);
+        }
         removeInvite(fd);
-        if (members.size() == 1) {
+        if (isSavedOperator(client->getNickname())) {
+            savedOperators.clear();
+            WriteAheadLog::logSavedOperatorsClear(name);
+            addOperator(fd);
+        } else if (members.size() == 1 && savedOperators.empty()) {
             addOperator(fd);
         }
         Logger::info(client->getNickname() + " added to " + name);
@@ -159,16 +245,22 @@ void Channel::addMember(Client* client) {
 void Channel::removeMember(Client* client) {
     if (client && isMember(client)) {
         int fd = client->getFd();
-        members.erase(fd);
         removeOperator(fd);
+        members.erase(fd);
+        syncMemory();
+        touch();
         removeInvite(fd);
         Logger::info(client->getNickname() + " removed from " + name);
     }
 }
 
 void Channel::addOperator(int fd) {
-    if (members.find(fd) != members.end()) {
+    MemberMap::const_iterator member = members.find(fd);
+    if (member != members.end()) {
         operators.insert(fd);
+        syncMemory();
+        touch();
+        WriteAheadLog::logOperator(name, member->second->getNickname(), true);
         Logger::info("Client fd " + Utils::intToString(fd) + " promoted to operator in " + name);
     }
 }
@@ -176,24 +268,225 @@ void Channel::addOperator(int fd) {
 void Channel::removeOperator(int fd) {
     if (operators.find(fd) != operators.end()) {
         operators.erase(fd);
+        syncMemory();
+        touch();
+        MemberMap::const_iterator member = members.find(fd);
+        if (member != members.end()) {
+            WriteAheadLog::logOperator(name, member->second->getNickname(), false);
+        }
         Logger::info("Client fd " + Utils::intToString(fd) + " demoted from operator in " + name);
     }
 }
 
+// The line is formatted once; the sender, if a member, gets it last.
 void Channel::broadcast(const std::string& message, Client* sender) {
-    for (std::map<int, Client*>::iterator it = members.begin(); it != members.end(); ++it) {
-        if (it->second != sender) {
-            it->second->sendReply(message);
+    AllocScope allocations("broadcast");
+    if (members.empty()) {
+        return;
+    }
+    std::string formatted = (sender ? sender : members.begin()->second)->formatReply(message);
+    FanoutPool& pool = FanoutPool::instance();
+    if (pool.accepts(members.size())) {
+        std::vector<Client*>& recipients = pool.recipientBuffer();
+        for (MemberMap::iterator it = members.begin(); it != members.end(); ++it) {
+            if (it->second != sender) {
+                recipients.push_back(it->second);
+            }
+        }
+        pool.deliver(formatted, 0);
+    } else {
+        for (MemberMap::iterator it = members.begin(); it != members.end(); ++it) {
+            if (it->second != sender) {
+                it->second->queueOutput(formatted);
+            }
         }
     }
     if (sender && isMember(sender)) {
-        sender->sendReply(message);
+        sender->queueOutput(formatted);
+    }
+}
+
+// Queues an already formatted line for the members that fan-out `generation`
+// has not reached yet (see PeerFanout) and returns how many it reached.
+size_t Channel::deliverOnce(const std::string& formatted, unsigned long generation) {
+    FanoutPool& pool = FanoutPool::instance();
+    if (pool.accepts(members.size())) {
+        std::vector<Client*>& recipients = pool.recipientBuffer();
+        for (MemberMap::iterator it = members.begin(); it != members.end(); ++it) {
+            recipients.push_back(it->second);
+        }
+        return pool.deliver(formatted, generation);
+    }
+    size_t reached = 0;
+    for (MemberMap::iterator it = members.begin(); it != members.end(); ++it) {
+        Client* member = it->second;
+        if (member->getFanoutStamp() == generation) {
+            continue;
+        }
+        member->setFanoutStamp(generation);
+        member->queueOutput(formatted);
+        ++reached;
+    }
+    return reached;
+}
+
+// Members and invites are recorded by fd; the successor maps them to its
+// own fds for the same sockets.
+void Channel::saveState(StateWriter& writer) const {
+    writer.putString(name);
+    writer.putString(topic);
+    writer.putString(topicSetter);
+    writer.putNumber(static_cast<unsigned long long>(topicTime));
+    writer.putString(key);
+    writer.putString(createdTime);
+    writer.putNumber(limit);
+    writer.putFlag(inviteOnly);
+    writer.putFlag(topicRestricted);
+    writer.putFlag(limited);
+    writer.putFlag(secret);
+    writer.putNumber(members.size());
+    for (MemberMap::const_iterator it = members.begin(); it != members.end(); ++it) {
+        writer.putNumber(it->first);
+        writer.putFlag(operators.find(it->first) != operators.end());
+    }
+    writer.putNumber(inviteList.size());
+    for (std::vector<int>::const_iterator it = inviteList.begin(); it != inviteList.end(); ++it) {
+        writer.putNumber(*it);
+    }
+}
+
+// `byOldFd` maps the fds recorded by saveState() to the restored clients;
+// members and invites whose client did not make it over are dropped.
+Channel* Channel::restoreState(StateReader& reader, const std::map<int, Client*>& byOldFd) {
+    Channel* channel = new Channel(reader.getString(), NULL);
+    channel->topic = reader.getString();
+    channel->topicSetter = reader.getString();
+    channel->topicTime = static_cast<time_t>(reader.getNumber());
+    channel->key = reader.getString();
+    channel->createdTime = reader.getString();
+    channel->limit = reader.getNumber();
+    channel->inviteOnly = reader.getFlag();
+    channel->topicRestricted = reader.getFlag();
+    channel->limited = reader.getFlag();
+    channel->secret = reader.getFlag();
+    for (unsigned long long count = reader.getNumber(); count > 0; --count) {
+        std::map<int, Client*>::const_iterator found = byOldFd.find(static_cast<int>(reader.getNumber()));
+        bool op = reader.getFlag();
+        if (found == byOldFd.end()) {
+            continue;
+        }
+        channel->addMember(found->second);
+        if (op) {
+            channel->addOperator(found->second->getFd());
+        } else {
+            channel->removeOperator(found->second->getFd());
+        }
+    }
+    for (unsigned long long count = reader.getNumber(); count > 0; --count) {
+        std::map<int, Client*>::const_iterator found = byOldFd.find(static_cast<int>(reader.getNumber()));
+        if (found != byOldFd.end()) {
+            channel->addInvite(found->second->getFd());
+        }
+    }
+    channel->syncMemory();
+    channel->touch();
+    return channel;
+}
+
+// Operators by nickname, for the state file: the current ones, then the
+// saved ones still waiting to rejoin. Runs in the forked state writer, so
+// it must not allocate.
+void Channel::putOperators(StateFileWriter& writer) const {
+    writer.putNumber(operators.size() + savedOperators.size(), 4);
+    for (OperatorSet::const_iterator it = operators.begin(); it != operators.end(); ++it) {
+        MemberMap::const_iterator member = members.find(*it);
+        size_t length = 0;
+        const char* nickname = member != members.end() ? member->second->peekNickname(length) : NULL;
+        writer.putString(nickname ? nickname : "", length);
+    }
+    for (std::vector<std::string>::const_iterator it = savedOperators.begin(); it != savedOperators.end(); ++it) {
+        writer.putString(*it);
+    }
+}
+
+// The channel as a state file record, for the change log.
+void Channel::toRecord(ChannelRecord& record) const {
+    record.name = name;
+    record.topic = topic;
+    record.topicSetter = topicSetter;
+    record.topicTime = topicTime;
+    record.key = key;
+    record.createdTime = createdTime;
+    record.limit = limit;
+    record.inviteOnly = inviteOnly;
+    record.topicRestricted = topicRestricted;
+    record.limited = limited;
+    record.secret = secret;
+    record.operators = savedOperators;
+    for (OperatorSet::const_iterator it = operators.begin(); it != operators.end(); ++it) {
+        MemberMap::const_iterator member = members.find(*it);
+        if (member != members.end()) {
+            record.operators.push_back(Utils::toLower(member->second->getNickname()));
+        }
+    }
+}
+
+// Brings back a channel saved by ChannelStore, before its first member
+// joins.
+void Channel::restoreRecord(const ChannelRecord& record) {
+    topic = record.topic;
+    topicSetter = record.topicSetter;
+    topicTime = record.topicTime;
+    key = record.key;
+    createdTime = record.createdTime;
+    limit = record.limit;
+    inviteOnly = record.inviteOnly;
+    topicRestricted = record.topicRestricted;
+    limited = record.limited;
+    secret = record.secret;
+    savedOperators = record.operators;
+    syncMemory();
+    touch();
+}
+
+// Called after every change NAMES or LIST can see. The old view is only
+// released: listings still reading it hold their own reference.
+void Channel::touch() {
+    if (view) {
+        view->release();
+        view = NULL;
+    }
+    SnapshotCache::invalidate();
+    ChannelStore::noteChange();
+}
+
+// A member changed nickname: operators are kept by nickname on disk.
+void Channel::memberRenamed(Client* client, const std::string& oldNickname) {
+    touch();
+    if (isOperator(client)) {
+        WriteAheadLog::logOperator(name, oldNickname, false);
+        WriteAheadLog::logOperator(name, client->getNickname(), true);
+    }
+}
+
+ChannelView* Channel::getView() {
+    if (!view) {
+        view = ChannelView::create(*this);
+    }
+    return view;
+}
+
+void Channel::markMembers(std::vector<bool>& onChannel) const {
+    for (MemberMap::const_iterator it = members.begin(); it != members.end(); ++it) {
+        if (static_cast<size_t>(it->first) < onChannel.size()) {
+            onChannel[it->first] = true;
+        }
     }
 }
 
 std::string Channel::getMemberList() const {
     std::string list;
-    for (std::map<int, Client*>::const_iterator it = members.begin(); it != members.end(); ++it) {
+    for (MemberMap::const_iterator it = members.begin(); it != members.end(); ++it) {
         if (!list.empty()) list += " ";
         if (operators.find(it->first) != operators.end()) list += "@";
         list += it->second->getNickname();
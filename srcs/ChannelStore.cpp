@@ -0,0 +1,484 @@
+#include "Includes.hpp"
+#include "ChannelStore.hpp"
+#include "Metrics.hpp"
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+unsigned long long ChannelStore::changes = 0;
+
+ChannelRecord::ChannelRecord()
+    : topicTime(0), limit(0), inviteOnly(false), topicRestricted(false), limited(false), secret(false) {}
+
+StateFileWriter::StateFileWriter(int fd) : fd(fd), used(0), written(0), checksum(FNV_OFFSET_BASIS), failed(false) {}
+
+void StateFileWriter::putBytes(const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        checksum = (checksum ^ static_cast<unsigned char>(data[i])) * FNV_PRIME;
+    }
+    while (length > 0 && !failed) {
+        if (used == STATE_BUFFER_SIZE && !finish()) {
+            return;
+        }
+        size_t count = std::min(length, STATE_BUFFER_SIZE - used);
+        std::memcpy(buffer + used, data, count);
+        used += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void StateFileWriter::putByte(unsigned char value) {
+    char byte = static_cast<char>(value);
+    putBytes(&byte, 1);
+}
+
+void StateFileWriter::putNumber(unsigned long long value, size_t bytes) {
+    char out[8];
+    for (size_t i = 0; i < bytes; ++i) {
+        out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+    putBytes(out, bytes);
+}
+
+void StateFileWriter::putString(const std::string& value) { putString(value.data(), value.size()); }
+
+void StateFileWriter::putString(const char* data, size_t length) {
+    putNumber(length, 4);
+    putBytes(data, length);
+}
+
+// The checksum covers every byte written before it.
+void StateFileWriter::putChecksum() {
+    unsigned long long value = checksum;
+    putNumber(value, 8);
+}
+
+// Writes out the buffer; call once more at the end to flush the rest.
+bool StateFileWriter::finish() {
+    const char* data = buffer;
+    while (used > 0 && !failed) {
+        ssize_t count = ::write(fd, data, used);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            failed = true;
+            break;
+        }
+        data += count;
+        used -= count;
+        written += count;
+    }
+    return !failed;
+}
+
+unsigned long long StateFileWriter::getWritten() const { return written; }
+
+StateFileReader::StateFileReader(const std::string& data, size_t pos) : data(data), pos(pos) {}
+
+void StateFileReader::need(size_t length) const {
+    if (length > data.size() - pos) {
+        throw std::runtime_error("truncated");
+    }
+}
+
+unsigned char StateFileReader::getByte() {
+    need(1);
+    return static_cast<unsigned char>(data[pos++]);
+}
+
+unsigned long long StateFileReader::getNumber(size_t bytes) {
+    need(bytes);
+    unsigned long long value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<unsigned long long>(static_cast<unsigned char>(data[pos + i])) << (8 * i);
+    }
+    pos += bytes;
+    return value;
+}
+
+void StateFileReader::getString(std::string& value) {
+    size_t length = getNumber(4);
+    need(length);
+    value.assign(data, pos, length);
+    pos += length;
+}
+
+bool StateFileReader::atEnd() const { return pos == data.size(); }
+
+static std::string statePathFromEnv() {
+    const char* file = getenv("IRCSERV_STATE_FILE");
+    return file ? file : "";
+}
+
+ChannelStore::ChannelStore()
+    : path(statePathFromEnv()), tempPath(path + ".tmp"),
+      intervalUs(static_cast<long long>(Utils::envToSize("IRCSERV_STATE_INTERVAL", STATE_DEFAULT_INTERVAL)) * 1000000LL),
+      lastSaveUs(Utils::nowMicros()), savedChanges(changes), writerChanges(0), writerPid(-1), writerStartUs(0),
+      writerSegment(0), wal(path, Utils::envToSize("IRCSERV_WAL", 0) != 0), saves(0), failures(0),
+      lastSaveDurationUs(0), lastForkUs(0), lastSaveBytes(0), savedBytes(0), loaded(0), loadDurationUs(0) {}
+
+ChannelStore::ChannelStore(const std::string& path, bool withLog)
+    : path(path), tempPath(path + ".tmp"), intervalUs(STATE_DEFAULT_INTERVAL * 1000000LL),
+      lastSaveUs(Utils::nowMicros()), savedChanges(changes), writerChanges(0), writerPid(-1), writerStartUs(0),
+      writerSegment(0), wal(path, withLog), saves(0), failures(0), lastSaveDurationUs(0), lastForkUs(0),
+      lastSaveBytes(0), savedBytes(0), loaded(0), loadDurationUs(0) {}
+
+ChannelStore::~ChannelStore() {
+    reapWriter(true);
+}
+
+// Called on every change a snapshot would see.
+void ChannelStore::noteChange() { ++changes; }
+
+bool ChannelStore::isEnabled() const { return !path.empty(); }
+
+static void putRecordHead(StateFileWriter& out, const std::string& name, const std::string& topic,
+                          const std::string& topicSetter, time_t topicTime, const std::string& key,
+                          const std::string& createdTime, size_t limit, unsigned char flags) {
+    out.putByte(STATE_RECORD_CHANNEL);
+    out.putString(name);
+    out.putString(topic);
+    out.putString(topicSetter);
+    out.putNumber(static_cast<unsigned long long>(topicTime), 8);
+    out.putString(key);
+    out.putString(createdTime);
+    out.putNumber(limit, 8);
+    out.putByte(flags);
+}
+
+// Live channels, then the loaded records nobody has rejoined yet, after a
+// header naming the first change log segment the file does not cover. Runs
+// in the forked child, so nothing here may allocate or take a lock.
+bool ChannelStore::write(int fd, const std::map<std::string, Channel*>& channels, unsigned long segment,
+                         unsigned long long& bytes) const {
+    StateFileWriter out(fd);
+    for (size_t i = 0; i < STATE_MAGIC_LENGTH; ++i) {
+        out.putByte(STATE_MAGIC[i]);
+    }
+    out.putNumber(static_cast<unsigned long long>(time(NULL)), 8);
+    out.putNumber(segment, 8);
+    unsigned long long count = 0;
+    for (std::map<std::string, Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        const Channel& channel = *it->second;
+        unsigned char flags = (channel.getInviteOnly() ? STATE_FLAG_INVITE_ONLY : 0) |
+                              (channel.getTopicRestricted() ? STATE_FLAG_TOPIC_RESTRICTED : 0) |
+                              (channel.getLimited() ? STATE_FLAG_LIMITED : 0) |
+                              (channel.getSecret() ? STATE_FLAG_SECRET : 0);
+        putRecordHead(out, channel.getName(), channel.getTopic(), channel.getTopicSetter(), channel.getTopicTime(),
+                      channel.getKey(), channel.getCreatedTime(), channel.getLimit(), flags);
+        channel.putOperators(out);
+        ++count;
+    }
+    for (std::map<std::string, ChannelRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        const ChannelRecord& record = it->second;
+        if (channels.find(record.name) != channels.end()) {
+            continue;
+        }
+        unsigned char flags = (record.inviteOnly ? STATE_FLAG_INVITE_ONLY : 0) |
+                              (record.topicRestricted ? STATE_FLAG_TOPIC_RESTRICTED : 0) |
+                              (record.limited ? STATE_FLAG_LIMITED : 0) | (record.secret ? STATE_FLAG_SECRET : 0);
+        putRecordHead(out, record.name, record.topic, record.topicSetter, record.topicTime, record.key,
+                      record.createdTime, record.limit, flags);
+        out.putNumber(record.operators.size(), 4);
+        for (std::vector<std::string>::const_iterator op = record.operators.begin(); op != record.operators.end(); ++op) {
+            out.putString(*op);
+        }
+        ++count;
+    }
+    out.putByte(STATE_RECORD_END);
+    out.putNumber(count, 8);
+    out.putChecksum();
+    bool ok = out.finish() && fsync(fd) == 0;
+    bytes = out.getWritten();
+    return ok;
+}
+
+// Moves a completely written temporary file over the previous state file,
+// so a crash at any point leaves one intact file behind.
+bool ChannelStore::commit() {
+    if (rename(tempPath.c_str(), path.c_str()) != 0) {
+        Logger::warning("Cannot replace state file " + path + ": " + strerror(errno));
+        return false;
+    }
+    Utils::syncDirectoryOf(path);
+    return true;
+}
+
+// The child's copies of the client sockets would keep them in the parent's
+// epoll set after the parent closes them, so it drops every fd but its
+// output file first.
+static void closeInheritedFds(int keep) {
+#ifdef SYS_close_range
+    bool below = keep <= 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0;
+    if (below && syscall(SYS_close_range, keep + 1, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    for (int fd = 3; fd < max; ++fd) {
+        if (fd != keep) {
+            close(fd);
+        }
+    }
+}
+
+// fork() happens between ticks, while the fan-out workers are parked; the
+// child only reads the registry and writes the file (see write()).
+void ChannelStore::startWriter(const std::map<std::string, Channel*>& channels) {
+    lastSaveUs = Utils::nowMicros();
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ++failures;
+        Logger::warning("Cannot write state file " + tempPath + ": " + strerror(errno));
+        return;
+    }
+    unsigned long segment = wal.rotate();
+    long long forkStartUs = Utils::nowMicros();
+    pid_t pid = fork();
+    if (pid == 0) {
+        closeInheritedFds(fd);
+        unsigned long long bytes;
+        _exit(write(fd, channels, segment, bytes) ? 0 : 1);
+    }
+    lastForkUs = Utils::nowMicros() - forkStartUs;
+    close(fd);
+    if (pid < 0) {
+        ++failures;
+        Logger::warning("Cannot fork the state writer: " + std::string(strerror(errno)));
+        return;
+    }
+    writerPid = pid;
+    writerStartUs = forkStartUs;
+    writerChanges = changes;
+    writerSegment = segment;
+}
+
+void ChannelStore::reapWriter(bool block) {
+    if (writerPid < 0) {
+        return;
+    }
+    int status = 0;
+    pid_t done;
+    do {
+        done = waitpid(writerPid, &status, block ? 0 : WNOHANG);
+    } while (done < 0 && errno == EINTR);
+    if (done == 0) {
+        return;
+    }
+    writerPid = -1;
+    struct stat info;
+    bool ok = done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && stat(tempPath.c_str(), &info) == 0;
+    if (ok && commit()) {
+        ++saves;
+        savedChanges = writerChanges;
+        lastSaveBytes = info.st_size;
+        savedBytes += lastSaveBytes;
+        lastSaveDurationUs = Utils::nowMicros() - writerStartUs;
+        wal.discardBefore(writerSegment);
+        return;
+    }
+    ++failures;
+    unlink(tempPath.c_str());
+    Logger::warning("State writer failed; keeping the previous " + path);
+}
+
+// Reaps a finished writer and starts the next one when a save is due.
+void ChannelStore::tick(const std::map<std::string, Channel*>& channels) {
+    if (!isEnabled()) {
+        return;
+    }
+    reapWriter(false);
+    if (writerPid >= 0 || changes == savedChanges || Utils::nowMicros() - lastSaveUs < intervalUs) {
+        return;
+    }
+    startWriter(channels);
+}
+
+// Writes the state in this process and waits for it, for shutdown and
+// hot upgrade.
+bool ChannelStore::save(const std::map<std::string, Channel*>& channels) {
+    if (!isEnabled()) {
+        return false;
+    }
+    reapWriter(true);
+    long long startUs = Utils::nowMicros();
+    lastSaveUs = startUs;
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ++failures;
+        Logger::warning("Cannot write state file " + tempPath + ": " + strerror(errno));
+        return false;
+    }
+    unsigned long segment = wal.rotate();
+    unsigned long long bytes = 0;
+    bool ok = write(fd, channels, segment, bytes);
+    close(fd);
+    if (!ok || !commit()) {
+        ++failures;
+        unlink(tempPath.c_str());
+        Logger::warning("Cannot save channel state to " + path);
+        return false;
+    }
+    ++saves;
+    savedChanges = changes;
+    lastSaveBytes = bytes;
+    savedBytes += bytes;
+    lastSaveDurationUs = Utils::nowMicros() - startUs;
+    wal.discardBefore(segment);
+    return true;
+}
+
+// The fields of a record after its name, as written by putRecordHead()
+// and putOperators().
+void ChannelStore::readRecordBody(StateFileReader& reader, ChannelRecord& record) {
+    reader.getString(record.topic);
+    reader.getString(record.topicSetter);
+    record.topicTime = static_cast<time_t>(reader.getNumber(8));
+    reader.getString(record.key);
+    reader.getString(record.createdTime);
+    record.limit = reader.getNumber(8);
+    unsigned char flags = reader.getByte();
+    record.inviteOnly = flags & STATE_FLAG_INVITE_ONLY;
+    record.topicRestricted = flags & STATE_FLAG_TOPIC_RESTRICTED;
+    record.limited = flags & STATE_FLAG_LIMITED;
+    record.secret = flags & STATE_FLAG_SECRET;
+    size_t ops = reader.getNumber(4);
+    record.operators.resize(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        std::string& nickname = record.operators[i];
+        reader.getString(nickname);
+        std::transform(nickname.begin(), nickname.end(), nickname.begin(), ::tolower);
+    }
+    record.operators.erase(std::remove(record.operators.begin(), record.operators.end(), std::string()),
+                           record.operators.end());
+}
+
+// Parses a state file into `records` and returns the first change log
+// segment it does not cover. Throws if the file fails its checks.
+unsigned long ChannelStore::parse(const std::string& data, time_t& savedAt) {
+    bool current = data.compare(0, STATE_MAGIC_LENGTH, STATE_MAGIC) == 0;
+    if (data.size() < STATE_MAGIC_LENGTH + 8 ||
+        (!current && data.compare(0, STATE_MAGIC_LENGTH, STATE_MAGIC_V1) != 0)) {
+        throw std::runtime_error("not an ircserv state file");
+    }
+    unsigned long long checksum = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < data.size() - 8; ++i) {
+        checksum = (checksum ^ static_cast<unsigned char>(data[i])) * FNV_PRIME;
+    }
+    if (StateFileReader(data, data.size() - 8).getNumber(8) != checksum) {
+        throw std::runtime_error("checksum mismatch");
+    }
+    // Records come in name order, so each insert is hinted at the end.
+    StateFileReader reader(data, STATE_MAGIC_LENGTH);
+    savedAt = static_cast<time_t>(reader.getNumber(8));
+    unsigned long segment = current ? reader.getNumber(8) : 0;
+    unsigned long long count = 0;
+    for (unsigned char tag = reader.getByte(); tag != STATE_RECORD_END; tag = reader.getByte()) {
+        if (tag != STATE_RECORD_CHANNEL) {
+            throw std::runtime_error("unknown record type");
+        }
+        std::string name;
+        reader.getString(name);
+        ChannelRecord& record = records.insert(records.end(), std::make_pair(name, ChannelRecord()))->second;
+        record.name = name;
+        readRecordBody(reader, record);
+        ++count;
+    }
+    if (reader.getNumber(8) != count) {
+        throw std::runtime_error("channel count mismatch");
+    }
+    return segment;
+}
+
+// Reads the state file left by the previous run, then replays the change
+// log segments written after it. A file that fails its checks is moved
+// aside to <file>.bad rather than overwritten by the next save.
+void ChannelStore::load() {
+    if (!isEnabled()) {
+        return;
+    }
+    long long startUs = Utils::nowMicros();
+    records.clear();
+    unsigned long segment = 0;
+    std::string data;
+    if (!Utils::readFile(path, data)) {
+        if (errno == ENOENT) {
+            Logger::info("No state file at " + path + " yet; starting without saved channels");
+        } else {
+            Logger::warning("Cannot read state file " + path + ": " + strerror(errno));
+        }
+    } else {
+        try {
+            time_t savedAt = 0;
+            segment = parse(data, savedAt);
+            std::ostringstream message;
+            message << "Loaded " << records.size() << " saved channels from " << path << " in "
+                    << (Utils::nowMicros() - startUs) / 1000.0 << " ms (saved " << time(NULL) - savedAt << " s ago)";
+            Logger::info(message.str());
+        } catch (const std::exception& e) {
+            records.clear();
+            std::string aside = path + ".bad";
+            rename(path.c_str(), aside.c_str());
+            Logger::warning("Ignoring state file " + path + " (" + e.what() + "); moved to " + aside);
+        }
+    }
+    std::string().swap(data);
+    if (wal.isEnabled()) {
+        wal.open(wal.replay(records, segment));
+    }
+    loaded = records.size();
+    loadDurationUs = Utils::nowMicros() - startUs;
+}
+
+const ChannelRecord* ChannelStore::find(const std::string& name) const {
+    std::map<std::string, ChannelRecord>::const_iterator it = records.find(name);
+    return it == records.end() ? NULL : &it->second;
+}
+
+// The channel is live again; from now on it is saved from the registry.
+void ChannelStore::claim(const std::string& name) {
+    if (records.erase(name)) {
+        noteChange();
+    }
+}
+
+size_t ChannelStore::size() const { return records.size(); }
+
+// Writes the changes of this tick to the change log and the replication
+// stream, if there are any.
+void ChannelStore::commitLog() { wal.commit(); }
+
+WriteAheadLog& ChannelStore::getLog() { return wal; }
+
+const std::map<std::string, ChannelRecord>& ChannelStore::getRecords() const { return records; }
+
+// Takes the channels a standby replicated as the saved ones, on promotion.
+void ChannelStore::adopt(std::map<std::string, ChannelRecord>& replica) {
+    records.swap(replica);
+    replica.clear();
+    loaded = records.size();
+    noteChange();
+}
+
+void ChannelStore::appendMetrics(MetricsWriter& writer) const {
+    writer.gauge("ircserv_state_enabled", "Whether channel state is saved to IRCSERV_STATE_FILE", isEnabled());
+    writer.counter("ircserv_state_saves_total", "State files written", saves);
+    writer.counter("ircserv_state_save_failures_total", "State file writes that failed", failures);
+    writer.gauge("ircserv_state_save_in_progress", "Whether a forked state writer is running", writerPid >= 0);
+    writer.gauge("ircserv_state_last_save_seconds", "Time from start to commit of the last state file",
+                 lastSaveDurationUs / 1e6);
+    writer.gauge("ircserv_state_last_fork_seconds", "Time the event loop spent in fork() for the last state file",
+                 lastForkUs / 1e6);
+    writer.gauge("ircserv_state_last_save_bytes", "Size of the last state file", lastSaveBytes);
+    writer.gauge("ircserv_state_loaded_channels", "Channels loaded from the state file at startup", loaded);
+    writer.gauge("ircserv_state_load_seconds", "Time spent loading the state file and replaying the change log",
+                 loadDurationUs / 1e6);
+    writer.gauge("ircserv_state_unclaimed_channels", "Loaded channels nobody has joined yet", records.size());
+    writer.counter("ircserv_state_bytes_total", "Bytes written to state files", savedBytes);
+    wal.appendMetrics(writer, savedBytes);
+}
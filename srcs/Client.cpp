@@ -1,50 +1,174 @@
 #include "Includes.hpp"
 #include <stdexcept>
 
+std::vector<int> Client::pendingFlush;
+unsigned long Client::nextSerial = 0;
+size_t Client::sendqLimits[2] = {SENDQ_DEFAULT_UNREGISTERED, SENDQ_DEFAULT_REGISTERED};
+size_t Client::sendqHighWater = 0;
+unsigned long long Client::sendqEvictions = 0;
+
 Client::Client()
-    : fd(-1), registered(false), authenticated(false), nickSet(false), userSet(false), realname(""), greeted(false)
+    : fd(-1), address(INADDR_NONE), registered(false), authenticated(false), nickSet(false), userSet(false),
+      greeted(false), ircOperator(false), writeArmed(false), backlogged(false), throttled(false), sendqExceeded(false), closing(false), identity(NULL), commandBuffer(NULL),
+      outBuffer(NULL), floodClock(0), fanoutStamp(0), serial(++nextSerial), accountedIdentity(0), accountedInput(0), accountedOutput(0)
 {
+    MemoryAccounting::add(MEM_CLIENTS, sizeof(Client));
     Logger::info(LOG_CLIENT_CREATED);
 }
 
 Client::~Client() {
+    MemoryAccounting::add(MEM_CLIENTS, -static_cast<long long>(sizeof(Client) + accountedIdentity));
+    MemoryAccounting::add(MEM_INPUT_BUFFERS, -static_cast<long long>(accountedInput));
+    MemoryAccounting::add(MEM_OUTPUT_BUFFERS, -static_cast<long long>(accountedOutput));
+    delete[] identity;
+    delete commandBuffer;
+    delete outBuffer;
+    SnapshotCache::invalidate();
     if (fd >= 0) {
-        close(fd);
         Logger::info(LOG_CLIENT_DISCONNECTED(fd));
     }
 }
 
+static SlabPool& clientPool() {
+    static SlabPool pool("client", sizeof(Client), POOL_CACHE_LINE);
+    return pool;
+}
+
+void* Client::operator new(size_t size) {
+    if (size != sizeof(Client)) {
+        return ::operator new(size);
+    }
+    return clientPool().allocate();
+}
+
+// Sized so that anything operator new passed to the global heap goes back there.
+void Client::operator delete(void* ptr, size_t size) {
+    if (size != sizeof(Client)) {
+        ::operator delete(ptr);
+        return;
+    }
+    clientPool().deallocate(ptr);
+}
+
 int Client::getFd() const { return fd; }
-std::string Client::getIPAddress() const { return IPAddress; }
-std::string Client::getNickname() const { return nickname; }
-std::string Client::getUsername() const { return username; }
-std::string Client::getHostname() const { return hostname; }
-std::string Client::getRealname() const { return realname; }
+unsigned long Client::getSerial() const { return serial; }
+in_addr_t Client::getAddress() const { return address; }
+
+std::string Client::getIPAddress() const {
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = address;
+    if (!inet_ntop(AF_INET, &addr, ip, sizeof(ip))) {
+        return "";
+    }
+    return ip;
+}
+std::string Client::getNickname() const { return getIdentityField(IDENTITY_NICKNAME); }
+std::string Client::getUsername() const { return getIdentityField(IDENTITY_USERNAME); }
+std::string Client::getHostname() const { return getIdentityField(IDENTITY_HOSTNAME); }
+std::string Client::getRealname() const { return getIdentityField(IDENTITY_REALNAME); }
 bool Client::isRegistered() const { return registered; }
 bool Client::isAuthenticated() const { return authenticated; }
 bool Client::isNickSet() const { return nickSet; }
 bool Client::isUserSet() const { return userSet; }
-std::string& Client::getCommandBuffer() { return commandBuffer; }
+
+// The identity block stores every field as a 16-bit length followed by its bytes.
+const char* Client::findIdentityField(IdentityField field, size_t& length) const {
+    length = 0;
+    if (!identity) {
+        return NULL;
+    }
+    const char* p = identity;
+    for (int i = 0; i < IDENTITY_FIELD_COUNT; ++i) {
+        unsigned short fieldLength;
+        std::memcpy(&fieldLength, p, sizeof(fieldLength));
+        p += sizeof(fieldLength);
+        if (i == field) {
+            length = fieldLength;
+            return p;
+        }
+        p += fieldLength;
+    }
+    return NULL;
+}
+
+std::string Client::getIdentityField(IdentityField field) const {
+    size_t length;
+    const char* data = findIdentityField(field, length);
+    return data ? std::string(data, length) : std::string();
+}
+
+// The nickname bytes in place, without the copy getNickname() makes.
+const char* Client::peekNickname(size_t& length) const {
+    return findIdentityField(IDENTITY_NICKNAME, length);
+}
+
+void Client::setIdentityField(IdentityField field, const std::string& value) {
+    std::string fields[IDENTITY_FIELD_COUNT];
+    size_t total = 0;
+    bool empty = true;
+    for (int i = 0; i < IDENTITY_FIELD_COUNT; ++i) {
+        fields[i] = (i == field) ? value.substr(0, 0xFFFF) : getIdentityField(static_cast<IdentityField>(i));
+        total += sizeof(unsigned short) + fields[i].size();
+        empty = empty && fields[i].empty();
+    }
+
+    delete[] identity;
+    identity = NULL;
+    if (!empty) {
+        identity = new char[total];
+        char* p = identity;
+        for (int i = 0; i < IDENTITY_FIELD_COUNT; ++i) {
+            unsigned short length = static_cast<unsigned short>(fields[i].size());
+            std::memcpy(p, &length, sizeof(length));
+            p += sizeof(length);
+            std::memcpy(p, fields[i].data(), length);
+            p += length;
+        }
+    }
+    syncMemory();
+}
+
+size_t Client::identityBytes() const {
+    if (!identity) {
+        return 0;
+    }
+    const char* p = identity;
+    for (int i = 0; i < IDENTITY_FIELD_COUNT; ++i) {
+        unsigned short length;
+        std::memcpy(&length, p, sizeof(length));
+        p += sizeof(length) + length;
+    }
+    return static_cast<size_t>(p - identity);
+}
 
 void Client::setFd(int fd) { this->fd = fd; }
-void Client::setIPAddress(const std::string& ipAddress) { this->IPAddress = ipAddress; }
+void Client::setIPAddress(const std::string& ipAddress) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ipAddress.c_str(), &addr) == 1) {
+        address = addr.s_addr;
+    } else {
+        address = INADDR_NONE;
+    }
+}
 void Client::setNickname(const std::string& nickname) {
-    this->nickname = nickname;
+    setIdentityField(IDENTITY_NICKNAME, nickname);
     nickSet = !nickname.empty();
+    SnapshotCache::invalidate();
     Logger::info(LOG_NICK_SET(nickname));
 }
 void Client::setUsername(const std::string& username) {
-    this->username = username;
+    setIdentityField(IDENTITY_USERNAME, username);
     userSet = !username.empty();
     Logger::info(LOG_USERNAME_SET(username));
 }
 void Client::setHostname(const std::string& hostname) {
-    this->hostname = hostname;
+    setIdentityField(IDENTITY_HOSTNAME, hostname);
     Logger::info(LOG_HOSTNAME_SET(hostname));
 }
 
 void Client::setRealname(const std::string& realname) {
-    this->realname = realname;
+    setIdentityField(IDENTITY_REALNAME, realname);
     Logger::info("Realname set to: " + realname);
 }
 
@@ -54,6 +178,7 @@ void Client::setAuthenticated(bool status) {
 }
 void Client::setRegistered(bool status) {
     registered = status;
+    SnapshotCache::invalidate();
     Logger::info(LOG_REG_STATUS(status));
 }
 void Client::setNickSet(bool status) { nickSet = status; }
@@ -62,8 +187,69 @@ void Client::setUserSet(bool status) { userSet = status; }
 bool Client::isGreeted() const { return greeted; }
 void Client::setGreeted(bool greeted) { this->greeted = greeted; }
 
+bool Client::isIrcOperator() const { return ircOperator; }
+void Client::setIrcOperator(bool status) {
+    ircOperator = status;
+    Logger::info("IRC operator status for fd " + Utils::intToString(fd) + " set to: " + (status ? "true" : "false"));
+}
+
 void Client::appendToCommandBuffer(const std::string& data) {
-    commandBuffer += data;
+    appendToCommandBuffer(data.data(), data.size());
+}
+
+void Client::appendToCommandBuffer(const char* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (!commandBuffer) {
+        commandBuffer = new std::string;
+    }
+    commandBuffer->append(data, length);
+    syncMemory();
+}
+
+bool Client::hasCompleteLine() const {
+    return commandBuffer && commandBuffer->find('\n') != std::string::npos;
+}
+
+std::string Client::popLine() {
+    size_t pos = commandBuffer->find('\n');
+    size_t end = pos;
+    if (pos > 0 && (*commandBuffer)[pos - 1] == '\r') {
+        end = pos - 1;
+    }
+    std::string line = commandBuffer->substr(0, end);
+    commandBuffer->erase(0, pos + 1);
+    if (commandBuffer->empty()) {
+        releaseCommandBuffer();
+    }
+    return line;
+}
+
+void Client::releaseCommandBuffer() {
+    delete commandBuffer;
+    commandBuffer = NULL;
+    syncMemory();
+}
+
+void Client::releaseOutBuffer() {
+    delete outBuffer;
+    outBuffer = NULL;
+    syncMemory();
+}
+
+void Client::syncMemory() {
+    size_t input = 0;
+    size_t output = 0;
+    if (commandBuffer) {
+        input = sizeof(std::string) + MemoryAccounting::stringBytes(*commandBuffer);
+    }
+    if (outBuffer) {
+        output = sizeof(std::string) + MemoryAccounting::stringBytes(*outBuffer);
+    }
+    MemoryAccounting::update(MEM_CLIENTS, accountedIdentity, identityBytes());
+    MemoryAccounting::update(MEM_INPUT_BUFFERS, accountedInput, input);
+    MemoryAccounting::update(MEM_OUTPUT_BUFFERS, accountedOutput, output);
 }
 
 std::string Client::formatReply(const std::string& reply) {
@@ -78,38 +264,192 @@ std::string Client::formatReply(const std::string& reply) {
     return formatted;
 }
 
-void Client::handleSendResult(ssize_t bytesSent, const std::string& formattedReply)
+bool Client::handleSendError()
 {
-    if (bytesSent < 0)
+    if (errno == EPIPE || errno == ECONNRESET)
     {
-        if (errno == EPIPE || errno == ECONNRESET)
-        {
-            Logger::warning("Peer already closed fd " + Utils::intToString(fd));
-        }
-        else
-        {
-            throw std::invalid_argument(LOG_SEND_FAILED(fd, strerror(errno)));
-        }
+        Logger::warning("Peer already closed fd " + Utils::intToString(fd));
+    }
+    else
+    {
+        Logger::warning(LOG_SEND_FAILED(fd, strerror(errno)));
+    }
+    releaseOutBuffer();
+    return false;
+}
+
+void Client::sendReply(const std::string& reply) {
+    queueOutput(formatReply(reply));
+}
+
+OutputTally::OutputTally() : flush(NULL), outputBytes(0), highWater(0), evictions(0) {}
+
+void Client::queueOutput(const std::string& data) {
+    OutputTally tally;
+    appendOutput(data, tally);
+    commitOutput(tally);
+}
+
+// A reader that falls more than its SendQ behind is not worth the memory:
+// its backlog is replaced by a final ERROR line and the flush phase closes
+// the connection. Disconnecting here is not safe, since callers may be
+// iterating over a channel the client belongs to.
+// Touches only this client and `tally`, so fan-out workers may call it for
+// disjoint clients while the loop thread waits.
+void Client::appendOutput(const std::string& data, OutputTally& tally) {
+    if (data.empty() || sendqExceeded) {
         return;
     }
+    std::vector<int>& flush = tally.flush ? *tally.flush : pendingFlush;
+    if (!outBuffer) {
+        outBuffer = new std::string;
+        flush.push_back(fd);
+    }
+    size_t before = accountedOutput;
+    size_t limit = getSendqLimit();
+    if (limit > 0 && outBuffer->size() + data.size() > limit) {
+        sendqExceeded = true;
+        ++tally.evictions;
+        outBuffer->assign(SENDQ_EXCEEDED_ERROR);
+        flush.push_back(fd);
+    } else {
+        outBuffer->append(data);
+        tally.highWater = std::max(tally.highWater, outBuffer->size());
+    }
+    accountedOutput = sizeof(std::string) + MemoryAccounting::stringBytes(*outBuffer);
+    tally.outputBytes += static_cast<long long>(accountedOutput) - static_cast<long long>(before);
+}
 
-    if (static_cast<size_t>(bytesSent) < formattedReply.length())
-    {
-        Logger::warning(LOG_PARTIAL_SEND(fd, bytesSent, formattedReply.length()));
+void Client::commitOutput(OutputTally& tally) {
+    if (tally.outputBytes != 0) {
+        MemoryAccounting::add(MEM_OUTPUT_BUFFERS, tally.outputBytes);
     }
-    else
-    {
+    sendqHighWater = std::max(sendqHighWater, tally.highWater);
+    sendqEvictions += tally.evictions;
+    if (tally.flush && tally.flush != &pendingFlush) {
+        pendingFlush.insert(pendingFlush.end(), tally.flush->begin(), tally.flush->end());
+        tally.flush->clear();
+    }
+    tally.outputBytes = 0;
+    tally.highWater = 0;
+    tally.evictions = 0;
+}
 
+bool Client::flushOutput(Transport& transport) {
+    if (!outBuffer) {
+        return true;
     }
+    while (!outBuffer->empty()) {
+        ssize_t bytesSent = transport.write(fd, outBuffer->data(), outBuffer->size());
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            return handleSendError();
+        }
+        if (static_cast<size_t>(bytesSent) < outBuffer->size()) {
+            Logger::warning(LOG_PARTIAL_SEND(fd, bytesSent, outBuffer->size()));
+        }
+        outBuffer->erase(0, bytesSent);
+    }
+    releaseOutBuffer();
+    return true;
 }
 
-void Client::sendReply(const std::string& reply) {
-    std::string formattedReply = formatReply(reply);
-    ssize_t bytesSent = send(fd, formattedReply.c_str(), formattedReply.length(), 0);
-    handleSendResult(bytesSent, formattedReply);
+bool Client::hasPendingOutput() const { return outBuffer != NULL; }
+size_t Client::getInputBufferSize() const { return commandBuffer ? commandBuffer->size() : 0; }
+size_t Client::getOutputBufferSize() const { return outBuffer ? outBuffer->size() : 0; }
+size_t Client::getBufferedBytes() const { return getInputBufferSize() + getOutputBufferSize(); }
+bool Client::isWriteArmed() const { return writeArmed; }
+void Client::setWriteArmed(bool armed) { writeArmed = armed; }
+
+bool Client::isBacklogged() const { return backlogged; }
+void Client::setBacklogged(bool queued) { backlogged = queued; }
+
+bool Client::isThrottled() const { return throttled; }
+void Client::setThrottled(bool paused) { throttled = paused; }
+
+long long Client::getFloodClock() const { return floodClock; }
+void Client::setFloodClock(long long clockUs) { floodClock = clockUs; }
+
+bool Client::isClosing() const { return closing; }
+void Client::markClosing() { closing = true; }
+
+unsigned long Client::getFanoutStamp() const { return fanoutStamp; }
+void Client::setFanoutStamp(unsigned long generation) { fanoutStamp = generation; }
+
+void Client::takePendingFlush(std::vector<int>& fds) {
+    fds.clear();
+    fds.swap(pendingFlush);
+}
+
+bool Client::isSendqExceeded() const { return sendqExceeded; }
+
+size_t Client::getSendqLimit() const { return sendqLimits[registered ? 1 : 0]; }
+
+void Client::setSendqLimits(size_t registered, size_t unregistered) {
+    sendqLimits[0] = unregistered;
+    sendqLimits[1] = registered;
+}
+
+size_t Client::getSendqHighWater() { return sendqHighWater; }
+
+unsigned long long Client::getSendqEvictions() { return sendqEvictions; }
+
+void Client::appendMetrics(MetricsWriter& writer) {
+    writer.gauge("ircserv_sendq_limit_bytes", "Send queue limit of registered clients", sendqLimits[1],
+                 "class=\"registered\"");
+    writer.gauge("ircserv_sendq_limit_bytes", "Send queue limit of unregistered clients", sendqLimits[0],
+                 "class=\"unregistered\"");
+    writer.gauge("ircserv_sendq_high_water_bytes", "Largest send queue seen since startup", sendqHighWater);
+    writer.counter("ircserv_sendq_evictions_total", "Clients disconnected for exceeding their send queue",
+                   sendqEvictions);
+}
+
+// Everything a successor process needs to carry the connection on; the fd
+// is not part of it, the socket itself is passed alongside.
+void Client::saveState(StateWriter& writer) const {
+    writer.putString(getIPAddress());
+    for (int field = 0; field < IDENTITY_FIELD_COUNT; ++field) {
+        writer.putString(getIdentityField(static_cast<IdentityField>(field)));
+    }
+    writer.putFlag(registered);
+    writer.putFlag(authenticated);
+    writer.putFlag(nickSet);
+    writer.putFlag(userSet);
+    writer.putFlag(greeted);
+    writer.putFlag(ircOperator);
+    writer.putString(commandBuffer ? *commandBuffer : std::string());
+    writer.putString(outBuffer ? *outBuffer : std::string());
+}
+
+// Expects the fd to be set already, so restored output is queued for it.
+void Client::restoreState(StateReader& reader) {
+    setIPAddress(reader.getString());
+    for (int field = 0; field < IDENTITY_FIELD_COUNT; ++field) {
+        setIdentityField(static_cast<IdentityField>(field), reader.getString());
+    }
+    registered = reader.getFlag();
+    authenticated = reader.getFlag();
+    nickSet = reader.getFlag();
+    userSet = reader.getFlag();
+    greeted = reader.getFlag();
+    ircOperator = reader.getFlag();
+    std::string input = reader.getString();
+    if (!input.empty()) {
+        appendToCommandBuffer(input);
+    }
+    std::string output = reader.getString();
+    if (!output.empty()) {
+        queueOutput(output);
+    }
+    SnapshotCache::invalidate();
 }
 
-void Client::sendWelcomeHowTo(int fd)
+void Client::sendWelcomeHowTo()
 {
     const char *lines[] = {
         ":ircserv NOTICE * :Welcome! Please register in this exact order:\r\n",
@@ -120,5 +460,5 @@ void Client::sendWelcomeHowTo(int fd)
         NULL
     };
     for (const char **p = lines; *p; ++p)
-        send(fd, *p, strlen(*p), MSG_NOSIGNAL);
+        queueOutput(*p);
 }
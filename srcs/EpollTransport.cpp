@@ -0,0 +1,173 @@
+#include "Includes.hpp"
+#include "EpollTransport.hpp"
+
+EpollTransport::EpollTransport() : sock_fd(-1), epfd(-1), spareFd(open("/dev/null", O_RDONLY | O_CLOEXEC)) {
+    std::memset(&serverAddress, 0, sizeof(serverAddress));
+}
+
+EpollTransport::~EpollTransport() {
+    if (sock_fd >= 0) {
+        ::close(sock_fd);
+        Logger::info("Server socket closed.");
+    }
+    if (epfd >= 0) {
+        ::close(epfd);
+        Logger::info("Epoll file descriptor closed.");
+    }
+    if (spareFd >= 0) {
+        ::close(spareFd);
+    }
+}
+
+void EpollTransport::listen(int port) {
+    createSocket();
+    configureServerAddress(port);
+    setReuseAddr();
+    bindSocket();
+    listenOnSocket();
+    initEpoll();
+}
+
+// Takes over a socket that is already listening, passed on by the process
+// this one upgraded.
+void EpollTransport::adopt(int listenFd) {
+    sock_fd = listenFd;
+    initEpoll();
+}
+
+// Sockets are close-on-exec so that a hot upgrade's new process only holds
+// the ones it is explicitly handed.
+void EpollTransport::createSocket() {
+    sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
+    }
+    Logger::info("Socket created successfully.");
+}
+
+void EpollTransport::configureServerAddress(int port) {
+    std::memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    serverAddress.sin_port = htons(port);
+}
+
+void EpollTransport::setReuseAddr() {
+    int optval = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        throw std::runtime_error("Failed to set SO_REUSEADDR: " + std::string(strerror(errno)));
+    }
+}
+
+void EpollTransport::bindSocket() {
+    if (bind(sock_fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        throw std::runtime_error("Failed to bind socket: " + std::string(strerror(errno)));
+    }
+    Logger::info("Socket bound successfully.");
+}
+
+void EpollTransport::listenOnSocket() {
+    if (::listen(sock_fd, SOMAXCONN) < 0) {
+        throw std::runtime_error("Failed to listen on socket: " + std::string(strerror(errno)));
+    }
+    Logger::info("Server listening on socket with maximum connections.");
+}
+
+void EpollTransport::initEpoll() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sock_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
+        throw std::runtime_error("Failed to add socket to epoll: " + std::string(strerror(errno)));
+    }
+}
+
+bool EpollTransport::isListener(int fd) const { return fd == sock_fd; }
+
+int EpollTransport::getListenFd() const { return sock_fd; }
+
+int EpollTransport::wait(std::vector<TransportEvent>& events, int timeoutMs) {
+    epollEvents.resize(events.size());
+    int nfds = epoll_wait(epfd, &epollEvents[0], static_cast<int>(epollEvents.size()), timeoutMs);
+    for (int i = 0; i < nfds; ++i) {
+        uint32_t flags = epollEvents[i].events;
+        events[i].fd = epollEvents[i].data.fd;
+        events[i].flags = 0;
+        if (flags & EPOLLIN) {
+            events[i].flags |= TRANSPORT_READABLE;
+        }
+        if (flags & EPOLLOUT) {
+            events[i].flags |= TRANSPORT_WRITABLE;
+        }
+        if (flags & (EPOLLHUP | EPOLLERR)) {
+            events[i].flags |= TRANSPORT_HANGUP;
+        }
+    }
+    return nfds;
+}
+
+int EpollTransport::accept(struct sockaddr_in& address) {
+    socklen_t length = sizeof(address);
+    int fd = ::accept4(sock_fd, (struct sockaddr*)&address, &length, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        Utils::setnonblocking(fd);
+    } else if (errno == EMFILE || errno == ENFILE) {
+        return shedConnection(address);
+    }
+    return fd;
+}
+
+// Out of descriptors, the pending connection would keep the level-triggered
+// listener readable and spin the loop. Give up the spare descriptor long
+// enough to accept and close it, then take the spare back.
+int EpollTransport::shedConnection(struct sockaddr_in& address) {
+    int error = errno;
+    if (spareFd >= 0) {
+        ::close(spareFd);
+        socklen_t length = sizeof(address);
+        int fd = ::accept(sock_fd, (struct sockaddr*)&address, &length);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    errno = error;
+    return -1;
+}
+
+bool EpollTransport::watch(int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLHUP | EPOLLERR;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool EpollTransport::watchWakeup(int fd) { return watch(fd); }
+
+bool EpollTransport::setWritable(int fd, bool enabled) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLHUP | EPOLLERR;
+    if (enabled) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+ssize_t EpollTransport::read(int fd, char* buffer, size_t length) {
+    return ::recv(fd, buffer, length, MSG_DONTWAIT);
+}
+
+ssize_t EpollTransport::write(int fd, const char* data, size_t length) {
+    return ::send(fd, data, length, MSG_NOSIGNAL);
+}
+
+// Closing the fd also drops it from the epoll set.
+void EpollTransport::close(int fd) {
+    ::close(fd);
+}
@@ -0,0 +1,38 @@
+#include "Includes.hpp"
+#include "Fanout.hpp"
+
+unsigned long PeerFanout::generation = 0;
+
+// Also used by message routing to de-duplicate recipients across targets.
+unsigned long PeerFanout::nextGeneration() { return ++generation; }
+
+std::vector<Channel*> PeerFanout::sharedChannels(Server* server, Client* source) {
+    std::vector<Channel*> found;
+    std::map<std::string, Channel*>& channels = server->getChannels();
+    for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (it->second->isMember(source)) {
+            found.push_back(it->second);
+        }
+    }
+    return found;
+}
+
+// Returns the number of peers reached, not counting the echo to the source.
+size_t PeerFanout::send(const std::vector<Channel*>& channels, Client* source, const std::string& line, bool echo) {
+    AllocScope allocations("fanout");
+    std::string formatted = source->formatReply(line);
+    unsigned long stamp = nextGeneration();
+    source->setFanoutStamp(stamp);
+    if (echo) {
+        source->queueOutput(formatted);
+    }
+    size_t reached = 0;
+    for (std::vector<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        reached += (*it)->deliverOnce(formatted, stamp);
+    }
+    return reached;
+}
+
+size_t PeerFanout::send(Server* server, Client* source, const std::string& line, bool echo) {
+    return send(sharedChannels(server, source), source, line, echo);
+}
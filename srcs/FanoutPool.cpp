@@ -0,0 +1,259 @@
+#include "Includes.hpp"
+#include "FanoutPool.hpp"
+#include "Metrics.hpp"
+
+static size_t defaultThreads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 1) {
+        return 0;
+    }
+    return std::min<size_t>(static_cast<size_t>(cpus - 1), FANOUT_MAX_THREADS);
+}
+
+FanoutPool::FanoutPool()
+    : threads(std::min<size_t>(Utils::envToSize("IRCSERV_FANOUT_THREADS", defaultThreads()), FANOUT_MAX_THREADS)),
+      threshold(Utils::envToSize("IRCSERV_FANOUT_THRESHOLD", FANOUT_DEFAULT_THRESHOLD)),
+      sliceSize(std::max<size_t>(1, Utils::envToSize("IRCSERV_FANOUT_SLICE", FANOUT_DEFAULT_SLICE))),
+      started(false), stopping(false), jobs(0), pending(0), line(NULL), generation(0), parallelFanouts(0),
+      slicesRun(0), steals(0)
+{
+    pthread_mutex_init(&stateLock, NULL);
+    pthread_cond_init(&wake, NULL);
+    pthread_cond_init(&done, NULL);
+}
+
+FanoutPool::~FanoutPool() {
+    stop();
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&stateLock);
+}
+
+FanoutPool& FanoutPool::instance() {
+    static FanoutPool pool;
+    return pool;
+}
+
+// Takes effect on the next fan-out; running workers are stopped first.
+void FanoutPool::configure(size_t threadCount, size_t minRecipients, size_t recipientsPerSlice) {
+    stop();
+    threads = std::min<size_t>(threadCount, FANOUT_MAX_THREADS);
+    threshold = minRecipients;
+    sliceSize = std::max<size_t>(1, recipientsPerSlice);
+}
+
+bool FanoutPool::accepts(size_t recipientCount) const {
+    return threads > 0 && recipientCount >= threshold && recipientCount > sliceSize;
+}
+
+size_t FanoutPool::getThreads() const { return threads; }
+
+// Workers block every signal so that SIGINT and friends keep interrupting
+// epoll_wait on the loop thread.
+void FanoutPool::start() {
+    if (started) {
+        return;
+    }
+    for (size_t i = 0; i <= threads; ++i) {
+        Queue* queue = new Queue;
+        pthread_mutex_init(&queue->lock, NULL);
+        queues.push_back(queue);
+    }
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    for (size_t i = 1; i <= threads; ++i) {
+        Worker* worker = new Worker;
+        worker->pool = this;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, workerMain, worker) != 0) {
+            Logger::warning("Fan-out worker " + Utils::intToString(i) + " could not be started");
+            delete worker;
+            break;
+        }
+        workers.push_back(worker);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    started = true;
+}
+
+void FanoutPool::stop() {
+    if (!started) {
+        return;
+    }
+    pthread_mutex_lock(&stateLock);
+    stopping = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&stateLock);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        pthread_join(workers[i]->thread, NULL);
+        delete workers[i];
+    }
+    workers.clear();
+    for (size_t i = 0; i < queues.size(); ++i) {
+        pthread_mutex_destroy(&queues[i]->lock);
+        delete queues[i];
+    }
+    queues.clear();
+    stopping = false;
+    started = false;
+}
+
+void* FanoutPool::workerMain(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->pool->workerLoop(worker->index);
+    return NULL;
+}
+
+void FanoutPool::workerLoop(size_t index) {
+    unsigned long seen = 0;
+    pthread_mutex_lock(&stateLock);
+    for (;;) {
+        while (!stopping && jobs == seen) {
+            pthread_cond_wait(&wake, &stateLock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen = jobs;
+        pthread_mutex_unlock(&stateLock);
+        runTasks(index);
+        pthread_mutex_lock(&stateLock);
+    }
+    pthread_mutex_unlock(&stateLock);
+}
+
+void FanoutPool::runTasks(size_t index) {
+    Task task;
+    while (takeTask(index, task)) {
+        task.fn(task.context, task.slice);
+        finishTask();
+    }
+}
+
+// Own deque from the back, then the others' from the front.
+bool FanoutPool::takeTask(size_t index, Task& task) {
+    Queue* own = queues[index];
+    pthread_mutex_lock(&own->lock);
+    bool found = !own->tasks.empty();
+    if (found) {
+        task = own->tasks.back();
+        own->tasks.pop_back();
+    }
+    pthread_mutex_unlock(&own->lock);
+    for (size_t k = 1; !found && k < queues.size(); ++k) {
+        Queue* victim = queues[(index + k) % queues.size()];
+        pthread_mutex_lock(&victim->lock);
+        found = !victim->tasks.empty();
+        if (found) {
+            task = victim->tasks.front();
+            victim->tasks.pop_front();
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (found) {
+            __sync_fetch_and_add(&steals, 1);
+        }
+    }
+    return found;
+}
+
+void FanoutPool::finishTask() {
+    pthread_mutex_lock(&stateLock);
+    ++slicesRun;
+    if (--pending == 0) {
+        pthread_cond_signal(&done);
+    }
+    pthread_mutex_unlock(&stateLock);
+}
+
+// Runs fn(context, 0 .. slices - 1) across the workers and the calling
+// thread and returns once all of them have finished.
+void FanoutPool::parallelFor(size_t slices, SliceFn fn, void* context) {
+    if (slices == 0) {
+        return;
+    }
+    start();
+    pthread_mutex_lock(&stateLock);
+    pending = slices;
+    pthread_mutex_unlock(&stateLock);
+    for (size_t i = 0; i < slices; ++i) {
+        Task task;
+        task.fn = fn;
+        task.context = context;
+        task.slice = i;
+        Queue* queue = queues[i % queues.size()];
+        pthread_mutex_lock(&queue->lock);
+        queue->tasks.push_back(task);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_mutex_lock(&stateLock);
+    ++jobs;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&stateLock);
+
+    runTasks(0);
+
+    pthread_mutex_lock(&stateLock);
+    while (pending > 0) {
+        pthread_cond_wait(&done, &stateLock);
+    }
+    pthread_mutex_unlock(&stateLock);
+}
+
+std::vector<Client*>& FanoutPool::recipientBuffer() {
+    recipients.clear();
+    return recipients;
+}
+
+void FanoutPool::deliverSlice(void* context, size_t slice) {
+    FanoutPool* pool = static_cast<FanoutPool*>(context);
+    SliceResult& result = pool->results[slice];
+    size_t begin = slice * pool->sliceSize;
+    size_t end = std::min(begin + pool->sliceSize, pool->recipients.size());
+    for (size_t i = begin; i < end; ++i) {
+        Client* recipient = pool->recipients[i];
+        if (pool->generation != 0) {
+            if (recipient->getFanoutStamp() == pool->generation) {
+                continue;
+            }
+            recipient->setFanoutStamp(pool->generation);
+        }
+        recipient->appendOutput(*pool->line, result.tally);
+        ++result.reached;
+    }
+}
+
+// Appends `formatted` to every client in recipientBuffer(). A non-zero
+// generation skips and stamps clients like Channel::deliverOnce does.
+// Returns how many clients were reached.
+size_t FanoutPool::deliver(const std::string& formatted, unsigned long stamp) {
+    size_t slices = (recipients.size() + sliceSize - 1) / sliceSize;
+    if (results.size() < slices) {
+        results.resize(slices);
+    }
+    for (size_t i = 0; i < slices; ++i) {
+        results[i].tally.flush = &results[i].flush;
+        results[i].reached = 0;
+    }
+    line = &formatted;
+    generation = stamp;
+    parallelFor(slices, deliverSlice, this);
+    line = NULL;
+
+    size_t reached = 0;
+    for (size_t i = 0; i < slices; ++i) {
+        Client::commitOutput(results[i].tally);
+        reached += results[i].reached;
+    }
+    recipients.clear();
+    ++parallelFanouts;
+    return reached;
+}
+
+void FanoutPool::appendMetrics(MetricsWriter& writer) const {
+    writer.gauge("ircserv_fanout_threads", "Worker threads helping with large channel fan-out", threads);
+    writer.counter("ircserv_fanout_parallel_total", "Fan-outs split across the worker pool", parallelFanouts);
+    writer.counter("ircserv_fanout_slices_total", "Recipient slices delivered by the worker pool", slicesRun);
+    writer.counter("ircserv_fanout_steals_total", "Slices taken from another thread's queue", steals);
+}
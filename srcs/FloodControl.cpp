@@ -0,0 +1,88 @@
+#include "Includes.hpp"
+#include "FloodControl.hpp"
+#include "Metrics.hpp"
+
+FloodControl::FloodControl()
+    : usPerToken(0), burstUs(0),
+      maxQueue(Utils::envToSize("IRCSERV_FLOOD_MAX_QUEUE", FLOOD_DEFAULT_MAX_QUEUE)), throttles(0), excessFloods(0)
+{
+    size_t rate = Utils::envToSize("IRCSERV_FLOOD_RATE", FLOOD_DEFAULT_RATE);
+    if (rate > 0) {
+        if (rate > FLOOD_MAX_RATE) {
+            Logger::warning("IRCSERV_FLOOD_RATE above 1000000 is not supported; using 1000000");
+            rate = FLOOD_MAX_RATE;
+        }
+        usPerToken = 1000000 / static_cast<long long>(rate);
+        size_t burst = Utils::envToSize("IRCSERV_FLOOD_BURST", FLOOD_DEFAULT_BURST);
+        if (burst > static_cast<unsigned long long>(FLOOD_MAX_BURST_US / usPerToken)) {
+            burst = static_cast<size_t>(FLOOD_MAX_BURST_US / usPerToken);
+            Logger::warning("IRCSERV_FLOOD_BURST is more than a day of tokens; using a day's worth");
+        }
+        burstUs = usPerToken * static_cast<long long>(burst);
+    }
+    parseCosts(FLOOD_DEFAULT_COSTS);
+    const char* overrides = getenv("IRCSERV_FLOOD_COSTS");
+    if (overrides) {
+        parseCosts(overrides);
+    }
+}
+
+FloodControl::~FloodControl() {}
+
+// "CMD=cost,CMD=cost"; later entries override earlier ones.
+void FloodControl::parseCosts(const std::string& spec) {
+    std::list<std::string> entries = Utils::split(spec, ',');
+    for (std::list<std::string>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        size_t equals = it->find('=');
+        if (equals == std::string::npos || equals == 0) {
+            Logger::warning("Ignoring flood cost entry: " + *it);
+            continue;
+        }
+        std::string command = it->substr(0, equals);
+        std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+        costs[command] = static_cast<unsigned int>(std::strtoul(it->c_str() + equals + 1, NULL, 10));
+    }
+}
+
+bool FloodControl::isEnabled() const { return usPerToken > 0; }
+
+unsigned int FloodControl::costOf(const std::string& command) const {
+    std::map<std::string, unsigned int>::const_iterator it = costs.find(command);
+    return it == costs.end() ? 1 : it->second;
+}
+
+void FloodControl::charge(Client* client, const std::string& command, long long nowUs) {
+    if (!isEnabled()) {
+        return;
+    }
+    long long clock = std::max(client->getFloodClock(), nowUs);
+    client->setFloodClock(clock + usPerToken * costOf(command));
+}
+
+long long FloodControl::throttledUntil(const Client* client) const {
+    return client->getFloodClock() - burstUs;
+}
+
+bool FloodControl::isThrottled(const Client* client, long long nowUs) {
+    if (!isEnabled() || throttledUntil(client) <= nowUs) {
+        return false;
+    }
+    ++throttles;
+    return true;
+}
+
+// Input piling up behind a throttle (or a line that never ends) past
+// maxQueue bytes is treated as a flood.
+bool FloodControl::isFlooding(const Client* client) {
+    if (maxQueue == 0 || client->getInputBufferSize() <= maxQueue) {
+        return false;
+    }
+    ++excessFloods;
+    return true;
+}
+
+void FloodControl::appendMetrics(MetricsWriter& writer) const {
+    writer.counter("ircserv_flood_throttles_total", "Times a client was paused for exceeding its command budget",
+                   throttles);
+    writer.counter("ircserv_flood_disconnects_total", "Clients disconnected for Excess Flood", excessFloods);
+}
@@ -0,0 +1,145 @@
+#include "Includes.hpp"
+#include "Mailbox.hpp"
+#include "Metrics.hpp"
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+SharedLine::SharedLine(const std::string& text) : refs(1), text(text) {}
+
+SharedLine::~SharedLine() {}
+
+SharedLine* SharedLine::create(const std::string& text) { return new SharedLine(text); }
+
+void SharedLine::retain() { __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED); }
+
+void SharedLine::release() {
+    if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        delete this;
+    }
+}
+
+const std::string& SharedLine::str() const { return text; }
+
+static size_t roundUpToPowerOfTwo(size_t value) {
+    size_t rounded = 2;
+    while (rounded < value) {
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+// Cell i starts with sequence i: free for the producer that claims
+// position i. Publishing sets it to i + 1 and consuming to i + capacity,
+// which frees it for the producer one lap later.
+Mailbox::Mailbox(size_t capacity)
+    : cells(NULL), mask(roundUpToPowerOfTwo(capacity) - 1), wakeFd(-1), enqueuePos(0), armed(0), posted(0),
+      rejected(0), wakeups(0), dequeuePos(0), delivered(0), stale(0)
+{
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        throw std::runtime_error("Failed to create mailbox eventfd: " + std::string(strerror(errno)));
+    }
+    cells = new Cell[mask + 1];
+    for (size_t i = 0; i <= mask; ++i) {
+        cells[i].sequence = i;
+    }
+}
+
+Mailbox::~Mailbox() {
+    MailItem item;
+    while (take(item)) {
+        item.line->release();
+    }
+    delete[] cells;
+    close(wakeFd);
+}
+
+// Any thread. On success the mailbox owns one reference to item.line.
+bool Mailbox::post(const MailItem& item) {
+    size_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    Cell* cell;
+    for (;;) {
+        cell = &cells[pos & mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = static_cast<long>(sequence) - static_cast<long>(pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+            return false;
+        } else {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&posted, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_exchange_n(&armed, 1, __ATOMIC_ACQ_REL) == 0) {
+        uint64_t one = 1;
+        ssize_t written = write(wakeFd, &one, sizeof(one));
+        (void)written;
+        __atomic_add_fetch(&wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+// The methods below belong to the event loop thread.
+
+bool Mailbox::hasWork() const {
+    if (__atomic_load_n(&armed, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    const Cell& cell = cells[dequeuePos & mask];
+    return __atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) == dequeuePos + 1;
+}
+
+// Clears the wakeup before draining, so a post that races with the drain
+// either is taken by it or writes the eventfd again. Also called whenever
+// the eventfd is reported readable, since such a late write may land after
+// the queue it announced has already been drained.
+void Mailbox::acknowledge() {
+    uint64_t count;
+    ssize_t got = read(wakeFd, &count, sizeof(count));
+    (void)got;
+    __atomic_store_n(&armed, 0, __ATOMIC_SEQ_CST);
+}
+
+bool Mailbox::take(MailItem& item) {
+    Cell& cell = cells[dequeuePos & mask];
+    if (__atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) != dequeuePos + 1) {
+        return false;
+    }
+    item = cell.item;
+    __atomic_store_n(&cell.sequence, dequeuePos + mask + 1, __ATOMIC_RELEASE);
+    ++dequeuePos;
+    return true;
+}
+
+void Mailbox::countDelivered(bool reachedClient) {
+    if (reachedClient) {
+        ++delivered;
+    } else {
+        ++stale;
+    }
+}
+
+int Mailbox::getWakeFd() const { return wakeFd; }
+size_t Mailbox::getCapacity() const { return mask + 1; }
+
+size_t Mailbox::getDepth() const { return __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED) - dequeuePos; }
+
+void Mailbox::appendMetrics(MetricsWriter& writer) const {
+    writer.counter("ircserv_mailbox_posted_total", "Lines posted to the event loop by other threads",
+                   __atomic_load_n(&posted, __ATOMIC_RELAXED));
+    writer.counter("ircserv_mailbox_rejected_total", "Posts refused because the mailbox was full",
+                   __atomic_load_n(&rejected, __ATOMIC_RELAXED));
+    writer.counter("ircserv_mailbox_wakeups_total", "Eventfd writes that woke the event loop",
+                   __atomic_load_n(&wakeups, __ATOMIC_RELAXED));
+    writer.counter("ircserv_mailbox_delivered_total", "Posted lines queued to their client", delivered);
+    writer.counter("ircserv_mailbox_stale_total", "Posted lines dropped because the client had gone", stale);
+    writer.gauge("ircserv_mailbox_depth", "Lines waiting in the mailbox", getDepth());
+    writer.gauge("ircserv_mailbox_capacity", "Mailbox size in lines", getCapacity());
+}
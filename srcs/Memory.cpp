@@ -0,0 +1,70 @@
+#include "Includes.hpp"
+#include "Memory.hpp"
+#include "Metrics.hpp"
+#include <fstream>
+
+long long MemoryAccounting::bytes[MEM_CATEGORY_COUNT];
+long long MemoryAccounting::peakBytes[MEM_CATEGORY_COUNT];
+
+void MemoryAccounting::add(MemoryCategory category, long long delta) {
+    bytes[category] += delta;
+    if (bytes[category] > peakBytes[category]) {
+        peakBytes[category] = bytes[category];
+    }
+}
+
+void MemoryAccounting::update(MemoryCategory category, size_t& accounted, size_t current) {
+    if (current != accounted) {
+        add(category, static_cast<long long>(current) - static_cast<long long>(accounted));
+        accounted = current;
+    }
+}
+
+long long MemoryAccounting::get(MemoryCategory category) { return bytes[category]; }
+long long MemoryAccounting::getPeak(MemoryCategory category) { return peakBytes[category]; }
+
+long long MemoryAccounting::total() {
+    long long sum = 0;
+    for (int i = 0; i < MEM_CATEGORY_COUNT; ++i) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+const char* MemoryAccounting::categoryName(MemoryCategory category) {
+    static const char* names[MEM_CATEGORY_COUNT] = {
+        "clients", "input_buffers", "output_buffers", "channels", "membership", "invites"
+    };
+    return names[category];
+}
+
+// Heap bytes owned by a string: nothing while it fits the inline (SSO) storage.
+size_t MemoryAccounting::stringBytes(const std::string& str) {
+    static const size_t inlineCapacity = std::string().capacity();
+    if (str.capacity() <= inlineCapacity) {
+        return 0;
+    }
+    return str.capacity() + 1;
+}
+
+size_t MemoryAccounting::residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    if (!(statm >> pages >> resident)) {
+        return 0;
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+void MemoryAccounting::appendMetrics(MetricsWriter& writer) {
+    for (int i = 0; i < MEM_CATEGORY_COUNT; ++i) {
+        writer.gauge("ircserv_memory_bytes", "Heap bytes accounted per subsystem", bytes[i],
+                     std::string("category=\"") + categoryName(static_cast<MemoryCategory>(i)) + "\"");
+    }
+    for (int i = 0; i < MEM_CATEGORY_COUNT; ++i) {
+        writer.gauge("ircserv_memory_peak_bytes", "Highest accounted heap bytes per subsystem", peakBytes[i],
+                     std::string("category=\"") + categoryName(static_cast<MemoryCategory>(i)) + "\"");
+    }
+    writer.gauge("ircserv_memory_resident_bytes", "Resident set size of the process", residentBytes());
+}
@@ -0,0 +1,49 @@
+#include "Includes.hpp"
+#include "Metrics.hpp"
+
+static void writeValue(std::ostream& os, double value) {
+    if (value == static_cast<double>(static_cast<long long>(value))) {
+        os << static_cast<long long>(value);
+    } else {
+        os << value;
+    }
+}
+
+MetricsWriter::MetricsWriter() {
+    out.precision(12);
+}
+
+MetricsWriter::~MetricsWriter() {}
+
+void MetricsWriter::describe(const std::string& name, const std::string& type, const std::string& help) {
+    if (described.insert(name).second) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " " << type << "\n";
+    }
+}
+
+void MetricsWriter::counter(const std::string& name, const std::string& help, double value, const std::string& labels) {
+    describe(name, "counter", help);
+    out << name;
+    if (!labels.empty()) {
+        out << "{" << labels << "}";
+    }
+    out << " ";
+    writeValue(out, value);
+    out << "\n";
+}
+
+void MetricsWriter::gauge(const std::string& name, const std::string& help, double value, const std::string& labels) {
+    describe(name, "gauge", help);
+    out << name;
+    if (!labels.empty()) {
+        out << "{" << labels << "}";
+    }
+    out << " ";
+    writeValue(out, value);
+    out << "\n";
+}
+
+std::string MetricsWriter::str() const {
+    return out.str();
+}
@@ -0,0 +1,131 @@
+#include "Pool.hpp"
+#include "Metrics.hpp"
+#include <cstdlib>
+#include <sstream>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON_SLOT(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON_SLOT(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON_SLOT(ptr, size) ((void)(ptr), (void)(size))
+#define UNPOISON_SLOT(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+SlabPool::SlabPool(const char* name, size_t objectSize, size_t alignment)
+    : name(name),
+      objectSize(objectSize),
+      alignment(alignment < sizeof(void*) ? sizeof(void*) : alignment),
+      freeList(NULL),
+      inUse(0),
+      peak(0),
+      allocations(0),
+      frees(0)
+{
+    size_t size = objectSize < sizeof(FreeSlot) ? sizeof(FreeSlot) : objectSize;
+    slotSize = (size + this->alignment - 1) / this->alignment * this->alignment;
+    slotsPerSlab = POOL_SLAB_BYTES / slotSize;
+    if (slotsPerSlab == 0) {
+        slotsPerSlab = 1;
+    }
+    registry().push_back(this);
+}
+
+SlabPool::~SlabPool() {
+    for (std::vector<void*>::iterator it = slabs.begin(); it != slabs.end(); ++it) {
+        UNPOISON_SLOT(*it, slotsPerSlab * slotSize);
+        free(*it);
+    }
+    std::vector<SlabPool*>& pools = registry();
+    for (std::vector<SlabPool*>::iterator it = pools.begin(); it != pools.end(); ++it) {
+        if (*it == this) {
+            pools.erase(it);
+            break;
+        }
+    }
+}
+
+void SlabPool::grow() {
+    void* slab = NULL;
+    if (posix_memalign(&slab, alignment, slotsPerSlab * slotSize) != 0) {
+        throw std::bad_alloc();
+    }
+    slabs.push_back(slab);
+
+    char* base = static_cast<char*>(slab);
+    for (size_t i = slotsPerSlab; i > 0; --i) {
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(base + (i - 1) * slotSize);
+        slot->next = freeList;
+        freeList = slot;
+        POISON_SLOT(slot, slotSize);
+    }
+}
+
+void* SlabPool::allocate() {
+    if (!freeList) {
+        grow();
+    }
+    FreeSlot* slot = freeList;
+    UNPOISON_SLOT(slot, slotSize);
+    freeList = slot->next;
+    ++allocations;
+    if (++inUse > peak) {
+        peak = inUse;
+    }
+    return slot;
+}
+
+void SlabPool::deallocate(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    FreeSlot* slot = static_cast<FreeSlot*>(ptr);
+    slot->next = freeList;
+    freeList = slot;
+    POISON_SLOT(slot, slotSize);
+    ++frees;
+    --inUse;
+}
+
+PoolStats SlabPool::stats() const {
+    PoolStats result;
+    result.name = name;
+    result.objectSize = objectSize;
+    result.slotSize = slotSize;
+    result.slabs = slabs.size();
+    result.capacity = slabs.size() * slotsPerSlab;
+    result.inUse = inUse;
+    result.peak = peak;
+    result.allocations = allocations;
+    result.frees = frees;
+    return result;
+}
+
+std::vector<SlabPool*>& SlabPool::registry() {
+    static std::vector<SlabPool*> pools;
+    return pools;
+}
+
+void SlabPool::appendMetrics(MetricsWriter& writer) {
+    std::vector<SlabPool*>& pools = registry();
+    std::vector<PoolStats> stats;
+    std::vector<std::string> labels;
+    for (std::vector<SlabPool*>::iterator it = pools.begin(); it != pools.end(); ++it) {
+        stats.push_back((*it)->stats());
+        std::ostringstream oss;
+        oss << "pool=\"" << stats.back().name << "\",object_size=\"" << stats.back().objectSize << "\"";
+        labels.push_back(oss.str());
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        writer.gauge("ircserv_pool_slots_in_use", "Pool slots currently allocated", stats[i].inUse, labels[i]);
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        writer.gauge("ircserv_pool_slots_capacity", "Pool slots carved from slabs", stats[i].capacity, labels[i]);
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        writer.gauge("ircserv_pool_bytes", "Slab memory held by the pool", stats[i].capacity * stats[i].slotSize, labels[i]);
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        writer.counter("ircserv_pool_allocations_total", "Allocations served by the pool", stats[i].allocations, labels[i]);
+    }
+}
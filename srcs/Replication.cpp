@@ -0,0 +1,427 @@
+#include "Includes.hpp"
+#include "Replication.hpp"
+#include "Channel.hpp"
+#include "Metrics.hpp"
+#include "Transport.hpp"
+#include <sys/time.h>
+#include <sys/un.h>
+
+// SYNC stamps use the wall clock so that lag means something between two
+// machines with synchronized clocks, not only between two processes.
+static long long wallMicros() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return static_cast<long long>(now.tv_sec) * 1000000LL + now.tv_usec;
+}
+
+// A replication address is a Unix socket path if it contains a '/', else
+// [<IPv4 address>:]<port>, on 127.0.0.1 by default. Returns a close-on-exec
+// socket, listening or connected, or -1 with errno set.
+static int openSocket(const std::string& address, bool listening) {
+    int fd;
+    int result;
+    if (address.find('/') != std::string::npos) {
+        struct sockaddr_un local;
+        std::memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(local.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        std::memcpy(local.sun_path, address.c_str(), address.size());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            unlink(address.c_str());
+            result = bind(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local));
+        } else {
+            result = connect(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local));
+        }
+    } else {
+        std::string::size_type colon = address.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+        std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+        struct sockaddr_in remote;
+        std::memset(&remote, 0, sizeof(remote));
+        remote.sin_family = AF_INET;
+        remote.sin_port = htons(static_cast<unsigned short>(std::atoi(port.c_str())));
+        if (inet_pton(AF_INET, host.c_str(), &remote.sin_addr) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            int optval = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+            result = bind(fd, reinterpret_cast<struct sockaddr*>(&remote), sizeof(remote));
+        } else {
+            result = connect(fd, reinterpret_cast<struct sockaddr*>(&remote), sizeof(remote));
+        }
+    }
+    if (result == 0 && listening) {
+        result = ::listen(fd, SOMAXCONN);
+    }
+    if (result != 0 || Utils::setnonblocking(fd) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+ReplicationFeed::ReplicationFeed()
+    : bufferLimit(Utils::envToSize("IRCSERV_REPLICATION_BUFFER", REPLICATION_DEFAULT_BUFFER)), started(false),
+      listenFd(-1), lastListenAttemptUs(0), lastSyncUs(0), accepted(0), dropped(0), bytesSent(0),
+      lastSnapshotUs(0), lastSnapshotBytes(0)
+{
+    const char* value = getenv("IRCSERV_REPLICATION_LISTEN");
+    if (value && *value) {
+        address = value;
+    }
+}
+
+ReplicationFeed::~ReplicationFeed() { stop(); }
+
+bool ReplicationFeed::isEnabled() const { return !address.empty(); }
+
+bool ReplicationFeed::owns(int fd) const { return fd >= 0 && fd == listenFd; }
+
+// Starts keeping the committed change records for the standbys; the
+// socket is opened by the next tick.
+void ReplicationFeed::start(WriteAheadLog& log) {
+    if (!isEnabled()) {
+        return;
+    }
+    log.startStream();
+    started = true;
+}
+
+// Closes the listening socket and every standby's stream. A hot upgrade
+// calls this before handing over, so the standbys reconnect to the new
+// process; if the upgrade fails, the next tick listens again.
+void ReplicationFeed::stop() {
+    if (listenFd >= 0) {
+        close(listenFd);
+        listenFd = -1;
+        if (address.find('/') != std::string::npos) {
+            unlink(address.c_str());
+        }
+    }
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        close(subscribers[i].fd);
+    }
+    subscribers.clear();
+    lastListenAttemptUs = 0;
+}
+
+void ReplicationFeed::listenSocket(Transport& transport) {
+    lastListenAttemptUs = Utils::nowMicros();
+    listenFd = openSocket(address, true);
+    if (listenFd < 0) {
+        Logger::warning("Cannot listen for standbys on " + address + ": " + strerror(errno) + "; retrying");
+        return;
+    }
+    transport.watchWakeup(listenFd);
+    Logger::info("Replicating channel state to standbys connecting to " + address);
+}
+
+void ReplicationFeed::snapshot(std::string& out, const std::map<std::string, Channel*>& channels,
+                              const std::map<std::string, ChannelRecord>& saved) {
+    WriteAheadLog::encodeMarker(WAL_RESET, 0, out);
+    ChannelRecord record;
+    for (std::map<std::string, Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        it->second->toRecord(record);
+        WriteAheadLog::encodeChannel(record, out);
+    }
+    for (std::map<std::string, ChannelRecord>::const_iterator it = saved.begin(); it != saved.end(); ++it) {
+        if (channels.find(it->first) == channels.end()) {
+            WriteAheadLog::encodeChannel(it->second, out);
+        }
+    }
+    WriteAheadLog::encodeMarker(WAL_SYNC, wallMicros(), out);
+}
+
+void ReplicationFeed::acceptSubscribers(const std::map<std::string, Channel*>& channels,
+                                        const std::map<std::string, ChannelRecord>& saved) {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                Logger::warning(std::string("Cannot accept a standby: ") + strerror(errno));
+            }
+            return;
+        }
+        long long startUs = Utils::nowMicros();
+        ReplicationSubscriber subscriber;
+        subscriber.fd = fd;
+        subscriber.sent = 0;
+        subscribers.push_back(subscriber);
+        snapshot(subscribers.back().output, channels, saved);
+        ++accepted;
+        lastSnapshotUs = Utils::nowMicros() - startUs;
+        lastSnapshotBytes = subscribers.back().output.size();
+        std::ostringstream message;
+        message << "Standby connected on fd " << fd << ": sending a snapshot of " << lastSnapshotBytes
+                << " bytes built in " << lastSnapshotUs / 1000.0 << " ms";
+        Logger::info(message.str());
+    }
+}
+
+// Sends what the socket takes. False once the standby is gone or too far
+// behind to keep.
+bool ReplicationFeed::service(ReplicationSubscriber& subscriber) {
+    char scratch[256];
+    ssize_t got = recv(subscriber.fd, scratch, sizeof(scratch), 0);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        Logger::info("Standby on fd " + Utils::intToString(subscriber.fd) + " disconnected");
+        return false;
+    }
+    while (subscriber.sent < subscriber.output.size()) {
+        ssize_t count = send(subscriber.fd, subscriber.output.data() + subscriber.sent,
+                             subscriber.output.size() - subscriber.sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (count <= 0) {
+            Logger::warning("Standby on fd " + Utils::intToString(subscriber.fd) + " lost: " + strerror(errno));
+            return false;
+        }
+        subscriber.sent += count;
+        bytesSent += count;
+    }
+    if (subscriber.sent == subscriber.output.size()) {
+        subscriber.output.clear();
+        subscriber.sent = 0;
+    } else if (subscriber.sent > subscriber.output.size() / 2) {
+        subscriber.output.erase(0, subscriber.sent);
+        subscriber.sent = 0;
+    }
+    if (subscriber.output.size() - subscriber.sent > bufferLimit) {
+        ++dropped;
+        Logger::warning("Standby on fd " + Utils::intToString(subscriber.fd) +
+                        " fell behind by more than IRCSERV_REPLICATION_BUFFER; dropping it");
+        return false;
+    }
+    return true;
+}
+
+// Runs right after the tick's change records are committed: queues them,
+// with a SYNC, on every standby, then serves new standbys a snapshot of
+// the state those records led to.
+void ReplicationFeed::tick(Transport& transport, WriteAheadLog& log,
+                           const std::map<std::string, Channel*>& channels,
+                           const std::map<std::string, ChannelRecord>& saved) {
+    if (!started) {
+        return;
+    }
+    long long now = Utils::nowMicros();
+    log.takeStream(batch);
+    if (!batch.empty() || now - lastSyncUs >= REPLICATION_HEARTBEAT_US) {
+        WriteAheadLog::encodeMarker(WAL_SYNC, wallMicros(), batch);
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            subscribers[i].output += batch;
+        }
+        lastSyncUs = now;
+    }
+    if (listenFd < 0 && now - lastListenAttemptUs >= REPLICATION_LISTEN_RETRY_US) {
+        listenSocket(transport);
+    }
+    if (listenFd >= 0) {
+        acceptSubscribers(channels, saved);
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        if (service(subscribers[i])) {
+            subscribers[kept++] = subscribers[i];
+        } else {
+            close(subscribers[i].fd);
+        }
+    }
+    subscribers.resize(kept);
+}
+
+void ReplicationFeed::appendMetrics(MetricsWriter& writer) const {
+    size_t unsent = 0;
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        unsent += subscribers[i].output.size() - subscribers[i].sent;
+    }
+    writer.gauge("ircserv_replication_enabled", "Whether standbys can follow this server (IRCSERV_REPLICATION_LISTEN)",
+                 isEnabled());
+    writer.gauge("ircserv_replication_listening", "Whether the replication socket is open", listenFd >= 0);
+    writer.gauge("ircserv_replication_standbys", "Standbys receiving the replication stream", subscribers.size());
+    writer.counter("ircserv_replication_standbys_accepted_total", "Standby connections accepted", accepted);
+    writer.counter("ircserv_replication_standbys_dropped_total", "Standbys dropped for falling behind", dropped);
+    writer.counter("ircserv_replication_bytes_total", "Replication stream bytes sent", bytesSent);
+    writer.gauge("ircserv_replication_unsent_bytes", "Replication stream bytes queued for standbys", unsent);
+    writer.gauge("ircserv_replication_last_snapshot_seconds", "Time the event loop spent on the last snapshot",
+                 lastSnapshotUs / 1e6);
+    writer.gauge("ircserv_replication_last_snapshot_bytes", "Size of the last snapshot", lastSnapshotBytes);
+}
+
+StandbyReplica::StandbyReplica()
+    : timeoutUs(static_cast<long long>(Utils::envToSize("IRCSERV_STANDBY_TIMEOUT_MS", STANDBY_DEFAULT_TIMEOUT_MS)) *
+                1000LL),
+      active(false), fd(-1), synced(false), everSynced(false), reportedFailure(false), lastAttemptUs(0),
+      lastHeardUs(0), lastSyncUs(0), lagUs(0), connects(0), bytesReceived(0), recordsApplied(0), streamErrors(0)
+{
+    const char* value = getenv("IRCSERV_STANDBY_OF");
+    if (value && *value) {
+        address = value;
+        active = true;
+    }
+}
+
+StandbyReplica::~StandbyReplica() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool StandbyReplica::isActive() const { return active; }
+
+bool StandbyReplica::owns(int fd) const { return fd >= 0 && fd == this->fd; }
+
+// A process that took over from another by hot upgrade was serving, so it
+// is no standby whatever its environment says.
+void StandbyReplica::disable() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    active = false;
+}
+
+void StandbyReplica::connectToPrimary(Transport& transport) {
+    lastAttemptUs = Utils::nowMicros();
+    fd = openSocket(address, false);
+    if (fd < 0) {
+        if (!reportedFailure) {
+            Logger::warning("Standby cannot reach the primary at " + address + ": " + strerror(errno) + "; retrying");
+            reportedFailure = true;
+        }
+        return;
+    }
+    transport.watchWakeup(fd);
+    ++connects;
+    reportedFailure = false;
+    synced = false;
+    input.clear();
+    incoming.clear();
+    lastHeardUs = lastAttemptUs;
+    Logger::info("Standby connected to the primary at " + address);
+}
+
+void StandbyReplica::disconnect(const std::string& reason) {
+    Logger::warning("Standby lost the primary: " + reason);
+    close(fd);
+    fd = -1;
+    synced = false;
+    input.clear();
+    incoming.clear();
+}
+
+// Reads what has arrived and applies every complete record.
+void StandbyReplica::receive() {
+    char buffer[REPLICATION_READ_SIZE];
+    for (;;) {
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got > 0) {
+            input.append(buffer, got);
+            bytesReceived += got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        disconnect(got == 0 ? "the stream ended" : strerror(errno));
+        return;
+    }
+    size_t pos = 0;
+    WalRecordType type;
+    long long stampUs = 0;
+    while (pos < input.size()) {
+        WalRecordStatus status = WriteAheadLog::applyRecord(synced ? channels : incoming, input, pos, type, stampUs);
+        if (status == WAL_RECORD_INCOMPLETE) {
+            break;
+        }
+        if (status != WAL_RECORD_OK) {
+            ++streamErrors;
+            disconnect("a damaged record in the stream");
+            return;
+        }
+        ++recordsApplied;
+        if (type != WAL_SYNC) {
+            continue;
+        }
+        if (!synced) {
+            channels.swap(incoming);
+            incoming.clear();
+            synced = true;
+            everSynced = true;
+            Logger::info("Standby replica synced: " + Utils::intToString(static_cast<int>(channels.size())) +
+                         " channels");
+        }
+        lastHeardUs = lastSyncUs = Utils::nowMicros();
+        lagUs = wallMicros() - stampUs;
+    }
+    input.erase(0, pos);
+}
+
+void StandbyReplica::tick(Transport& transport) {
+    if (!active) {
+        return;
+    }
+    if (fd >= 0) {
+        receive();
+    }
+    long long now = Utils::nowMicros();
+    if (fd >= 0 && now - lastHeardUs >= timeoutUs) {
+        disconnect("no SYNC for IRCSERV_STANDBY_TIMEOUT_MS");
+    }
+    if (fd < 0 && now - lastAttemptUs >= REPLICATION_CONNECT_RETRY_US) {
+        connectToPrimary(transport);
+    }
+}
+
+// Whether the primary has been silent long enough to take over. A standby
+// that never had a replica keeps waiting.
+bool StandbyReplica::shouldPromote() const {
+    return active && everSynced && Utils::nowMicros() - lastSyncUs >= timeoutUs;
+}
+
+// Hands the replica over and stops being a standby.
+void StandbyReplica::promote(std::map<std::string, ChannelRecord>& replica) {
+    disable();
+    replica.swap(channels);
+    channels.clear();
+}
+
+void StandbyReplica::appendMetrics(MetricsWriter& writer) const {
+    if (address.empty()) {
+        return;
+    }
+    writer.gauge("ircserv_standby_active", "Whether this server is a standby not yet promoted", active);
+    writer.gauge("ircserv_standby_connected", "Whether the standby has a stream from the primary", fd >= 0);
+    writer.gauge("ircserv_standby_synced", "Whether the standby has the primary's current snapshot", synced);
+    writer.gauge("ircserv_standby_replica_channels", "Channels in the standby's replica", channels.size());
+    writer.gauge("ircserv_standby_lag_seconds", "Time from the primary committing a tick's changes to their replay here",
+                 lagUs / 1e6);
+    writer.gauge("ircserv_standby_last_sync_age_seconds", "Time since the last SYNC from the primary",
+                 everSynced ? (Utils::nowMicros() - lastSyncUs) / 1e6 : 0);
+    writer.counter("ircserv_standby_connects_total", "Connections made to the primary", connects);
+    writer.counter("ircserv_standby_bytes_total", "Replication stream bytes received", bytesReceived);
+    writer.counter("ircserv_standby_records_total", "Replication records applied", recordsApplied);
+    writer.counter("ircserv_standby_stream_errors_total", "Streams dropped for a damaged record", streamErrors);
+}
@@ -1,15 +1,36 @@
 #include "Includes.hpp"
+#include "Metrics.hpp"
+#include "EpollTransport.hpp"
 #include <cstring>
 #include <cctype>
+#include <sys/wait.h>
 
 bool Server::signal = false;
+bool Server::dumpRequested = false;
+bool Server::upgradeRequested = false;
 
 Server::Server(const std::string &portStr, const std::string &password)
-    : epfd(-1) {
+    : transport(NULL), ownsTransport(false),
+      events(std::max<size_t>(1, Utils::envToSize("IRCSERV_MAX_EVENTS", MAX_EVENTS))),
+      lineBudget(std::max<size_t>(1, Utils::envToSize("IRCSERV_LINE_BUDGET", DEFAULT_LINE_BUDGET))),
+      tickLineBudget(std::max<size_t>(1, Utils::envToSize("IRCSERV_TICK_LINE_BUDGET", DEFAULT_TICK_LINE_BUDGET))),
+      tickLines(0), deferrals(0),
+      maxTargets(std::max<size_t>(1, Utils::envToSize("IRCSERV_MAXTARGETS", DEFAULT_MAX_TARGETS))),
+      mailbox(std::max<size_t>(2, Utils::envToSize("IRCSERV_MAILBOX_CAPACITY", MAILBOX_DEFAULT_CAPACITY))),
+      mailboxWatched(false),
+      upgradeTimeoutMs(static_cast<int>(
+          Utils::envToSize("IRCSERV_UPGRADE_TIMEOUT_MS", UPGRADE_DEFAULT_READY_TIMEOUT_MS))),
+      handedOver(false), upgradeWaitStartUs(0) {
   validateArgs(portStr, password);
   name = "ircserv";
   port = std::atoi(portStr.c_str());
   this->password = password;
+  const char *oper = getenv("IRCSERV_OPER_PASSWORD");
+  if (oper && Utils::isValidPassword(oper)) {
+    operPassword = oper;
+  }
+  Client::setSendqLimits(Utils::envToSize("IRCSERV_SENDQ", SENDQ_DEFAULT_REGISTERED),
+                         Utils::envToSize("IRCSERV_SENDQ_UNREGISTERED", SENDQ_DEFAULT_UNREGISTERED));
   createdtime = Utils::formatTime(time(NULL));
   Logger::info("Server instance created with port " + portStr +
                " and password set.");
@@ -43,10 +64,8 @@ void Server::validatePassword(const std::string &password) {
 Server::~Server() {
   cleanupAllClients();
   cleanupAllChannels();
-  closeSocket();
-  if (epfd >= 0) {
-    close(epfd);
-    Logger::info("Epoll file descriptor closed.");
+  if (ownsTransport) {
+    delete transport;
   }
   logShutdown();
 }
@@ -65,21 +84,18 @@ std::map<std::string, Channel *> &Server::getChannels() { return channels; }
 void Server::cleanupAllClients() {
   std::map<int, Client *>::iterator it = clients.begin();
   while (it != clients.end()) {
-    close(it->first);
+    if (transport) {
+      transport->close(it->first);
+    }
+    forgetNickname(it->second);
     delete it->second;
     ++it;
   }
   clients.clear();
+  closing.clear();
   Logger::info("All clients cleaned up.");
 }
 
-void Server::closeSocket() {
-  if (sock_fd > 0) {
-    close(sock_fd);
-    Logger::info("Server socket closed.");
-  }
-}
-
 void Server::logShutdown() {
   Logger::info("Server on port " + Utils::intToString(port) +
                " is shutting down.");
@@ -87,6 +103,20 @@ void Server::logShutdown() {
 
 const std::string &Server::getPassword() const { return password; }
 
+const std::string &Server::getOperPassword() const { return operPassword; }
+
+size_t Server::getMaxTargets() const { return maxTargets; }
+
+SlowLog &Server::getSlowLog() { return slowLog; }
+
+TickProfiler &Server::getProfiler() { return profiler; }
+
+Transport *Server::getTransport() { return transport; }
+
+Mailbox &Server::getMailbox() { return mailbox; }
+
+ChannelStore &Server::getChannelStore() { return channelStore; }
+
 const std::string &Server::getCreatedTime() const { return createdtime; }
 
 std::map<int, Client *> &Server::getClients() { return this->clients; }
@@ -94,24 +124,99 @@ std::map<int, Client *> &Server::getClients() { return this->clients; }
 const std::string &Server::getName() const { return name; }
 
 Client *Server::getClientByNickname(const std::string &nickname) const {
-  for (std::map<int, Client *>::const_iterator it = clients.begin();
-       it != clients.end(); ++it) {
-    if (it->second->getNickname() == nickname) {
-      return it->second;
-    }
+  std::map<std::string, Client *>::const_iterator it =
+      nicknames.find(Utils::toLower(nickname));
+  if (it == nicknames.end()) {
+    return NULL;
+  }
+  return it->second;
+}
+
+static size_t nicknameEntryBytes(const std::string &key) {
+  return MemoryAccounting::treeNodeBytes<std::pair<const std::string, Client *> >() +
+         MemoryAccounting::stringBytes(key);
+}
+
+void Server::forgetNickname(Client *client) {
+  std::string nickname = client->getNickname();
+  if (nickname.empty()) {
+    return;
+  }
+  std::map<std::string, Client *>::iterator it =
+      nicknames.find(Utils::toLower(nickname));
+  if (it != nicknames.end() && it->second == client) {
+    MemoryAccounting::add(MEM_CLIENTS, -static_cast<long long>(nicknameEntryBytes(it->first)));
+    nicknames.erase(it);
+  }
+}
+
+void Server::setClientNickname(Client *client, const std::string &nickname) {
+  forgetNickname(client);
+  client->setNickname(nickname);
+  if (!nickname.empty()) {
+    std::string key = Utils::toLower(nickname);
+    nicknames[key] = client;
+    MemoryAccounting::add(MEM_CLIENTS, nicknameEntryBytes(key));
   }
-  return NULL;
 }
 
 void Server::serverInit() {
   Utils::displayBanner();
   increaseFdLimit();
-  createSocket();
-  configureServerAddress();
-  setReuseAddr();
-  bindSocket();
-  listenOnSocket();
-  initEpoll();
+  transport = new EpollTransport();
+  ownsTransport = true;
+  transport->listen(port);
+  mailboxWatched = transport->watchWakeup(mailbox.getWakeFd());
+  executable = HotUpgrade::currentExecutable();
+  channelStore.load();
+  if (!standby.isActive()) {
+    replication.start(channelStore.getLog());
+  }
+  logInitialization();
+}
+
+// Carries on the server run by the process that exec'd this one (see
+// HotUpgrade): adopts its listening and client sockets and its state, then
+// tells it to exit. Nothing is read from a client before that.
+void Server::serverResume(int link) {
+  increaseFdLimit();
+  std::string state;
+  std::vector<int> fds;
+  HotUpgrade::receive(link, state, fds);
+  if (fds.empty()) {
+    throw std::runtime_error("Upgrade link passed no listening socket");
+  }
+  EpollTransport *epoll = new EpollTransport();
+  transport = epoll;
+  ownsTransport = true;
+  epoll->adopt(fds[0]);
+  mailboxWatched = transport->watchWakeup(mailbox.getWakeFd());
+  executable = HotUpgrade::currentExecutable();
+  StateReader reader(state);
+  restoreState(reader, fds);
+  channelStore.load();
+  for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); ++it) {
+    channelStore.claim(it->first);
+  }
+  standby.disable();
+  replication.start(channelStore.getLog());
+  HotUpgrade::signalReady(link);
+  close(link);
+  Logger::info("Resumed " + Utils::intToString(static_cast<int>(clients.size())) + " clients and " +
+               Utils::intToString(static_cast<int>(channels.size())) + " channels from the previous process.");
+  logInitialization();
+}
+
+// Runs the protocol core on a transport owned by the caller, e.g. SimTransport.
+void Server::serverInit(Transport &external) {
+  transport = &external;
+  ownsTransport = false;
+  transport->listen(port);
+  mailboxWatched = transport->watchWakeup(mailbox.getWakeFd());
+  channelStore.load();
+  if (!standby.isActive()) {
+    replication.start(channelStore.getLog());
+  }
   logInitialization();
 }
 
@@ -121,12 +226,14 @@ void Server::increaseFdLimit() {
     Logger::info("Current FD limit: soft=" + Utils::intToString(rlim.rlim_cur) +
                  ", hard=" + Utils::intToString(rlim.rlim_max));
 
-    rlim_t newLimit;
-    if (rlim.rlim_max == RLIM_INFINITY) {
-      newLimit = 10000;
-    } else if (rlim.rlim_max > 10000) {
-      newLimit = 10000;
-    } else {
+    rlim_t newLimit = Utils::envToSize("IRCSERV_FD_LIMIT", 0);
+    if (newLimit == 0) {
+      newLimit = rlim.rlim_max;
+    }
+    if (newLimit == RLIM_INFINITY) {
+      newLimit = DEFAULT_FD_LIMIT;
+    }
+    if (rlim.rlim_max != RLIM_INFINITY && newLimit > rlim.rlim_max) {
       newLimit = rlim.rlim_max;
     }
 
@@ -146,116 +253,212 @@ void Server::increaseFdLimit() {
   }
 }
 
-void Server::createSocket() {
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
-    }
-    Logger::info("Socket created successfully.");
-}
-
-void Server::configureServerAddress() {
-    std::memset(&serverAddress, 0, sizeof(serverAddress));
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = htons(port);
+void Server::logInitialization() {
+  Logger::info("Server initialized on port " + Utils::intToString(port));
 }
 
-void Server::setReuseAddr() {
-    int optval = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        throw std::runtime_error("Failed to set SO_REUSEADDR: " + std::string(strerror(errno)));
+void Server::serverRun() {
+  while (!signal && !handedOver) {
+    int timeoutMs = -1;
+    if (capture.isActive()) {
+      timeoutMs = CAPTURE_FLUSH_INTERVAL_US / 1000;
     }
-}
-
-void Server::bindSocket() {
-    if (bind(sock_fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
-        throw std::runtime_error("Failed to bind socket: " + std::string(strerror(errno)));
+    if (channelStore.isEnabled()) {
+      timeoutMs = timeoutMs < 0 ? STATE_POLL_INTERVAL_MS : std::min(timeoutMs, STATE_POLL_INTERVAL_MS);
+    }
+    if (replication.isEnabled() || standby.isActive()) {
+      timeoutMs = timeoutMs < 0 ? REPLICATION_POLL_INTERVAL_MS : std::min(timeoutMs, REPLICATION_POLL_INTERVAL_MS);
+    }
+    runOnce(timeoutMs);
+  }
+  if (handedOver) {
+    Logger::info("Server run loop ended: clients handed over to the upgraded process.");
+  } else {
+    Logger::warning("Signal received! Stopping server...");
+    Logger::info("Server run loop terminated due to signal.");
+    if (channelStore.save(channels)) {
+      Logger::info("Channel state saved for the next start.");
     }
-    Logger::info("Socket bound successfully.");
+  }
 }
 
-void Server::listenOnSocket() {
-    if (listen(sock_fd, SOMAXCONN) < 0) {
-        throw std::runtime_error("Failed to listen on socket: " + std::string(strerror(errno)));
-    }
-    Logger::info("Server listening on socket with maximum connections.");
+// One event loop tick: wait for the transport, handle what is ready, resume
+// clients with deferred lines, queue lines posted by other threads, flush
+// the output queued during the tick and tear down the clients that
+// disconnected.
+// While lines are deferred the wait does not block, and while clients are
+// throttled it ends in time to resume the earliest one.
+void Server::runOnce(int timeoutMs) {
+  int nfds = 0;
+  tickLines = 0;
+  profiler.enter(PHASE_WAIT);
+  bool idle = backlog.empty() && !mailbox.hasWork() && !listings.ready(clients);
+  waitForEvents(nfds, idle ? nextWakeTimeout(timeoutMs) : 0);
+  profiler.enter(PHASE_OTHER);
+  if (dumpRequested) {
+    handleDumpRequest();
+  }
+  if (nfds > 0) {
+    processEvents(nfds);
+  }
+  processThrottled();
+  processBacklog();
+  processMailbox();
+  processListings();
+  channelStore.commitLog();
+  processReplication();
+  flushPendingOutput();
+  reapClosingClients();
+  if (upgradeRequested && finishListingsForUpgrade()) {
+    handleUpgradeRequest();
+  }
+  capture.tick();
+  channelStore.tick(channels);
+  profiler.endTick(nfds);
 }
 
-void Server::initEpoll() {
-    epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (epfd < 0) {
-        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+// Runs right after the tick's channel changes are committed. A primary
+// streams them to its standbys; a standby applies the primary's stream and
+// takes over once the primary has gone quiet.
+void Server::processReplication() {
+  if (standby.isActive()) {
+    standby.tick(*transport);
+    if (standby.shouldPromote()) {
+      promoteStandby();
     }
+    return;
+  }
+  replication.tick(*transport, channelStore.getLog(), channels, channelStore.getRecords());
+}
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = sock_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
-        throw std::runtime_error("Failed to add socket to epoll: " + std::string(strerror(errno)));
-    }
+// The replica becomes the saved channels, so each comes back on its first
+// join as after a restart, and clients are accepted from now on.
+void Server::promoteStandby() {
+  std::map<std::string, ChannelRecord> replica;
+  standby.promote(replica);
+  size_t count = replica.size();
+  channelStore.adopt(replica);
+  Logger::warning("Primary silent for IRCSERV_STANDBY_TIMEOUT_MS: promoted to primary with " +
+                  Utils::intToString(static_cast<int>(count)) + " replicated channels");
+  if (channelStore.isEnabled()) {
+    channelStore.save(channels);
+  }
+  replication.start(channelStore.getLog());
 }
 
-void Server::logInitialization() {
-  Logger::info("Server initialized on port " + Utils::intToString(port));
+bool Server::hasPendingWork() const {
+  return !backlog.empty() || !throttled.empty() || mailbox.hasWork() || listings.ready(clients);
 }
 
-void Server::serverRun() {
-  struct epoll_event events[MAX_EVENTS];
-  while (!signal) {
-    int nfds = 0;
-    waitForEvents(events, nfds);
-    if (nfds > 0) {
-      processedFds.clear();
-      processEvents(events, nfds);
-    }
+// Shortens the wait so throttled clients resume on time.
+int Server::nextWakeTimeout(int timeoutMs) const {
+  if (throttled.empty()) {
+    return timeoutMs;
   }
-  Logger::info("Server run loop terminated due to signal.");
+  long long untilWake = throttled.begin()->first - Utils::nowMicros();
+  int wakeMs = untilWake <= 0 ? 0 : static_cast<int>((untilWake + 999) / 1000);
+  return timeoutMs < 0 ? wakeMs : std::min(timeoutMs, wakeMs);
 }
 
-void Server::waitForEvents(struct epoll_event events[], int& nfds) {
-    nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+void Server::waitForEvents(int& nfds, int timeoutMs) {
+    nfds = transport->wait(events, timeoutMs);
     if (nfds < 0 && errno != EINTR) {
-        throw std::runtime_error("Epoll wait failed: " + std::string(strerror(errno)));
-    }
-    if (nfds >= 0) {
-
+        throw std::runtime_error("Event wait failed: " + std::string(strerror(errno)));
     }
 }
 
-void Server::processEvents(struct epoll_event events[], int nfds) {
+void Server::processEvents(int nfds) {
   for (int i = 0; i < nfds; ++i) {
-    int fd = events[i].data.fd;
-    uint32_t eventFlags = events[i].events;
+    int fd = events[i].fd;
+    unsigned int flags = events[i].flags;
 
-    if (fd == sock_fd && (eventFlags & EPOLLIN)) {
+    if (transport->isListener(fd) && (flags & TRANSPORT_READABLE)) {
       acceptNewConnection();
+    } else if (mailboxWatched && fd == mailbox.getWakeFd()) {
+      mailbox.acknowledge();
+    } else if (replication.owns(fd) || standby.owns(fd)) {
+      // Served once per tick by processReplication().
     } else {
-      handleClientEvent(fd, eventFlags);
+      handleClientEvent(fd, flags);
     }
   }
 
 }
 
-void Server::handleClientEvent(int fd, uint32_t events) {
-  if (events & (EPOLLHUP | EPOLLERR)) {
-
+void Server::handleClientEvent(int fd, unsigned int flags) {
+  std::map<int, Client *>::iterator it = clients.find(fd);
+  if (it == clients.end() || it->second->isClosing()) {
+    return;
+  }
+  if (flags & TRANSPORT_HANGUP) {
     handleClientDisconnect(fd);
-  } else if (events & EPOLLIN) {
+    return;
+  }
+  if (flags & TRANSPORT_WRITABLE) {
+    handleClientWritable(fd);
+  }
+  // A client whose earlier lines are still deferred is not read from until
+  // they have run, so a flood stays in the kernel buffer rather than ours.
+  if ((flags & TRANSPORT_READABLE) && !it->second->isClosing() && !it->second->isBacklogged()) {
     handleClientData(fd);
   }
 }
 
+void Server::handleClientWritable(int fd) {
+  PhaseScope scope(profiler, PHASE_FLUSH);
+  std::map<int, Client *>::iterator it = clients.find(fd);
+  if (it != clients.end()) {
+    flushClient(it->second);
+  }
+}
+
+void Server::flushPendingOutput() {
+  PhaseScope scope(profiler, PHASE_FLUSH);
+  std::vector<int> fds;
+  Client::takePendingFlush(fds);
+  for (std::vector<int>::iterator fdIt = fds.begin(); fdIt != fds.end(); ++fdIt) {
+    std::map<int, Client *>::iterator it = clients.find(*fdIt);
+    if (it != clients.end()) {
+      flushClient(it->second);
+    }
+  }
+}
+
+void Server::flushClient(Client *client) {
+  if (client->isSendqExceeded()) {
+    Logger::warning("SendQ exceeded for fd " + Utils::intToString(client->getFd()) + ", disconnecting");
+    handleClientDisconnect(client->getFd());
+    return;
+  }
+  if (!client->flushOutput(*transport)) {
+    handleClientDisconnect(client->getFd());
+    return;
+  }
+  updateClientEvents(client);
+}
+
+void Server::updateClientEvents(Client *client) {
+  bool wantWrite = client->hasPendingOutput();
+  if (wantWrite == client->isWriteArmed()) {
+    return;
+  }
+
+  if (transport->setWritable(client->getFd(), wantWrite)) {
+    client->setWriteArmed(wantWrite);
+  }
+}
+
 void Server::acceptNewConnection() {
+  PhaseScope scope(profiler, PHASE_ACCEPT);
   sockaddr_in clientAddr;
-  socklen_t clientLen = sizeof(clientAddr);
-  int clientFd = accept(sock_fd, (struct sockaddr *)&clientAddr, &clientLen);
+  int clientFd = transport->accept(clientAddr);
   handleAcceptResult(clientFd, clientAddr);
 }
 
 void Server::handleAcceptResult(int clientFd, sockaddr_in &clientAddr) {
   if (clientFd < 0) {
     if (errno == EMFILE || errno == ENFILE) {
+      admission.reject(ADMIT_FD_LIMIT);
       Logger::warning("Accept failed due to FD limit: " +
                       std::string(strerror(errno)));
     } else {
@@ -263,25 +466,27 @@ void Server::handleAcceptResult(int clientFd, sockaddr_in &clientAddr) {
     }
     return;
   }
+  // Rejections are counted, not logged: they come in floods.
+  if (admission.admit(clientAddr.sin_addr.s_addr, Utils::nowMicros()) != ADMIT_OK) {
+    transport->close(clientFd);
+    return;
+  }
   configureNewClient(clientFd, clientAddr);
 }
 
 void Server::configureNewClient(int clientFd, sockaddr_in &clientAddr) {
-  Utils::setnonblocking(clientFd);
   Client *client = createNewClient(clientFd, clientAddr);
   clients[clientFd] = client;
+  capture.connect(clientFd, clientAddr.sin_addr.s_addr);
 
-  if (tryHandleHttpClient(clientFd)) {
+  if (tryHandleHttpClient(clientFd) || client->isClosing()) {
     return;
   }
 
-  std::map<int, Client *>::iterator clientIt = clients.find(clientFd);
-  if (clientIt == clients.end()) {
-    return;
+  if (!standby.isActive()) {
+    sendIrcGreeting(client);
   }
-
-  sendIrcGreeting(clientIt->second);
-  addClientToEpoll(clientFd);
+  watchClient(clientFd);
 }
 
 static bool looksLikeHTTP(const char *buf) {
@@ -292,8 +497,8 @@ static bool looksLikeHTTP(const char *buf) {
 }
 
 bool Server::tryHandleHttpClient(int clientFd) {
-  char buffer[BUFFER_SIZE] = {0};
-  int bytesRead = recv(clientFd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+  char *buffer = readBuffer;
+  int bytesRead = transport->read(clientFd, buffer, sizeof(readBuffer) - 1);
   if (bytesRead <= 0) {
     if (bytesRead == 0 ||
         (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
@@ -306,40 +511,34 @@ bool Server::tryHandleHttpClient(int clientFd) {
   }
 
   buffer[bytesRead] = '\0';
+  capture.data(clientFd, buffer, bytesRead);
   if (looksLikeHTTP(buffer)) {
-    sendHttpResponse(clientFd);
+    sendHttpResponse(clientFd, buffer);
     handleClientDisconnect(clientFd);
     return true;
   }
 
-  std::map<int, Client *>::iterator clientIt = clients.find(clientFd);
-  if (clientIt == clients.end()) {
-    return true;
-  }
-  Client *client = clientIt->second;
-  client->appendToCommandBuffer(buffer);
-  processClientBuffer(clientFd);
+  Client *client = clients[clientFd];
+  client->appendToCommandBuffer(buffer, bytesRead);
+  processClientBuffer(client);
   return false;
 }
 
 void Server::sendIrcGreeting(Client *client) {
-  client->sendWelcomeHowTo(client->getFd());
+  client->sendWelcomeHowTo();
   client->setGreeted(true);
 }
 
-void Server::addClientToEpoll(int clientFd) {
+void Server::watchClient(int clientFd) {
 
   std::map<int, Client *>::iterator clientIt = clients.find(clientFd);
   if (clientIt == clients.end()) {
     return;
   }
 
-  struct epoll_event ev;
-  ev.events = EPOLLIN | EPOLLHUP | EPOLLERR;
-  ev.data.fd = clientFd;
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, clientFd, &ev) < 0) {
+  if (!transport->watch(clientFd)) {
     Logger::warning("Failed to add client fd " + Utils::intToString(clientFd) +
-                    " to epoll: " + strerror(errno));
+                    " to the transport: " + strerror(errno));
     handleClientDisconnect(clientFd);
   } else {
 
@@ -362,9 +561,9 @@ void Server::logNewConnection(int clientFd, const char *ip, int port) {
 }
 
 void Server::handleClientData(int fd) {
-  char buffer[BUFFER_SIZE] = {0};
-  int bytesRead = read(fd, buffer, sizeof(buffer) - 1);
-  processReadResult(fd, buffer, bytesRead);
+  PhaseScope scope(profiler, PHASE_READ);
+  int bytesRead = transport->read(fd, readBuffer, sizeof(readBuffer) - 1);
+  processReadResult(fd, readBuffer, bytesRead);
 }
 
 void Server::processReadResult(int fd, char *buffer, int bytesRead) {
@@ -385,111 +584,246 @@ void Server::handleReadError(int fd) {
   handleClientDisconnect(fd);
 }
 
+// Safe to call from anywhere, including command handlers and broadcasts:
+// the client is only marked closing here. It stays allocated, keeps its fd
+// and ignores further input until reapClosingClients() runs at the end of
+// the tick, so nothing can be left holding a dangling Client*.
 void Server::handleClientDisconnect(int fd) {
-  if (processedFds.find(fd) != processedFds.end()) {
+  std::map<int, Client *>::iterator clientIt = clients.find(fd);
+  if (clientIt == clients.end() || clientIt->second->isClosing()) {
     return;
   }
-  processedFds.insert(fd);
-
-  if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+  clientIt->second->markClosing();
+  closing.push_back(clientIt->second);
+}
 
+// Tears down the clients that disconnected during the tick, as one batch:
+// a single pass over the channels drops them all from membership.
+void Server::reapClosingClients() {
+  if (closing.empty()) {
+    return;
   }
-
-  std::map<int, Client *>::iterator clientIt = clients.find(fd);
-  if (clientIt != clients.end()) {
-    Client *client = clientIt->second;
-
-    std::map<std::string, Channel *>::iterator chanIt = channels.begin();
-    while (chanIt != channels.end()) {
-      Channel *channel = chanIt->second;
-      channel->removeMember(client);
-      if (channel->getMemberCount() == 0) {
-        delete channel;
-        channels.erase(chanIt++);
-      } else {
-        ++chanIt;
-      }
+  std::vector<Client *> batch;
+  batch.swap(closing);
+
+  std::map<std::string, Channel *>::iterator chanIt = channels.begin();
+  while (chanIt != channels.end()) {
+    Channel *channel = chanIt->second;
+    for (std::vector<Client *>::iterator it = batch.begin(); it != batch.end(); ++it) {
+      channel->removeMember(*it);
+    }
+    if (channel->getMemberCount() == 0) {
+      delete channel;
+      channels.erase(chanIt++);
+    } else {
+      ++chanIt;
     }
-    delete client;
-    clients.erase(clientIt);
   }
 
-  if (fd > 0) {
-    close(fd);
+  for (std::vector<Client *>::iterator it = batch.begin(); it != batch.end(); ++it) {
+    Client *client = *it;
+    int fd = client->getFd();
+    capture.disconnect(fd);
+    client->flushOutput(*transport);
+    forgetNickname(client);
+    admission.release(client->getAddress());
+    clients.erase(fd);
+    delete client;
+    transport->close(fd);
+    Logger::info("Client disconnected, fd: " + Utils::intToString(fd));
   }
-  Logger::info("Client disconnected, fd: " + Utils::intToString(fd));
 }
 
-void Server::sendHttpResponse(int fd) {
-  const char *http = "HTTP/1.1 200 OK\r\n"
+void Server::sendHttpResponse(int fd, const char *request) {
+  std::string body = "This is an IRC server mate ;)\r\n";
+  if (strncmp(request, "GET /metrics ", 13) == 0) {
+    body = renderMetrics();
+  }
+
+  std::string http = "HTTP/1.1 200 OK\r\n"
                      "Content-Type: text/plain\r\n"
-                     "Content-Length: 31\r\n"
+                     "Content-Length: " + Utils::intToString(body.size()) + CRLF +
                      "Connection: close\r\n"
-                     CRLF
-                     "This is an IRC server mate ;)\r\n";
-  send(fd, http, strlen(http), MSG_NOSIGNAL);
+                     CRLF + body;
+  transport->write(fd, http.c_str(), http.size());
+}
+
+std::string Server::renderMetrics() {
+  MetricsWriter writer;
+  writer.gauge("ircserv_clients", "Connected clients", clients.size());
+  writer.gauge("ircserv_channels", "Existing channels", channels.size());
+  writer.gauge("ircserv_line_backlog_clients", "Clients with deferred input lines", backlog.size());
+  writer.counter("ircserv_line_deferrals_total", "Times a client hit its per-tick line budget", deferrals);
+  profiler.appendMetrics(writer);
+  slowLog.appendMetrics(writer);
+  MemoryAccounting::appendMetrics(writer);
+  SlabPool::appendMetrics(writer);
+  AllocTrace::appendMetrics(writer);
+  capture.appendMetrics(writer);
+  floodControl.appendMetrics(writer);
+  Client::appendMetrics(writer);
+  admission.appendMetrics(writer);
+  FanoutPool::instance().appendMetrics(writer);
+  mailbox.appendMetrics(writer);
+  snapshots.appendMetrics(writer);
+  listings.appendMetrics(writer);
+  channelStore.appendMetrics(writer);
+  replication.appendMetrics(writer);
+  standby.appendMetrics(writer);
+  writer.gauge("ircserv_flood_throttled_clients", "Clients paused by flood control", throttled.size());
+
+  std::vector<Client *> top = getTopBufferedClients(MEMORY_DEFAULT_TOP_CLIENTS);
+  for (std::vector<Client *>::iterator it = top.begin(); it != top.end(); ++it) {
+    writer.gauge("ircserv_client_buffered_bytes", "Input plus unsent output bytes of the most buffered clients",
+                 (*it)->getBufferedBytes(), "fd=\"" + Utils::intToString((*it)->getFd()) + "\"");
+  }
+  return writer.str();
+}
+
+static bool moreBuffered(Client *a, Client *b) {
+  return a->getBufferedBytes() > b->getBufferedBytes();
+}
+
+std::vector<Client *> Server::getTopBufferedClients(size_t count) const {
+  std::vector<Client *> all;
+  all.reserve(clients.size());
+  for (std::map<int, Client *>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+    if (it->second->getBufferedBytes() > 0) {
+      all.push_back(it->second);
+    }
+  }
+  count = std::min(count, all.size());
+  std::partial_sort(all.begin(), all.begin() + count, all.end(), moreBuffered);
+  all.resize(count);
+  return all;
 }
 
 void Server::handleReadSuccess(int fd, char *buffer, int bytesRead) {
   buffer[bytesRead] = '\0';
+  capture.data(fd, buffer, bytesRead);
 
   if (looksLikeHTTP(buffer)) {
-    sendHttpResponse(fd);
+    sendHttpResponse(fd, buffer);
     handleClientDisconnect(fd);
     return;
   }
 
-  appendToClientBuffer(fd, buffer);
-  processClientBuffer(fd);
+  appendToClientBuffer(fd, buffer, bytesRead);
+  Client *client = clients[fd];
+  if (floodControl.isFlooding(client)) {
+    Logger::warning("Excess flood from fd " + Utils::intToString(fd));
+    client->sendReply("ERROR :Closing link: Excess Flood");
+    handleClientDisconnect(fd);
+    return;
+  }
+  processClientBuffer(client);
 }
 
-void Server::appendToClientBuffer(int fd, const char *data) {
-  if (clients.find(fd) != clients.end()) {
-    clients[fd]->getCommandBuffer() += data;
+void Server::appendToClientBuffer(int fd, const char *data, size_t length) {
+  std::map<int, Client *>::iterator it = clients.find(fd);
+  if (it != clients.end()) {
+    it->second->appendToCommandBuffer(data, length);
   }
 }
 
-void Server::processClientBuffer(int fd) {
-    std::map<int, Client*>::iterator it = clients.find(fd);
-    if (it == clients.end())
+// Runs at most lineBudget lines per call so a client pipelining thousands of
+// commands cannot starve the others; the rest waits on the backlog.
+void Server::processClientBuffer(Client *client) {
+    if (client->isThrottled())
         return;
-
-    Client *client = it->second;
-    while (client && hasNextMessage(client->getCommandBuffer())) {
-
-        std::string msg =
-            extractNextMessage(client->getCommandBuffer());
-
-        std::list<std::string> cmd = parseMessage(msg);
-
-        if (!cmd.empty()) {
-            executeCommand(fd, cmd);
-            if (clients.find(fd) == clients.end())
-                return;
-            client = clients[fd];
+    // A standby only answers /metrics, which is handled before this.
+    if (standby.isActive() && client->hasCompleteLine()) {
+        client->sendReply("ERROR :This server is a standby and takes no clients until it is promoted");
+        handleClientDisconnect(client->getFd());
+        return;
+    }
+    int fd = client->getFd();
+    size_t executed = 0;
+    while (!client->isClosing() && client->hasCompleteLine()) {
+        if (floodControl.isThrottled(client, Utils::nowMicros())) {
+            client->setThrottled(true);
+            throttled.insert(std::make_pair(floodControl.throttledUntil(client), fd));
+            return;
+        }
+        if (executed == lineBudget) {
+            client->setBacklogged(true);
+            backlog.push_back(fd);
+            ++deferrals;
+            return;
         }
+        ++executed;
+        ++tickLines;
+        std::list<std::string> cmd;
+        {
+            PhaseScope parsing(profiler, PHASE_PARSE);
+            std::string msg = client->popLine();
+            cmd = parseMessage(msg);
+        }
+        profiler.countLine();
+
+        executeCommand(client, cmd);
     }
 }
 
-bool Server::hasNextMessage(const std::string &buffer) {
-  return buffer.find('\n') != std::string::npos;
+// Resumes clients whose flood penalty has decayed. They go through
+// processClientBuffer again, so the line budget still applies.
+void Server::processThrottled() {
+  long long now = Utils::nowMicros();
+  while (!throttled.empty() && throttled.begin()->first <= now) {
+    int fd = throttled.begin()->second;
+    throttled.erase(throttled.begin());
+    std::map<int, Client *>::iterator it = clients.find(fd);
+    if (it == clients.end() || !it->second->isThrottled()) {
+      continue;
+    }
+    it->second->setThrottled(false);
+    processClientBuffer(it->second);
+  }
 }
 
-std::string Server::extractNextMessage(std::string &buffer) {
-  size_t pos = buffer.find('\n');
-  std::string message = extractMessage(buffer, pos);
-  buffer.erase(0, pos + 1);
-  return message;
+// Revisits deferred clients round-robin, one budget at a time, until none
+// are left or the tick has run tickLineBudget lines; whatever remains is
+// resumed next tick, after the output so far has been flushed.
+void Server::processBacklog() {
+  while (!backlog.empty() && tickLines < tickLineBudget) {
+    int fd = backlog.front();
+    backlog.pop_front();
+    std::map<int, Client *>::iterator it = clients.find(fd);
+    if (it == clients.end() || !it->second->isBacklogged()) {
+      continue;
+    }
+    it->second->setBacklogged(false);
+    processClientBuffer(it->second);
+  }
 }
 
-std::string Server::extractMessage(const std::string &buffer, size_t pos) {
-  size_t end;
-  if (pos > 0 && buffer[pos - 1] == '\r') {
-    end = pos - 1;
-  } else {
-    end = pos;
+// Queues the lines other threads posted for our clients. At most one
+// mailbox worth is taken per tick so producers cannot keep the loop here;
+// a line whose connection has closed, or whose fd now belongs to a newer
+// client, is dropped.
+void Server::processMailbox() {
+  if (!mailbox.hasWork()) {
+    return;
+  }
+  mailbox.acknowledge();
+  MailItem item;
+  for (size_t taken = 0; taken < mailbox.getCapacity() && mailbox.take(item); ++taken) {
+    std::map<int, Client *>::iterator it = clients.find(item.fd);
+    bool live = it != clients.end() && it->second->getSerial() == item.serial && !it->second->isClosing();
+    if (live) {
+      it->second->queueOutput(item.line->str());
+    }
+    mailbox.countDelivered(live);
+    item.line->release();
   }
-  return buffer.substr(0, end);
+}
+
+// Runs after the tick's commands, so a listing started this tick sends
+// its first batch before the output is flushed.
+void Server::processListings() { listings.pump(clients, channels); }
+
+void Server::startListing(Client *client, ListingKind kind) {
+  listings.start(client, kind, snapshots.acquire(channels, clients));
 }
 
 std::list<std::string> Server::parseMessage(const std::string &message) {
@@ -518,30 +852,43 @@ void Server::tokenizePrefix(const std::string &prefix,
   }
 }
 
-void Server::executeCommand(int fd, std::list<std::string> cmdList) {
+void Server::executeCommand(Client *client, const std::list<std::string> &cmdList) {
   if (cmdList.empty()) {
     return;
   }
+  PhaseScope scope(profiler, PHASE_DISPATCH);
 
   std::string cmd = cmdList.front();
   if (!isUpperCase(cmd)) {
-    sendInvalidCommandError(fd, cmd);
+    sendInvalidCommandError(client, cmd);
     return;
   }
 
   std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-  Client *client = clients[fd];
-  dispatchCommand(cmd, cmdList, client);
+  int fd = client->getFd();
+  std::string nickname = client->getNickname();
+  long long start = Utils::nowMicros();
+  floodControl.charge(client, cmd, start);
+  {
+    // Unknown verbs share one scope so clients cannot grow the scope table.
+    std::string scopeName = cmd;
+    AllocScope allocations("command", &scopeName);
+    if (!dispatchCommand(cmd, cmdList, client)) {
+      scopeName = "unknown";
+    }
+  }
+  slowLog.record(cmdList, fd, nickname, Utils::nowMicros() - start);
 }
 
-void Server::sendInvalidCommandError(int fd, const std::string &cmd) {
-  clients[fd]->sendReply(":ircserv " ERR_UNKNOWNCOMMAND " * " + cmd +
-                         " :Commands must be uppercase\r\n");
-  Logger::warning("Invalid command received from fd " + Utils::intToString(fd) +
+void Server::sendInvalidCommandError(Client *client, const std::string &cmd) {
+  client->sendReply(":ircserv " ERR_UNKNOWNCOMMAND " * " + cmd +
+                    " :Commands must be uppercase\r\n");
+  Logger::warning("Invalid command received from fd " + Utils::intToString(client->getFd()) +
                   ": " + cmd);
 }
 
-void Server::dispatchCommand(const std::string &cmd,
+// Returns false when `cmd` is not a command this server knows.
+bool Server::dispatchCommand(const std::string &cmd,
                              std::list<std::string> cmdList, Client *client) {
   if (cmd == "PASS") {
     handlePass(cmdList, client, this);
@@ -553,6 +900,8 @@ void Server::dispatchCommand(const std::string &cmd,
     handleJoin(cmdList, client, this);
   } else if (cmd == "PRIVMSG") {
     handlePrivmsg(cmdList, client, this);
+  } else if (cmd == "NOTICE") {
+    handleNotice(cmdList, client, this);
   } else if (cmd == "PART") {
     handlePart(cmdList, client, this);
   } else if (cmd == "MODE") {
@@ -561,6 +910,8 @@ void Server::dispatchCommand(const std::string &cmd,
     handleInvite(cmdList, client, this);
   } else if (cmd == "NAMES") {
     handleNames(cmdList, client, this);
+  } else if (cmd == "LIST") {
+    handleList(cmdList, client, this);
   } else if (cmd == "TOPIC") {
     handleTopic(cmdList, client, this);
   } else if (cmd == "KICK") {
@@ -569,9 +920,19 @@ void Server::dispatchCommand(const std::string &cmd,
     handleQuit(cmdList, client, this);
   } else if (cmd == "PING") {
     handlePing(cmdList, client, this);
+  } else if (cmd == "OPER") {
+    handleOper(cmdList, client, this);
+  } else if (cmd == "SLOWLOG") {
+    handleSlowlog(cmdList, client, this);
+  } else if (cmd == "STATS") {
+    handleStats(cmdList, client, this);
+  } else if (cmd == "MEMORY") {
+    handleMemory(cmdList, client, this);
   } else {
     sendUnknownCommandError(client, cmd);
+    return false;
   }
+  return true;
 }
 
 void Server::sendUnknownCommandError(Client *client, const std::string &cmd) {
@@ -606,8 +967,151 @@ void Server::removeChannel(const std::string &channelName) {
   }
 }
 
+// Signal handlers only set flags: logging here could deadlock on a lock
+// held by the code the signal interrupted.
 void Server::sigHandler(int sig) {
   (void)sig;
-  Logger::warning("Signal received! Stopping server...");
   signal = true;
 }
+
+void Server::upgradeHandler(int sig) {
+  (void)sig;
+  upgradeRequested = true;
+}
+
+void Server::dumpHandler(int sig) {
+  (void)sig;
+  dumpRequested = true;
+}
+
+void Server::handleDumpRequest() {
+  dumpRequested = false;
+  slowLog.dump();
+  Logger::info("Tick profile " + TickProfiler::formatWindow(profiler.aggregate(TICK_WINDOW_COUNT), "60s"));
+}
+
+// A listing half sent when an upgrade is requested gets
+// UPGRADE_LISTING_WAIT_MS to finish. A client that stopped reading would
+// hold it up for good, so after that the listings still going are cut short.
+bool Server::finishListingsForUpgrade() {
+  if (listings.empty()) {
+    upgradeWaitStartUs = 0;
+    return true;
+  }
+  long long now = Utils::nowMicros();
+  if (upgradeWaitStartUs == 0) {
+    upgradeWaitStartUs = now;
+  }
+  if (now - upgradeWaitStartUs < UPGRADE_LISTING_WAIT_MS * 1000LL) {
+    return false;
+  }
+  size_t cut = listings.cut(clients);
+  Logger::warning("Upgrade: cut short " + Utils::intToString(static_cast<int>(cut)) +
+                  " NAMES/LIST replies that did not finish in time");
+  upgradeWaitStartUs = 0;
+  return true;
+}
+
+// Runs at the end of a tick, once no listing is half sent: what is left of
+// the tick's output is in the clients' queues, which are part of the state.
+// The old process stops serving while the new one loads; clients only see
+// a pause. If the new process fails to confirm, this one carries on.
+void Server::handleUpgradeRequest() {
+  upgradeRequested = false;
+  if (transport->getListenFd() < 0 || executable.empty()) {
+    Logger::warning("Upgrade requested, but this server cannot hand over its sockets.");
+    return;
+  }
+  if (standby.isActive()) {
+    Logger::warning("Upgrade requested, but a standby has nothing to hand over; restart it instead.");
+    return;
+  }
+  Logger::info("Upgrade requested: handing " + Utils::intToString(static_cast<int>(clients.size())) +
+               " clients over to a new " + executable);
+  StateWriter state;
+  saveState(state);
+  // The successor reloads the saved channels nobody has rejoined from here.
+  channelStore.save(channels);
+  // Standbys reconnect to the successor and get a snapshot from it.
+  replication.stop();
+  // The successor reopens IRCSERV_CAPTURE from scratch; nothing buffered
+  // here may land in its file afterwards.
+  if (capture.isActive()) {
+    capture.stop("closed for the upgrade; the new process starts a new capture");
+  }
+  std::vector<int> fds;
+  fds.reserve(clients.size() + 1);
+  fds.push_back(transport->getListenFd());
+  for (std::map<int, Client *>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+    fds.push_back(it->first);
+  }
+  std::vector<std::string> args;
+  args.push_back(Utils::intToString(port));
+  args.push_back(password);
+
+  int link = -1;
+  pid_t child = HotUpgrade::spawn(executable, args, link);
+  if (child < 0) {
+    Logger::warning("Upgrade failed: cannot start " + executable + ": " + strerror(errno));
+    return;
+  }
+  bool ready = HotUpgrade::send(link, state.str(), fds) && HotUpgrade::awaitReady(link, upgradeTimeoutMs);
+  close(link);
+  if (!ready) {
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    Logger::warning("Upgrade failed: the new process did not take over; still serving.");
+    return;
+  }
+  Logger::info("Upgrade complete: pid " + Utils::intToString(child) + " is serving.");
+  handedOver = true;
+}
+
+void Server::saveState(StateWriter &writer) const {
+  writer.putString(createdtime);
+  writer.putNumber(clients.size());
+  for (std::map<int, Client *>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+    writer.putNumber(it->first);
+    it->second->saveState(writer);
+  }
+  writer.putNumber(channels.size());
+  for (std::map<std::string, Channel *>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+    it->second->saveState(writer);
+  }
+}
+
+// fds[0] is the listening socket, then one per client in saveState() order.
+void Server::restoreState(StateReader &reader, const std::vector<int> &fds) {
+  createdtime = reader.getString();
+  unsigned long long clientCount = reader.getNumber();
+  if (clientCount + 1 != fds.size()) {
+    throw std::runtime_error("Upgrade state does not match the passed sockets");
+  }
+  std::map<int, Client *> byOldFd;
+  for (size_t i = 0; i < clientCount; ++i) {
+    int oldFd = static_cast<int>(reader.getNumber());
+    int fd = fds[i + 1];
+    Client *client = new Client();
+    client->setFd(fd);
+    clients[fd] = client;
+    client->restoreState(reader);
+    byOldFd[oldFd] = client;
+    if (!client->getNickname().empty()) {
+      setClientNickname(client, client->getNickname());
+    }
+    admission.adopt(client->getAddress());
+    watchClient(fd);
+    if (client->hasCompleteLine()) {
+      client->setBacklogged(true);
+      backlog.push_back(fd);
+    }
+  }
+  for (unsigned long long count = reader.getNumber(); count > 0; --count) {
+    Channel *channel = Channel::restoreState(reader, byOldFd);
+    if (channel->getMemberCount() == 0) {
+      delete channel;
+    } else {
+      channels[channel->getName()] = channel;
+    }
+  }
+}
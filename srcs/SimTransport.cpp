@@ -0,0 +1,219 @@
+#include "Includes.hpp"
+#include "SimTransport.hpp"
+
+SimTransport::SimTransport(bool recordOutput) : listening(false), recordOutput(recordOutput) {}
+
+SimTransport::~SimTransport() {}
+
+SimTransport::Connection* SimTransport::find(int fd) {
+    if (fd < SIM_FIRST_HANDLE || static_cast<size_t>(fd - SIM_FIRST_HANDLE) >= connections.size()) {
+        return NULL;
+    }
+    return &connections[fd - SIM_FIRST_HANDLE];
+}
+
+const SimTransport::Connection* SimTransport::find(int fd) const {
+    if (fd < SIM_FIRST_HANDLE || static_cast<size_t>(fd - SIM_FIRST_HANDLE) >= connections.size()) {
+        return NULL;
+    }
+    return &connections[fd - SIM_FIRST_HANDLE];
+}
+
+void SimTransport::markReady(int fd) {
+    Connection* connection = find(fd);
+    if (connection && connection->accepted && !connection->queued) {
+        connection->queued = true;
+        ready.push_back(fd);
+    }
+}
+
+// Level-triggered, like epoll: a connection is reported on every wait()
+// while it still has unread bytes, a pending hangup or write interest.
+unsigned int SimTransport::pendingFlags(const Connection& connection) const {
+    unsigned int flags = 0;
+    if (!connection.open || !connection.accepted) {
+        return 0;
+    }
+    if (!connection.inbound.empty() || connection.hungUp) {
+        flags |= TRANSPORT_READABLE;
+    }
+    if (connection.writable) {
+        flags |= TRANSPORT_WRITABLE;
+    }
+    return flags;
+}
+
+void SimTransport::listen(int port) {
+    (void)port;
+    listening = true;
+}
+
+bool SimTransport::isListener(int fd) const { return fd == SIM_LISTENER_HANDLE; }
+
+int SimTransport::getListenFd() const { return -1; }
+
+int SimTransport::wait(std::vector<TransportEvent>& events, int timeoutMs) {
+    (void)timeoutMs;
+    size_t count = 0;
+    if (listening && !pendingAccepts.empty() && count < events.size()) {
+        events[count].fd = SIM_LISTENER_HANDLE;
+        events[count].flags = TRANSPORT_READABLE;
+        ++count;
+    }
+    size_t scanned = ready.size();
+    for (size_t i = 0; i < scanned && count < events.size(); ++i) {
+        int fd = ready.front();
+        ready.pop_front();
+        Connection& connection = *find(fd);
+        unsigned int flags = pendingFlags(connection);
+        if (!flags) {
+            connection.queued = false;
+            continue;
+        }
+        events[count].fd = fd;
+        events[count].flags = flags;
+        ++count;
+        ready.push_back(fd);
+    }
+    return static_cast<int>(count);
+}
+
+int SimTransport::accept(struct sockaddr_in& address) {
+    if (pendingAccepts.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int fd = pendingAccepts.front();
+    pendingAccepts.pop_front();
+    Connection& connection = *find(fd);
+    connection.accepted = true;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = connection.address;
+    return fd;
+}
+
+bool SimTransport::watch(int fd) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open) {
+        return false;
+    }
+    markReady(fd);
+    return true;
+}
+
+// Handles here are not real fds; the server polls its mailbox every tick.
+bool SimTransport::watchWakeup(int) { return false; }
+
+bool SimTransport::setWritable(int fd, bool enabled) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open) {
+        return false;
+    }
+    connection->writable = enabled;
+    if (enabled) {
+        markReady(fd);
+    }
+    return true;
+}
+
+ssize_t SimTransport::read(int fd, char* buffer, size_t length) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open) {
+        errno = EBADF;
+        return -1;
+    }
+    if (connection->inbound.empty()) {
+        if (connection->hungUp) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t count = std::min(length, connection->inbound.size());
+    std::memcpy(buffer, connection->inbound.data(), count);
+    connection->inbound.erase(0, count);
+    return static_cast<ssize_t>(count);
+}
+
+ssize_t SimTransport::write(int fd, const char* data, size_t length) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open) {
+        errno = EBADF;
+        return -1;
+    }
+    if (connection->hungUp) {
+        errno = EPIPE;
+        return -1;
+    }
+    connection->bytesWritten += length;
+    if (recordOutput) {
+        connection->outbound.append(data, length);
+    }
+    return static_cast<ssize_t>(length);
+}
+
+void SimTransport::close(int fd) {
+    Connection* connection = find(fd);
+    if (!connection) {
+        return;
+    }
+    connection->open = false;
+    std::string().swap(connection->inbound);
+}
+
+int SimTransport::connect(in_addr_t address) {
+    Connection connection;
+    connection.bytesWritten = 0;
+    connection.address = address;
+    connection.open = true;
+    connection.accepted = false;
+    connection.hungUp = false;
+    connection.writable = false;
+    connection.queued = false;
+    connections.push_back(connection);
+    int fd = static_cast<int>(connections.size() - 1) + SIM_FIRST_HANDLE;
+    pendingAccepts.push_back(fd);
+    return fd;
+}
+
+void SimTransport::send(int fd, const std::string& data) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open || connection->hungUp) {
+        return;
+    }
+    connection->inbound += data;
+    markReady(fd);
+}
+
+void SimTransport::hangup(int fd) {
+    Connection* connection = find(fd);
+    if (!connection || !connection->open) {
+        return;
+    }
+    connection->hungUp = true;
+    markReady(fd);
+}
+
+std::string SimTransport::takeOutput(int fd) {
+    std::string output;
+    Connection* connection = find(fd);
+    if (connection) {
+        output.swap(connection->outbound);
+    }
+    return output;
+}
+
+unsigned long long SimTransport::getBytesWritten(int fd) const {
+    const Connection* connection = find(fd);
+    return connection ? connection->bytesWritten : 0;
+}
+
+bool SimTransport::isOpen(int fd) const {
+    const Connection* connection = find(fd);
+    return connection && connection->open;
+}
+
+bool SimTransport::hasActivity() const {
+    return !pendingAccepts.empty() || !ready.empty();
+}
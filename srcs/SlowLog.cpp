@@ -0,0 +1,89 @@
+#include "Includes.hpp"
+#include "SlowLog.hpp"
+#include "Metrics.hpp"
+
+SlowLog::SlowLog()
+    : thresholdUs(static_cast<long long>(Utils::envToSize("IRCSERV_SLOWLOG_THRESHOLD_US", SLOWLOG_DEFAULT_THRESHOLD_US))),
+      maxEntries(Utils::envToSize("IRCSERV_SLOWLOG_MAX_ENTRIES", SLOWLOG_DEFAULT_MAX_ENTRIES)),
+      nextId(0)
+{
+}
+
+SlowLog::~SlowLog() {}
+
+std::string SlowLog::truncateArgs(const std::list<std::string>& cmdList) {
+    std::string args;
+    std::list<std::string>::const_iterator it = cmdList.begin();
+    if (it == cmdList.end())
+        return args;
+    if (*it == "PASS" || *it == "OPER")
+        return "<redacted>";
+    ++it;
+    for (; it != cmdList.end(); ++it) {
+        if (!args.empty())
+            args += " ";
+        args += *it;
+        if (args.size() > SLOWLOG_MAX_ARGS_LENGTH)
+            break;
+    }
+    if (args.size() > SLOWLOG_MAX_ARGS_LENGTH) {
+        args.erase(SLOWLOG_MAX_ARGS_LENGTH);
+        args += "...";
+    }
+    return args;
+}
+
+bool SlowLog::record(const std::list<std::string>& cmdList, int fd, const std::string& nickname, long long durationUs) {
+    if (durationUs < thresholdUs || maxEntries == 0 || cmdList.empty()) {
+        return false;
+    }
+
+    SlowLogEntry entry;
+    entry.id = nextId++;
+    entry.timestamp = time(NULL);
+    entry.durationUs = durationUs;
+    entry.fd = fd;
+    entry.nickname = nickname.empty() ? "*" : nickname;
+    entry.verb = cmdList.front();
+    entry.args = truncateArgs(cmdList);
+
+    entries.push_front(entry);
+    if (entries.size() > maxEntries) {
+        entries.pop_back();
+    }
+    Logger::warning("Slow command: " + formatEntry(entry));
+    return true;
+}
+
+void SlowLog::reset() {
+    entries.clear();
+}
+
+long long SlowLog::getThresholdUs() const { return thresholdUs; }
+size_t SlowLog::getMaxEntries() const { return maxEntries; }
+const std::deque<SlowLogEntry>& SlowLog::getEntries() const { return entries; }
+
+std::string SlowLog::formatEntry(const SlowLogEntry& entry) {
+    std::ostringstream oss;
+    oss << "#" << entry.id << " " << Utils::formatTime(entry.timestamp)
+        << " " << entry.durationUs << "us " << entry.nickname
+        << " (fd " << entry.fd << ") " << entry.verb;
+    if (!entry.args.empty()) {
+        oss << " " << entry.args;
+    }
+    return oss.str();
+}
+
+void SlowLog::dump() const {
+    Logger::info("Slow log dump: " + Utils::intToString(entries.size()) + " entries, threshold " +
+                 Utils::intToString(static_cast<int>(thresholdUs)) + "us");
+    for (std::deque<SlowLogEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        Logger::info("  " + formatEntry(*it));
+    }
+}
+
+void SlowLog::appendMetrics(MetricsWriter& writer) const {
+    writer.counter("ircserv_slowlog_recorded_total", "Commands that exceeded the slow log threshold", nextId);
+    writer.gauge("ircserv_slowlog_entries", "Entries currently held in the slow log", entries.size());
+    writer.gauge("ircserv_slowlog_threshold_seconds", "Slow log threshold", thresholdUs / 1e6);
+}
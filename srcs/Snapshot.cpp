@@ -0,0 +1,258 @@
+#include "Includes.hpp"
+#include "Snapshot.hpp"
+
+unsigned long long ChannelView::builds = 0;
+size_t ChannelView::live = 0;
+unsigned long SnapshotCache::version = 1;
+
+ChannelView::ChannelView(const Channel& channel)
+    : refs(1), name(channel.getName()), topic(channel.getTopic()), members(channel.getMemberList()),
+      memberCount(channel.getMemberCount()), secret(channel.getSecret())
+{
+    ++builds;
+    ++live;
+}
+
+ChannelView::~ChannelView() { --live; }
+
+ChannelView* ChannelView::create(const Channel& channel) { return new ChannelView(channel); }
+
+void ChannelView::retain() { ++refs; }
+
+void ChannelView::release() {
+    if (--refs == 0) {
+        delete this;
+    }
+}
+
+const std::string& ChannelView::getName() const { return name; }
+const std::string& ChannelView::getTopic() const { return topic; }
+const std::string& ChannelView::getMembers() const { return members; }
+size_t ChannelView::getMemberCount() const { return memberCount; }
+bool ChannelView::isSecret() const { return secret; }
+unsigned long long ChannelView::getBuilds() { return builds; }
+size_t ChannelView::getLive() { return live; }
+
+// Membership is marked by fd, so finding the users on no channel costs
+// one pass over the member maps instead of a set of nickname strings.
+RegistrySnapshot::RegistrySnapshot(unsigned long version, std::map<std::string, Channel*>& channels,
+                                   const std::map<int, Client*>& clients)
+    : refs(1), version(version)
+{
+    this->channels.reserve(channels.size());
+    std::vector<bool> onChannel(clients.empty() ? 0 : clients.rbegin()->first + 1, false);
+    for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        ChannelView* view = it->second->getView();
+        view->retain();
+        this->channels.push_back(view);
+        it->second->markMembers(onChannel);
+    }
+    for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client* client = it->second;
+        if (client->isRegistered() && !onChannel[it->first]) {
+            std::string nick = client->getNickname();
+            if (nick.empty()) {
+                continue;
+            }
+            if (!loneNicks.empty()) {
+                loneNicks += " ";
+            }
+            loneNicks += nick;
+        }
+    }
+}
+
+RegistrySnapshot::~RegistrySnapshot() {
+    for (std::vector<ChannelView*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        (*it)->release();
+    }
+}
+
+void RegistrySnapshot::retain() { ++refs; }
+
+void RegistrySnapshot::release() {
+    if (--refs == 0) {
+        delete this;
+    }
+}
+
+unsigned long RegistrySnapshot::getVersion() const { return version; }
+size_t RegistrySnapshot::size() const { return channels.size(); }
+const ChannelView& RegistrySnapshot::at(size_t index) const { return *channels[index]; }
+const std::string& RegistrySnapshot::getLoneNicks() const { return loneNicks; }
+
+SnapshotCache::SnapshotCache() : current(NULL), builds(0), reuses(0) {}
+
+SnapshotCache::~SnapshotCache() {
+    if (current) {
+        current->release();
+    }
+}
+
+void SnapshotCache::invalidate() { ++version; }
+
+// The caller owns one reference to the result.
+RegistrySnapshot* SnapshotCache::acquire(std::map<std::string, Channel*>& channels,
+                                         const std::map<int, Client*>& clients) {
+    if (current && current->getVersion() == version) {
+        ++reuses;
+    } else {
+        if (current) {
+            current->release();
+        }
+        current = new RegistrySnapshot(version, channels, clients);
+        ++builds;
+    }
+    current->retain();
+    return current;
+}
+
+void SnapshotCache::appendMetrics(MetricsWriter& writer) const {
+    writer.counter("ircserv_snapshot_builds_total", "Registry snapshots built for NAMES and LIST", builds);
+    writer.counter("ircserv_snapshot_reuses_total", "Listings served from an unchanged registry snapshot", reuses);
+    writer.counter("ircserv_channel_view_builds_total", "Channel views rebuilt after a change",
+                   ChannelView::getBuilds());
+    writer.gauge("ircserv_channel_views", "Channel views alive, current and superseded", ChannelView::getLive());
+}
+
+ListingQueue::ListingQueue()
+    : batch(std::max<size_t>(1, Utils::envToSize("IRCSERV_LISTING_BATCH", LISTING_DEFAULT_BATCH))), started(0),
+      completed(0), abandoned(0), cutShort(0)
+{
+}
+
+ListingQueue::~ListingQueue() {
+    for (std::vector<ListingCursor>::iterator it = cursors.begin(); it != cursors.end(); ++it) {
+        it->snapshot->release();
+    }
+}
+
+// Takes over the caller's reference to the snapshot.
+void ListingQueue::start(Client* client, ListingKind kind, RegistrySnapshot* snapshot) {
+    ListingCursor cursor;
+    cursor.fd = client->getFd();
+    cursor.serial = client->getSerial();
+    cursor.kind = kind;
+    cursor.snapshot = snapshot;
+    cursor.next = 0;
+    cursors.push_back(cursor);
+    ++started;
+}
+
+bool ListingQueue::empty() const { return cursors.empty(); }
+
+// True when pump() would make progress: some listing's client can take
+// more output, or has gone and its listing is to be dropped.
+bool ListingQueue::ready(const std::map<int, Client*>& clients) const {
+    for (std::vector<ListingCursor>::const_iterator it = cursors.begin(); it != cursors.end(); ++it) {
+        std::map<int, Client*>::const_iterator found = clients.find(it->fd);
+        if (found == clients.end() || found->second->getOutputBufferSize() < LISTING_OUTPUT_LIMIT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ListingQueue::pump(const std::map<int, Client*>& clients, std::map<std::string, Channel*>& channels) {
+    size_t kept = 0;
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        ListingCursor cursor = cursors[i];
+        std::map<int, Client*>::const_iterator found = clients.find(cursor.fd);
+        if (found == clients.end() || found->second->getSerial() != cursor.serial || found->second->isClosing()) {
+            cursor.snapshot->release();
+            ++abandoned;
+            continue;
+        }
+        bool waiting = false;
+        for (size_t j = 0; j < kept && !waiting; ++j) {
+            waiting = cursors[j].fd == cursor.fd;
+        }
+        if (!waiting && step(cursor, found->second, channels)) {
+            cursor.snapshot->release();
+            ++completed;
+            continue;
+        }
+        cursors[kept++] = cursor;
+    }
+    cursors.resize(kept);
+}
+
+// Ends every listing with its end-of-list reply, without the channels not
+// yet sent, and returns how many clients were cut short.
+size_t ListingQueue::cut(const std::map<int, Client*>& clients) {
+    size_t count = 0;
+    for (std::vector<ListingCursor>::iterator it = cursors.begin(); it != cursors.end(); ++it) {
+        std::map<int, Client*>::const_iterator found = clients.find(it->fd);
+        if (found != clients.end() && found->second->getSerial() == it->serial && !found->second->isClosing()) {
+            Client* client = found->second;
+            if (it->kind == LISTING_LIST) {
+                sendListEnd(client);
+            } else {
+                client->sendReply(std::string(IRC_SERVER) + " " + RPL_ENDOFNAMES + " " + client->getNickname() +
+                                  " * :End of NAMES list");
+            }
+            ++count;
+        }
+        it->snapshot->release();
+    }
+    cutShort += count;
+    cursors.clear();
+    return count;
+}
+
+// Sends up to one batch of channels; returns true once the listing is done.
+bool ListingQueue::step(ListingCursor& cursor, Client* client, std::map<std::string, Channel*>& channels) {
+    const RegistrySnapshot& snapshot = *cursor.snapshot;
+    for (size_t sent = 0; sent < batch && cursor.next < snapshot.size(); ++sent) {
+        if (client->getOutputBufferSize() >= LISTING_OUTPUT_LIMIT) {
+            return false;
+        }
+        const ChannelView& view = snapshot.at(cursor.next++);
+        if (cursor.kind == LISTING_NAMES) {
+            sendNames(view, client);
+        } else if (!view.isSecret()) {
+            sendList(view, client);
+        } else {
+            std::map<std::string, Channel*>::iterator live = channels.find(view.getName());
+            if (live != channels.end() && live->second->isMember(client)) {
+                sendList(view, client);
+            }
+        }
+    }
+    if (cursor.next < snapshot.size()) {
+        return false;
+    }
+    if (cursor.kind == LISTING_LIST) {
+        sendListEnd(client);
+    } else if (!snapshot.getLoneNicks().empty()) {
+        client->sendReply(std::string(IRC_SERVER) + " " + RPL_NAMREPLY + " " + client->getNickname() + " = * :" +
+                          snapshot.getLoneNicks());
+        client->sendReply(std::string(IRC_SERVER) + " " + RPL_ENDOFNAMES + " " + client->getNickname() +
+                          " * :End of NAMES list");
+    }
+    return true;
+}
+
+void ListingQueue::sendNames(const ChannelView& view, Client* client) {
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_NAMREPLY + " " + client->getNickname() + " = " +
+                      view.getName() + " :" + view.getMembers());
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_ENDOFNAMES + " " + client->getNickname() + " " +
+                      view.getName() + " :End of NAMES list");
+}
+
+void ListingQueue::sendList(const ChannelView& view, Client* client) {
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_LIST + " " + client->getNickname() + " " + view.getName() +
+                      " " + Utils::intToString(static_cast<int>(view.getMemberCount())) + " :" + view.getTopic());
+}
+
+void ListingQueue::sendListEnd(Client* client) {
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_LISTEND + " " + client->getNickname() + " :End of LIST");
+}
+
+void ListingQueue::appendMetrics(MetricsWriter& writer) const {
+    writer.gauge("ircserv_listings_active", "NAMES and LIST replies being sent from a snapshot", cursors.size());
+    writer.counter("ircserv_listings_started_total", "Whole-registry NAMES and LIST replies started", started);
+    writer.counter("ircserv_listings_completed_total", "Whole-registry NAMES and LIST replies finished", completed);
+    writer.counter("ircserv_listings_abandoned_total", "Listings dropped because the client went away", abandoned);
+    writer.counter("ircserv_listings_cut_total", "Listings ended early to start a hot upgrade", cutShort);
+}
@@ -0,0 +1,183 @@
+#include "Includes.hpp"
+#include "TickProfiler.hpp"
+#include "Metrics.hpp"
+
+void TickWindow::clear(long long start) {
+    startUs = start;
+    ticks = 0;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        phaseUs[i] = 0;
+    }
+    events = 0;
+    maxEvents = 0;
+    lines = 0;
+    maxLines = 0;
+}
+
+void TickWindow::merge(const TickWindow& other) {
+    ticks += other.ticks;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        phaseUs[i] += other.phaseUs[i];
+    }
+    events += other.events;
+    lines += other.lines;
+    maxEvents = std::max(maxEvents, other.maxEvents);
+    maxLines = std::max(maxLines, other.maxLines);
+}
+
+long long TickWindow::totalUs() const {
+    long long total = 0;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        total += phaseUs[i];
+    }
+    return total;
+}
+
+TickProfiler::TickProfiler()
+    : current(0), phase(PHASE_OTHER), lastSwitchUs(Utils::nowMicros()), tickLines(0)
+{
+    for (size_t i = 0; i < TICK_WINDOW_COUNT; ++i) {
+        windows[i].clear(lastSwitchUs);
+    }
+    totals.clear(lastSwitchUs);
+}
+
+TickProfiler::~TickProfiler() {}
+
+void TickProfiler::charge(long long now) {
+    long long elapsed = now - lastSwitchUs;
+    windows[current].phaseUs[phase] += elapsed;
+    totals.phaseUs[phase] += elapsed;
+    lastSwitchUs = now;
+}
+
+LoopPhase TickProfiler::enter(LoopPhase next) {
+    LoopPhase previous = phase;
+    charge(Utils::nowMicros());
+    phase = next;
+    return previous;
+}
+
+void TickProfiler::countLine() {
+    ++tickLines;
+}
+
+void TickProfiler::rotate(long long now) {
+    long long elapsed = now - windows[current].startUs;
+    if (elapsed < TICK_WINDOW_US) {
+        return;
+    }
+    long long steps = elapsed / TICK_WINDOW_US;
+    if (steps > TICK_WINDOW_COUNT) {
+        steps = TICK_WINDOW_COUNT;
+    }
+    for (long long i = 0; i < steps; ++i) {
+        current = (current + 1) % TICK_WINDOW_COUNT;
+        windows[current].clear(now);
+    }
+}
+
+void TickProfiler::endTick(int nfds) {
+    long long now = Utils::nowMicros();
+    charge(now);
+
+    unsigned long events = nfds > 0 ? static_cast<unsigned long>(nfds) : 0;
+    TickWindow& window = windows[current];
+    window.ticks++;
+    window.events += events;
+    window.maxEvents = std::max(window.maxEvents, events);
+    window.lines += tickLines;
+    window.maxLines = std::max(window.maxLines, tickLines);
+
+    totals.ticks++;
+    totals.events += events;
+    totals.maxEvents = std::max(totals.maxEvents, events);
+    totals.lines += tickLines;
+    totals.maxLines = std::max(totals.maxLines, tickLines);
+
+    tickLines = 0;
+    rotate(now);
+}
+
+TickWindow TickProfiler::aggregate(size_t seconds) const {
+    TickWindow result;
+    result.clear(windows[current].startUs);
+    if (seconds > TICK_WINDOW_COUNT) {
+        seconds = TICK_WINDOW_COUNT;
+    }
+    for (size_t i = 0; i < seconds; ++i) {
+        const TickWindow& window = windows[(current + TICK_WINDOW_COUNT - i) % TICK_WINDOW_COUNT];
+        result.merge(window);
+        result.startUs = std::min(result.startUs, window.startUs);
+    }
+    return result;
+}
+
+const TickWindow& TickProfiler::getTotals() const { return totals; }
+
+const char* TickProfiler::phaseName(LoopPhase phase) {
+    static const char* names[PHASE_COUNT] = {
+        "wait", "accept", "read", "parse", "dispatch", "flush", "other"
+    };
+    return names[phase];
+}
+
+std::string TickProfiler::formatWindow(const TickWindow& window, const std::string& label) {
+    std::ostringstream oss;
+    long long total = window.totalUs();
+    long long busy = total - window.phaseUs[PHASE_WAIT];
+    unsigned long ticks = window.ticks ? window.ticks : 1;
+
+    oss << label << " ticks=" << window.ticks;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        oss << " " << phaseName(static_cast<LoopPhase>(i)) << "=" << window.phaseUs[i] << "us";
+    }
+    oss << " busy=" << (total > 0 ? busy * 100 / total : 0) << "%"
+        << " nfds/tick=" << window.events / ticks << " (max " << window.maxEvents << ")"
+        << " lines/tick=" << window.lines / ticks << " (max " << window.maxLines << ")";
+    return oss.str();
+}
+
+void TickProfiler::appendMetrics(MetricsWriter& writer) const {
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        writer.counter("ircserv_loop_phase_seconds_total", "Event loop time spent per phase",
+                       totals.phaseUs[i] / 1e6, std::string("phase=\"") + phaseName(static_cast<LoopPhase>(i)) + "\"");
+    }
+    writer.counter("ircserv_loop_ticks_total", "Event loop iterations", totals.ticks);
+    writer.counter("ircserv_loop_events_total", "Events returned by epoll_wait", totals.events);
+    writer.counter("ircserv_loop_lines_total", "Protocol lines processed", totals.lines);
+
+    static const size_t spans[] = { 1, 10, 60 };
+    static const size_t spanCount = sizeof(spans) / sizeof(spans[0]);
+    TickWindow windows[spanCount];
+    std::string labels[spanCount];
+    for (size_t i = 0; i < spanCount; ++i) {
+        windows[i] = aggregate(spans[i]);
+        labels[i] = "window=\"" + Utils::intToString(spans[i]) + "s\"";
+    }
+    for (size_t i = 0; i < spanCount; ++i) {
+        long long total = windows[i].totalUs();
+        double busy = total > 0 ? static_cast<double>(total - windows[i].phaseUs[PHASE_WAIT]) / total : 0;
+        writer.gauge("ircserv_loop_busy_ratio", "Fraction of loop time not spent in epoll_wait", busy, labels[i]);
+    }
+    for (size_t i = 0; i < spanCount; ++i) {
+        writer.gauge("ircserv_loop_ticks", "Event loop iterations in the window", windows[i].ticks, labels[i]);
+    }
+    for (size_t i = 0; i < spanCount; ++i) {
+        writer.gauge("ircserv_loop_events_per_tick_max", "Largest nfds returned by epoll_wait in the window",
+                     windows[i].maxEvents, labels[i]);
+    }
+    for (size_t i = 0; i < spanCount; ++i) {
+        writer.gauge("ircserv_loop_lines_per_tick_max", "Most lines processed in one tick in the window",
+                     windows[i].maxLines, labels[i]);
+    }
+}
+
+PhaseScope::PhaseScope(TickProfiler& profiler, LoopPhase phase)
+    : profiler(profiler), previous(profiler.enter(phase))
+{
+}
+
+PhaseScope::~PhaseScope() {
+    profiler.enter(previous);
+}
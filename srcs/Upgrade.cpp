@@ -0,0 +1,245 @@
+#include "Includes.hpp"
+#include "Upgrade.hpp"
+
+extern char** environ;
+
+void StateWriter::putNumber(unsigned long long value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void StateWriter::putString(const std::string& value) {
+    putNumber(value.size());
+    data.append(value);
+}
+
+void StateWriter::putFlag(bool value) { data.push_back(value ? 1 : 0); }
+
+const std::string& StateWriter::str() const { return data; }
+
+StateReader::StateReader(const std::string& data) : data(data), pos(0) {}
+
+void StateReader::need(size_t length) const {
+    if (length > data.size() - pos) {
+        throw std::runtime_error("Upgrade state is truncated");
+    }
+}
+
+unsigned long long StateReader::getNumber() {
+    unsigned long long value;
+    need(sizeof(value));
+    std::memcpy(&value, data.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+std::string StateReader::getString() {
+    unsigned long long length = getNumber();
+    need(length);
+    std::string value = data.substr(pos, length);
+    pos += length;
+    return value;
+}
+
+bool StateReader::getFlag() {
+    need(1);
+    return data[pos++] != 0;
+}
+
+// Resolved at startup, before a deploy replaces the file: exec'ing the
+// path then starts the new binary.
+std::string HotUpgrade::currentExecutable() {
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        return "";
+    }
+    return std::string(path, length);
+}
+
+// Everything the child needs is built before fork(): the fan-out workers
+// may hold allocator locks, so the child only calls fcntl() and execve().
+pid_t HotUpgrade::spawn(const std::string& executable, const std::vector<std::string>& args, int& link) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        return -1;
+    }
+    std::string linkVar = std::string(UPGRADE_LINK_ENV "=") + Utils::intToString(pair[1]);
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(executable.c_str()));
+    for (std::vector<std::string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(const_cast<char*>(it->c_str()));
+    }
+    argv.push_back(NULL);
+    std::vector<char*> envp;
+    for (char** var = environ; *var; ++var) {
+        if (std::strncmp(*var, UPGRADE_LINK_ENV "=", sizeof(UPGRADE_LINK_ENV)) != 0) {
+            envp.push_back(*var);
+        }
+    }
+    envp.push_back(const_cast<char*>(linkVar.c_str()));
+    envp.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(pair[1], F_SETFD, 0);
+        execve(executable.c_str(), &argv[0], &envp[0]);
+        _exit(127);
+    }
+    ::close(pair[1]);
+    if (pid < 0) {
+        ::close(pair[0]);
+        return -1;
+    }
+    link = pair[0];
+    return pid;
+}
+
+static bool writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static void readAll(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t got = ::read(fd, data, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            throw std::runtime_error("Upgrade link closed while reading the state");
+        }
+        data += got;
+        length -= got;
+    }
+}
+
+// A header (magic, version, state size, fd count), the state, then the fds
+// in batches, each riding on a single payload byte so that a stream read
+// never merges two batches.
+bool HotUpgrade::send(int link, const std::string& state, const std::vector<int>& fds) {
+    StateWriter header;
+    header.putNumber(UPGRADE_STATE_MAGIC);
+    header.putNumber(UPGRADE_STATE_VERSION);
+    header.putNumber(state.size());
+    header.putNumber(fds.size());
+    if (!writeAll(link, header.str().data(), header.str().size()) || !writeAll(link, state.data(), state.size())) {
+        return false;
+    }
+    for (size_t sent = 0; sent < fds.size(); sent += UPGRADE_FDS_PER_MESSAGE) {
+        size_t count = std::min<size_t>(UPGRADE_FDS_PER_MESSAGE, fds.size() - sent);
+        char marker = 'F';
+        struct iovec payload;
+        payload.iov_base = &marker;
+        payload.iov_len = 1;
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = &control[0];
+        message.msg_controllen = control.size();
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fds[sent], count * sizeof(int));
+        ssize_t written;
+        do {
+            written = sendmsg(link, &message, MSG_NOSIGNAL);
+        } while (written < 0 && errno == EINTR);
+        if (written != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HotUpgrade::awaitReady(int link, int timeoutMs) {
+    struct pollfd ready;
+    ready.fd = link;
+    ready.events = POLLIN;
+    int polled;
+    do {
+        polled = poll(&ready, 1, timeoutMs);
+    } while (polled < 0 && errno == EINTR);
+    char reply = 0;
+    return polled == 1 && ::read(link, &reply, 1) == 1 && reply == 'R';
+}
+
+// The link fd named by the environment, or -1 for a normal start. The
+// variable is cleared so that a later upgrade does not inherit it.
+int HotUpgrade::inheritedLink() {
+    const char* value = getenv(UPGRADE_LINK_ENV);
+    if (!value) {
+        return -1;
+    }
+    std::string text(value);
+    unsetenv(UPGRADE_LINK_ENV);
+    int link = std::atoi(text.c_str());
+    if (link < 0 || fcntl(link, F_SETFD, FD_CLOEXEC) < 0) {
+        throw std::runtime_error("Invalid " UPGRADE_LINK_ENV ": " + text);
+    }
+    return link;
+}
+
+void HotUpgrade::receive(int link, std::string& state, std::vector<int>& fds) {
+    char raw[4 * sizeof(unsigned long long)];
+    readAll(link, raw, sizeof(raw));
+    std::string headerBytes(raw, sizeof(raw));
+    StateReader header(headerBytes);
+    if (header.getNumber() != UPGRADE_STATE_MAGIC) {
+        throw std::runtime_error("Upgrade link did not send an ircserv state");
+    }
+    unsigned long long version = header.getNumber();
+    if (version != UPGRADE_STATE_VERSION) {
+        throw std::runtime_error("Unsupported upgrade state version " + Utils::intToString(static_cast<int>(version)));
+    }
+    state.resize(header.getNumber());
+    size_t expected = header.getNumber();
+    if (!state.empty()) {
+        readAll(link, &state[0], state.size());
+    }
+
+    fds.clear();
+    fds.reserve(expected);
+    while (fds.size() < expected) {
+        size_t count = std::min<size_t>(UPGRADE_FDS_PER_MESSAGE, expected - fds.size());
+        char marker;
+        struct iovec payload;
+        payload.iov_base = &marker;
+        payload.iov_len = 1;
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        struct msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = &control[0];
+        message.msg_controllen = control.size();
+        ssize_t got;
+        do {
+            got = recvmsg(link, &message, MSG_CMSG_CLOEXEC);
+        } while (got < 0 && errno == EINTR);
+        struct cmsghdr* header = got == 1 ? CMSG_FIRSTHDR(&message) : NULL;
+        if (!header || header->cmsg_type != SCM_RIGHTS || (message.msg_flags & MSG_CTRUNC)) {
+            throw std::runtime_error("Upgrade link closed while receiving sockets");
+        }
+        size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* passed = reinterpret_cast<const int*>(CMSG_DATA(header));
+        fds.insert(fds.end(), passed, passed + received);
+    }
+}
+
+void HotUpgrade::signalReady(int link) {
+    char reply = 'R';
+    writeAll(link, &reply, 1);
+}
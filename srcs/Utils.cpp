@@ -1,5 +1,6 @@
 #include "Includes.hpp"
 #include <iostream>
+#include <sys/stat.h>
 
 void Utils::displayBanner() {
     std::cout << "                                             \n";
@@ -23,6 +24,59 @@ std::string Utils::formatTime(time_t t) {
     return std::string(buf);
 }
 
+long long Utils::nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+size_t Utils::envToSize(const char* name, size_t defaultValue) {
+    const char* value = getenv(name);
+    if (!value || !*value)
+        return defaultValue;
+    for (size_t i = 0; value[i]; i++)
+        if (!isdigit(value[i]))
+            return defaultValue;
+    return static_cast<size_t>(std::strtoul(value, NULL, 10));
+}
+
+// Reads a whole regular file; false (with errno set) if it cannot be opened.
+bool Utils::readFile(const std::string& path, std::string& data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        data.resize(info.st_size);
+        size_t got = 0;
+        while (got < data.size()) {
+            ssize_t count = ::read(fd, &data[got], data.size() - got);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            got += count;
+        }
+        data.resize(got);
+    }
+    close(fd);
+    return true;
+}
+
+// Makes a file just created or renamed at `path` survive a crash.
+void Utils::syncDirectoryOf(const std::string& path) {
+    std::string::size_type slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+}
+
 bool Utils::isValidPort(const char* portStr) {
     for (size_t i = 0; portStr[i]; i++)
         if (!isdigit(portStr[i]))
@@ -50,6 +104,8 @@ bool Utils::isValidPassword(const std::string& password) {
 void Utils::setupSignalHandler() {
     signal(SIGINT, Server::sigHandler);
     signal(SIGQUIT, Server::sigHandler);
+    signal(SIGUSR1, Server::dumpHandler);
+    signal(SIGUSR2, Server::upgradeHandler);
     signal(SIGPIPE, SIG_IGN);
 }
 
@@ -0,0 +1,496 @@
+#include "Includes.hpp"
+#include "WriteAheadLog.hpp"
+#include "ChannelStore.hpp"
+#include "Channel.hpp"
+#include "Metrics.hpp"
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define FNV32_OFFSET_BASIS 2166136261U
+#define FNV32_PRIME 16777619U
+
+WriteAheadLog* WriteAheadLog::active = NULL;
+
+static WalFsyncPolicy fsyncPolicyFromEnv() {
+    const char* value = getenv("IRCSERV_WAL_FSYNC");
+    if (!value || !*value || std::strcmp(value, "second") == 0) {
+        return WAL_FSYNC_SECOND;
+    }
+    if (std::strcmp(value, "tick") == 0) {
+        return WAL_FSYNC_TICK;
+    }
+    if (std::strcmp(value, "none") == 0) {
+        return WAL_FSYNC_NONE;
+    }
+    Logger::warning(std::string("Unknown IRCSERV_WAL_FSYNC value ") + value + "; using second");
+    return WAL_FSYNC_SECOND;
+}
+
+static unsigned int checksumOf(const char* data, size_t length) {
+    unsigned int hash = FNV32_OFFSET_BASIS;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * FNV32_PRIME;
+    }
+    return hash;
+}
+
+static void appendNumber(std::string& out, unsigned long long value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+static void appendString(std::string& out, const std::string& value) {
+    appendNumber(out, value.size(), 4);
+    out += value;
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& statePath, bool enabled)
+    : prefix(enabled && !statePath.empty() ? statePath + ".wal." : ""), streaming(false),
+      fsyncPolicy(enabled ? fsyncPolicyFromEnv() : WAL_FSYNC_SECOND),
+      segmentLimit(Utils::envToSize("IRCSERV_WAL_SEGMENT_BYTES", WAL_DEFAULT_SEGMENT_BYTES)), fd(-1), segment(0),
+      segmentBytes(0), unsynced(false), lastSyncUs(Utils::nowMicros()), records(0), payloadBytes(0),
+      bytesWritten(0), commits(0), fsyncs(0), errors(0), replayed(0), replayDurationUs(0) {}
+
+// Records still buffered are dropped: the channels torn down at shutdown
+// or after a handover are not changes the next run should replay.
+WriteAheadLog::~WriteAheadLog() {
+    if (active == this) {
+        active = NULL;
+    }
+    if (fd >= 0) {
+        sync();
+        close(fd);
+    }
+}
+
+bool WriteAheadLog::isEnabled() const { return !prefix.empty(); }
+
+std::string WriteAheadLog::segmentPath(unsigned long number) const {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "%08lu", number);
+    return prefix + suffix;
+}
+
+// Segment numbers on disk, oldest first.
+std::vector<unsigned long> WriteAheadLog::listSegments() const {
+    std::vector<unsigned long> numbers;
+    std::string::size_type slash = prefix.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : prefix.substr(0, slash));
+    std::string base = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        return numbers;
+    }
+    for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+        const char* name = entry->d_name;
+        if (std::strncmp(name, base.c_str(), base.size()) != 0) {
+            continue;
+        }
+        const char* digits = name + base.size();
+        char* end = NULL;
+        unsigned long number = std::strtoul(digits, &end, 10);
+        if (end != digits && *end == '\0' && isdigit(static_cast<unsigned char>(*digits))) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+bool WriteAheadLog::openSegment(unsigned long number) {
+    std::string file = segmentPath(number);
+    int newFd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (newFd < 0) {
+        ++errors;
+        Logger::warning("Cannot open change log " + file + ": " + strerror(errno));
+        return false;
+    }
+    Utils::syncDirectoryOf(file);
+    if (fd >= 0) {
+        sync();
+        close(fd);
+    }
+    struct stat info;
+    fd = newFd;
+    segment = number;
+    segmentBytes = fstat(fd, &info) == 0 ? info.st_size : 0;
+    return true;
+}
+
+void WriteAheadLog::sync() {
+    if (!unsynced) {
+        return;
+    }
+    if (fdatasync(fd) != 0) {
+        ++errors;
+        Logger::warning(std::string("Cannot sync the change log: ") + strerror(errno));
+    }
+    ++fsyncs;
+    unsynced = false;
+    lastSyncUs = Utils::nowMicros();
+}
+
+void WriteAheadLog::append(WalRecordType type, const std::string& body) {
+    frame(type, body, pending);
+    ++records;
+    payloadBytes += body.size();
+}
+
+// Applies the record at `pos` to `channels` and moves `pos` past it,
+// unless the data ends inside the record or its checksum fails. A SYNC
+// record sets `stampUs`. Only the event loop thread applies records.
+WalRecordStatus WriteAheadLog::applyRecord(std::map<std::string, ChannelRecord>& channels, const std::string& data,
+                                           size_t& pos, WalRecordType& type, long long& stampUs) {
+    static std::string name;
+    static std::string nickname;
+    size_t length;
+    unsigned int checksum;
+    try {
+        StateFileReader header(data, pos);
+        type = static_cast<WalRecordType>(header.getByte());
+        length = header.getNumber(4);
+        checksum = static_cast<unsigned int>(header.getNumber(4));
+    } catch (const std::exception&) {
+        return WAL_RECORD_INCOMPLETE;
+    }
+    if (length > data.size() - pos - WAL_RECORD_HEADER) {
+        return WAL_RECORD_INCOMPLETE;
+    }
+    if (checksumOf(data.data() + pos + WAL_RECORD_HEADER, length) != checksum) {
+        return WAL_RECORD_DAMAGED;
+    }
+    // Read in place: the checksum has vouched for the body.
+    StateFileReader reader(data, pos + WAL_RECORD_HEADER);
+    pos += WAL_RECORD_HEADER + length;
+    try {
+        reader.getString(name);
+        std::map<std::string, ChannelRecord>::iterator found = channels.find(name);
+        if (type == WAL_CHANNEL) {
+            if (found == channels.end()) {
+                found = channels.insert(std::make_pair(name, ChannelRecord())).first;
+            } else {
+                found->second = ChannelRecord();
+            }
+            found->second.name = name;
+            ChannelStore::readRecordBody(reader, found->second);
+        } else if (type == WAL_DESTROY) {
+            if (found != channels.end()) {
+                channels.erase(found);
+            }
+        } else if (type == WAL_RESET) {
+            channels.clear();
+        } else if (type == WAL_SYNC) {
+            stampUs = static_cast<long long>(reader.getNumber(8));
+        } else if (found == channels.end()) {
+            return WAL_RECORD_OK;
+        } else if (type == WAL_TOPIC) {
+            reader.getString(found->second.topic);
+            reader.getString(found->second.topicSetter);
+            found->second.topicTime = static_cast<time_t>(reader.getNumber(8));
+        } else if (type == WAL_KEY) {
+            reader.getString(found->second.key);
+        } else if (type == WAL_LIMIT) {
+            found->second.limit = reader.getNumber(8);
+            found->second.limited = reader.getByte() != 0;
+        } else if (type == WAL_MODE) {
+            unsigned char mode = reader.getByte();
+            bool enabled = reader.getByte() != 0;
+            if (mode == 'i') {
+                found->second.inviteOnly = enabled;
+            } else if (mode == 't') {
+                found->second.topicRestricted = enabled;
+            } else if (mode == 's') {
+                found->second.secret = enabled;
+            }
+        } else if (type == WAL_OPERATOR_ADD || type == WAL_OPERATOR_REMOVE) {
+            reader.getString(nickname);
+            std::vector<std::string>& ops = found->second.operators;
+            ops.erase(std::remove(ops.begin(), ops.end(), nickname), ops.end());
+            if (type == WAL_OPERATOR_ADD) {
+                ops.push_back(nickname);
+            }
+        } else if (type == WAL_SAVED_OPERATORS_CLEAR) {
+            found->second.operators.clear();
+        }
+    } catch (const std::exception&) {
+        return WAL_RECORD_MALFORMED;
+    }
+    return WAL_RECORD_OK;
+}
+
+// Replays every segment from `firstSegment` on into `channels` and returns
+// the number the next segment should get. A record cut short by a crash
+// ends the replay of its segment.
+unsigned long WriteAheadLog::replay(std::map<std::string, ChannelRecord>& channels, unsigned long firstSegment) {
+    long long startUs = Utils::nowMicros();
+    unsigned long next = firstSegment;
+    std::vector<unsigned long> numbers = listSegments();
+    std::string data;
+    for (std::vector<unsigned long>::const_iterator it = numbers.begin(); it != numbers.end(); ++it) {
+        if (*it < firstSegment) {
+            continue;
+        }
+        next = *it + 1;
+        std::string file = segmentPath(*it);
+        if (!Utils::readFile(file, data)) {
+            ++errors;
+            Logger::warning("Cannot read change log " + file + ": " + strerror(errno));
+            continue;
+        }
+        size_t pos = 0;
+        WalRecordType type;
+        long long stampUs;
+        while (pos < data.size()) {
+            WalRecordStatus status = applyRecord(channels, data, pos, type, stampUs);
+            if (status == WAL_RECORD_OK) {
+                ++replayed;
+            } else if (status == WAL_RECORD_MALFORMED) {
+                ++errors;
+            } else {
+                break;
+            }
+        }
+        if (pos < data.size()) {
+            std::ostringstream message;
+            message << "Change log " << file << " ends in a damaged record at byte " << pos
+                    << "; ignoring the last " << data.size() - pos << " bytes";
+            Logger::warning(message.str());
+        }
+    }
+    replayDurationUs = Utils::nowMicros() - startUs;
+    if (replayed > 0) {
+        std::ostringstream message;
+        message << "Replayed " << replayed << " change log records in " << replayDurationUs / 1000.0 << " ms";
+        Logger::info(message.str());
+    }
+    return next;
+}
+
+// Starts logging into segment `number`; the hooks record nothing before.
+bool WriteAheadLog::open(unsigned long number) {
+    if (!isEnabled() || !openSegment(number)) {
+        return false;
+    }
+    active = this;
+    return true;
+}
+
+// Keeps every committed batch for takeStream() as well, with or without a
+// log file (see ReplicationFeed).
+void WriteAheadLog::startStream() {
+    streaming = true;
+    active = this;
+}
+
+// Hands over the records committed since the last call.
+void WriteAheadLog::takeStream(std::string& batch) {
+    batch.clear();
+    batch.swap(streamed);
+}
+
+// Writes the records buffered this tick in one write() and syncs them as
+// IRCSERV_WAL_FSYNC says. Called once per tick, before replies go out.
+void WriteAheadLog::commit() {
+    if (streaming) {
+        streamed += pending;
+    }
+    if (fd < 0) {
+        pending.clear();
+        return;
+    }
+    if (!pending.empty()) {
+        const char* data = pending.data();
+        size_t left = pending.size();
+        while (left > 0) {
+            ssize_t count = ::write(fd, data, left);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                ++errors;
+                Logger::warning(std::string("Cannot write the change log: ") + strerror(errno));
+                break;
+            }
+            data += count;
+            left -= count;
+        }
+        bytesWritten += pending.size() - left;
+        segmentBytes += pending.size() - left;
+        pending.clear();
+        unsynced = true;
+        ++commits;
+    }
+    if (fsyncPolicy == WAL_FSYNC_TICK ||
+        (fsyncPolicy == WAL_FSYNC_SECOND && Utils::nowMicros() - lastSyncUs >= WAL_FSYNC_INTERVAL_US)) {
+        sync();
+    }
+    if (segmentBytes >= segmentLimit) {
+        openSegment(segment + 1);
+    }
+}
+
+// Commits what is buffered and starts a new segment, whose number a state
+// file about to be written records as the first one it does not cover.
+unsigned long WriteAheadLog::rotate() {
+    if (fd < 0) {
+        return segment;
+    }
+    commit();
+    sync();
+    openSegment(segment + 1);
+    return segment;
+}
+
+// Removes the segments a committed state file has made obsolete.
+void WriteAheadLog::discardBefore(unsigned long number) {
+    if (!isEnabled()) {
+        return;
+    }
+    std::vector<unsigned long> numbers = listSegments();
+    for (std::vector<unsigned long>::const_iterator it = numbers.begin(); it != numbers.end() && *it < number; ++it) {
+        unlink(segmentPath(*it).c_str());
+    }
+}
+
+unsigned long long WriteAheadLog::getPayloadBytes() const { return payloadBytes; }
+
+void WriteAheadLog::appendMetrics(MetricsWriter& writer, unsigned long long stateBytes) const {
+    writer.gauge("ircserv_wal_enabled", "Whether channel changes go to a change log (IRCSERV_WAL)", isEnabled());
+    writer.counter("ircserv_wal_records_total", "Channel change records logged", records);
+    writer.counter("ircserv_wal_payload_bytes_total", "Bytes of change record bodies logged", payloadBytes);
+    writer.counter("ircserv_wal_bytes_total", "Bytes written to change log segments", bytesWritten);
+    writer.counter("ircserv_wal_commits_total", "Ticks whose change records were written", commits);
+    writer.counter("ircserv_wal_fsyncs_total", "Change log syncs to disk", fsyncs);
+    writer.counter("ircserv_wal_errors_total", "Change log writes, syncs and replayed records that failed", errors);
+    writer.gauge("ircserv_wal_segment", "Number of the change log segment being written", segment);
+    writer.gauge("ircserv_wal_replayed_records", "Change records replayed at startup", replayed);
+    writer.gauge("ircserv_wal_replay_seconds", "Time spent replaying the change log at startup",
+                 replayDurationUs / 1e6);
+    writer.gauge("ircserv_wal_write_amplification",
+                 "Bytes written to the change log and state files per byte of change record body",
+                 payloadBytes ? static_cast<double>(bytesWritten + stateBytes) / payloadBytes : 0);
+}
+
+// A framed CHANNEL record carrying all of `record`, as logged when a
+// channel gets its first member and sent in a replication snapshot.
+void WriteAheadLog::encodeChannel(const ChannelRecord& record, std::string& out) {
+    std::string body;
+    appendString(body, record.name);
+    appendString(body, record.topic);
+    appendString(body, record.topicSetter);
+    appendNumber(body, static_cast<unsigned long long>(record.topicTime), 8);
+    appendString(body, record.key);
+    appendString(body, record.createdTime);
+    appendNumber(body, record.limit, 8);
+    appendNumber(body, (record.inviteOnly ? STATE_FLAG_INVITE_ONLY : 0) |
+                           (record.topicRestricted ? STATE_FLAG_TOPIC_RESTRICTED : 0) |
+                           (record.limited ? STATE_FLAG_LIMITED : 0) | (record.secret ? STATE_FLAG_SECRET : 0),
+                 1);
+    appendNumber(body, record.operators.size(), 4);
+    for (std::vector<std::string>::const_iterator it = record.operators.begin(); it != record.operators.end(); ++it) {
+        appendString(body, *it);
+    }
+    frame(WAL_CHANNEL, body, out);
+}
+
+// A framed RESET or SYNC record, which name no channel.
+void WriteAheadLog::encodeMarker(WalRecordType type, long long stampUs, std::string& out) {
+    std::string body;
+    appendString(body, "");
+    appendNumber(body, static_cast<unsigned long long>(stampUs), 8);
+    frame(type, body, out);
+}
+
+void WriteAheadLog::frame(WalRecordType type, const std::string& body, std::string& out) {
+    out += static_cast<char>(type);
+    appendNumber(out, body.size(), 4);
+    appendNumber(out, checksumOf(body.data(), body.size()), 4);
+    out += body;
+}
+
+void WriteAheadLog::logChannel(const Channel& channel) {
+    if (!active) {
+        return;
+    }
+    ChannelRecord record;
+    channel.toRecord(record);
+    size_t start = active->pending.size();
+    encodeChannel(record, active->pending);
+    ++active->records;
+    active->payloadBytes += active->pending.size() - start - WAL_RECORD_HEADER;
+}
+
+void WriteAheadLog::logDestroy(const std::string& channel) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    active->append(WAL_DESTROY, body);
+}
+
+void WriteAheadLog::logTopic(const std::string& channel, const std::string& topic, const std::string& setter,
+                             time_t when) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    appendString(body, topic);
+    appendString(body, setter);
+    appendNumber(body, static_cast<unsigned long long>(when), 8);
+    active->append(WAL_TOPIC, body);
+}
+
+void WriteAheadLog::logKey(const std::string& channel, const std::string& key) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    appendString(body, key);
+    active->append(WAL_KEY, body);
+}
+
+void WriteAheadLog::logLimit(const std::string& channel, size_t limit, bool limited) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    appendNumber(body, limit, 8);
+    appendNumber(body, limited, 1);
+    active->append(WAL_LIMIT, body);
+}
+
+void WriteAheadLog::logMode(const std::string& channel, char mode, bool enabled) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    appendNumber(body, static_cast<unsigned char>(mode), 1);
+    appendNumber(body, enabled, 1);
+    active->append(WAL_MODE, body);
+}
+
+void WriteAheadLog::logOperator(const std::string& channel, const std::string& nickname, bool added) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    appendString(body, Utils::toLower(nickname));
+    active->append(added ? WAL_OPERATOR_ADD : WAL_OPERATOR_REMOVE, body);
+}
+
+void WriteAheadLog::logSavedOperatorsClear(const std::string& channel) {
+    if (!active) {
+        return;
+    }
+    std::string body;
+    appendString(body, channel);
+    active->append(WAL_SAVED_OPERATORS_CLEAR, body);
+}
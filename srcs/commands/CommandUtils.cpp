@@ -53,4 +53,13 @@ namespace CommandUtils {
             return client->getNickname();
         }
     }
+
+    bool validateIrcOperator(Client* client) {
+        if (!client->isIrcOperator()) {
+            client->sendReply(std::string(IRC_SERVER) + " " + ERR_NOPRIVILEGES + " " +
+                          getNicknameOrDefault(client, "*") + " :Permission Denied- You're not an IRC operator");
+            return false;
+        }
+        return true;
+    }
 }
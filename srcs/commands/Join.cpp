@@ -22,6 +22,12 @@ static Channel* getOrCreateChannel(const std::string& channelName, Client* clien
     if (chanIt == channels.end()) {
         Channel* newChannel = new Channel(channelName, client);
         channels[channelName] = newChannel;
+        const ChannelRecord* record = server->getChannelStore().find(channelName);
+        if (record) {
+            newChannel->restoreRecord(*record);
+            Logger::info("Channel " + channelName + " restored from the state file for " + client->getNickname());
+            return newChannel;
+        }
         newChannel->addOperator(client->getFd());
         Logger::info("Channel " + channelName + " created by " + client->getNickname() + ", " +
                      client->getNickname() + " set as operator");
@@ -40,7 +46,8 @@ static bool checkExistingMembership(Channel* channel, Client* client) {
 }
 
 static bool validateChannelModes(Channel* channel, Client* client, const std::string& key) {
-    if (channel->getInviteOnly() && !channel->isInvited(client->getFd())) {
+    if (channel->getInviteOnly() && !channel->isInvited(client->getFd()) &&
+        !channel->isSavedOperator(client->getNickname())) {
         client->sendReply(std::string(IRC_SERVER) + " " + ERR_INVITEONLYCHAN + " " +
                           client->getNickname() + " " + channel->getName() + " :Cannot join channel (+i)\r\n");
         Logger::warning(client->getNickname() + " failed to join " + channel->getName() + " due to +i restriction");
@@ -108,10 +115,14 @@ static void processSingleJoin(const std::string& channelName, const std::string&
     }
 
     if (!validateChannelModes(channel, client, key)) {
+        if (channel->getMemberCount() == 0) {
+            server->removeChannel(channelName);
+        }
         return;
     }
 
     channel->addMember(client);
+    server->getChannelStore().claim(channelName);
     sendJoinMessages(channelName, channel, client);
     Logger::info(client->getNickname() + " joined " + channelName);
 }
@@ -0,0 +1,32 @@
+#include "Includes.hpp"
+
+// Named channels are answered at once from their current views; secret
+// channels only show to their members.
+static void handleListWithChannels(const std::string& channelsStr, Client* client, Server* server) {
+    std::map<std::string, Channel*>& chMap = server->getChannels();
+    std::list<std::string> names = Utils::split(channelsStr, ',');
+    for (std::list<std::string>::iterator it = names.begin(); it != names.end(); ++it) {
+        std::map<std::string, Channel*>::iterator chIter = chMap.find(*it);
+        if (chIter == chMap.end()) {
+            continue;
+        }
+        Channel* channel = chIter->second;
+        if (!channel->getSecret() || channel->isMember(client)) {
+            ListingQueue::sendList(*channel->getView(), client);
+        }
+    }
+    ListingQueue::sendListEnd(client);
+}
+
+void handleList(std::list<std::string> cmdList, Client* client, Server* server) {
+    if (!CommandUtils::validateClientRegistration(client)) {
+        return;
+    }
+    std::list<std::string>::iterator it = cmdList.begin();
+    ++it;
+    if (it == cmdList.end() || it->empty()) {
+        server->startListing(client, LISTING_LIST);
+        return;
+    }
+    handleListWithChannels(*it, client, server);
+}
@@ -0,0 +1,81 @@
+#include "Includes.hpp"
+
+static void sendMemoryNotice(Client* client, const std::string& text) {
+    client->sendReply(std::string(IRC_SERVER) + " NOTICE " + client->getNickname() + " :" + text);
+}
+
+static void sendCategories(Client* client) {
+    for (int i = 0; i < MEM_CATEGORY_COUNT; ++i) {
+        MemoryCategory category = static_cast<MemoryCategory>(i);
+        std::ostringstream oss;
+        oss << "MEMORY " << MemoryAccounting::categoryName(category) << " "
+            << MemoryAccounting::get(category) << " bytes (peak "
+            << MemoryAccounting::getPeak(category) << ")";
+        sendMemoryNotice(client, oss.str());
+    }
+    std::ostringstream totals;
+    totals << "MEMORY accounted " << MemoryAccounting::total() << " bytes, resident "
+           << MemoryAccounting::residentBytes() << " bytes";
+    sendMemoryNotice(client, totals.str());
+}
+
+static void sendPools(Client* client) {
+    std::vector<SlabPool*>& pools = SlabPool::registry();
+    for (std::vector<SlabPool*>::iterator it = pools.begin(); it != pools.end(); ++it) {
+        PoolStats stats = (*it)->stats();
+        std::ostringstream oss;
+        oss << "MEMORY pool " << stats.name << "/" << stats.objectSize << " " << stats.inUse << "/"
+            << stats.capacity << " slots in use (peak " << stats.peak << ", " << stats.slotSize
+            << "-byte slots, " << stats.slabs << " slabs)";
+        sendMemoryNotice(client, oss.str());
+    }
+}
+
+static void sendAllocScopes(Client* client) {
+    std::map<std::string, AllocScopeStats> stats = AllocTrace::snapshot();
+    for (std::map<std::string, AllocScopeStats>::iterator it = stats.begin(); it != stats.end(); ++it) {
+        std::ostringstream oss;
+        oss << "MEMORY alloc " << it->first << " " << it->second.allocs / it->second.calls << " allocs/call (max "
+            << it->second.maxAllocs << ", " << it->second.bytes / it->second.calls << " bytes/call, "
+            << it->second.calls << " calls)";
+        sendMemoryNotice(client, oss.str());
+    }
+}
+
+static void sendSendqStats(Client* client) {
+    std::ostringstream oss;
+    oss << "MEMORY sendq limit " << client->getSendqLimit() << " bytes, high water "
+        << Client::getSendqHighWater() << " bytes, " << Client::getSendqEvictions() << " evictions";
+    sendMemoryNotice(client, oss.str());
+}
+
+static void sendTopClients(Client* client, Server* server, size_t count) {
+    std::vector<Client*> top = server->getTopBufferedClients(count);
+    for (std::vector<Client*>::iterator it = top.begin(); it != top.end(); ++it) {
+        std::ostringstream oss;
+        oss << "MEMORY top " << CommandUtils::getNicknameOrDefault(*it, "*")
+            << " (fd " << (*it)->getFd() << ") input " << (*it)->getInputBufferSize()
+            << " output " << (*it)->getOutputBufferSize() << " bytes";
+        sendMemoryNotice(client, oss.str());
+    }
+}
+
+void handleMemory(std::list<std::string> cmdList, Client* client, Server* server) {
+    if (!CommandUtils::validateClientRegistration(client) || !CommandUtils::validateIrcOperator(client)) {
+        return;
+    }
+
+    size_t count = MEMORY_DEFAULT_TOP_CLIENTS;
+    std::list<std::string>::iterator it = cmdList.begin();
+    ++it;
+    if (it != cmdList.end() && !it->empty() && it->find_first_not_of("0123456789") == std::string::npos) {
+        count = static_cast<size_t>(std::strtoul(it->c_str(), NULL, 10));
+    }
+
+    sendCategories(client);
+    sendPools(client);
+    sendAllocScopes(client);
+    sendSendqStats(client);
+    sendTopClients(client, server, count);
+    sendMemoryNotice(client, "MEMORY End of report");
+}
@@ -25,25 +25,27 @@ static bool isValidNickFormat(const std::string& nick) {
     return nick.find_first_not_of(allowed) == std::string::npos;
 }
 
-static bool isNickAvailable(const std::string& nick, Client* client, std::map<int, Client*>& clients) {
-    for (std::map<int, Client*>::iterator it = clients.begin(); it != clients.end(); ++it) {
-        Client* other = it->second;
-        if (other == client) continue;
-        if (Utils::toLower(other->getNickname()) == Utils::toLower(nick)) {
-            client->sendReply(IRC_SERVER " " ERR_NICKNAMEINUSE " * " + nick + " :Nickname is already in use");
-            return false;
-        }
+static bool isNickAvailable(const std::string& nick, Client* client, Server* server) {
+    Client* other = server->getClientByNickname(nick);
+    if (other && other != client) {
+        client->sendReply(IRC_SERVER " " ERR_NICKNAMEINUSE " * " + nick + " :Nickname is already in use");
+        return false;
     }
     return true;
 }
 
-static void updateNickAndNotify(Client* client, const std::string& nick) {
+static void updateNickAndNotify(Client* client, const std::string& nick, Server* server) {
     std::string oldNick = client->getNickname();
-    client->setNickname(nick);
+    server->setClientNickname(client, nick);
     client->setNickSet(true);
 
     if (!oldNick.empty() && client->isRegistered()) {
-        client->sendReply(":" + oldNick + "!" + client->getUsername() + "@" + client->getHostname() + " NICK " + nick);
+        std::vector<Channel*> shared = PeerFanout::sharedChannels(server, client);
+        for (std::vector<Channel*>::iterator it = shared.begin(); it != shared.end(); ++it) {
+            (*it)->memberRenamed(client, oldNick);
+        }
+        PeerFanout::send(shared, client,
+                         ":" + oldNick + "!" + client->getUsername() + "@" + client->getHostname() + " NICK " + nick, true);
     } else {
         client->sendReply(IRC_SERVER " " NOTICE_JOIN " " + nick + " :Nickname set to " + nick);
     }
@@ -72,9 +74,8 @@ void handleNick(std::list<std::string> cmdList, Client* client, Server* server)
         return;
     }
 
-    std::map<int, Client*>& clients = server->getClients();
-    if (!isNickAvailable(nick, client, clients)) return;
+    if (!isNickAvailable(nick, client, server)) return;
 
-    updateNickAndNotify(client, nick);
+    updateNickAndNotify(client, nick, server);
     maybeRegister(client, server);
 }
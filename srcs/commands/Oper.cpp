@@ -0,0 +1,35 @@
+#include "Includes.hpp"
+
+static bool validateOperCommand(std::list<std::string>& cmdList, Client* client) {
+    return CommandUtils::validateClientRegistration(client) &&
+           CommandUtils::validateParameters(cmdList, client, "OPER", 3);
+}
+
+void handleOper(std::list<std::string> cmdList, Client* client, Server* server) {
+    if (!validateOperCommand(cmdList, client)) {
+        return;
+    }
+
+    std::list<std::string>::iterator it = cmdList.begin();
+    ++it;
+    std::string name = *it;
+    ++it;
+    std::string password = *it;
+
+    if (server->getOperPassword().empty()) {
+        client->sendReply(std::string(IRC_SERVER) + " " + ERR_NOOPERHOST + " " +
+                          client->getNickname() + " :No O-lines for your host");
+        return;
+    }
+    if (password != server->getOperPassword()) {
+        client->sendReply(std::string(IRC_SERVER) + " " + ERR_PASSWDMISMATCH + " " +
+                          client->getNickname() + " :Password incorrect");
+        Logger::warning("Failed OPER attempt by " + client->getNickname() + " as " + name);
+        return;
+    }
+
+    client->setIrcOperator(true);
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_YOUREOPER + " " +
+                      client->getNickname() + " :You are now an IRC operator");
+    Logger::info(client->getNickname() + " is now an IRC operator (" + name + ")");
+}
@@ -4,69 +4,168 @@
 #include "Replies.hpp"
 #include <sstream>
 
-static bool validatePrivmsgParameters(std::list<std::string>& cmdList, Client* client) {
-    if (!CommandUtils::validateParameters(cmdList, client, "PRIVMSG", 2)) {
+// PRIVMSG and NOTICE share one routing path. All targets are resolved
+// through the channel map and the nickname index before anything is sent,
+// each target gets one line naming that target, and a client reached
+// through several targets receives the message once. NOTICE never triggers
+// automatic replies, so its errors are dropped silently.
+
+struct MessageTarget {
+    const std::string* name;
+    Channel* channel;
+    Client* user;
+};
+
+static void sendRoutingError(Client* client, bool notice, const std::string& reply) {
+    if (!notice) {
+        client->sendReply(reply);
+    }
+}
+
+static bool validateMessageParameters(std::list<std::string>& cmdList, Client* client, const std::string& verb,
+                                      bool notice) {
+    if (cmdList.size() < 2) {
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_NORECIPIENT + " " +
+                                             CommandUtils::getNicknameOrDefault(client, "*") +
+                                             " :No recipient given (" + verb + ")");
         return false;
     }
     if (cmdList.size() < 3) {
         std::string nickname = CommandUtils::getNicknameOrDefault(client, "*");
-        client->sendReply(std::string(IRC_SERVER) + " " + ERR_NOTEXTTOSEND + " " +
-                          nickname + " :No text to send");
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_NOTEXTTOSEND + " " +
+                                             nickname + " :No text to send");
         return false;
     }
     return true;
 }
 
-static bool validateMessageLength(const std::string& message, Client* client) {
+static bool validateMessageLength(const std::string& message, Client* client, bool notice) {
     std::string fullMsgWithCRLF = message + CRLF;
     if (fullMsgWithCRLF.length() > MAX_MESSAGE_LENGTH) {
-        client->sendReply(std::string(IRC_SERVER) + " " + ERR_TOOMANYCHANNELS + " " +
-                          client->getNickname() + " :Message too long");
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_TOOMANYCHANNELS + " " +
+                                             client->getNickname() + " :Message too long");
         return false;
     }
     return true;
 }
 
-static std::string constructFullMessage(const std::string& targetsStr, const std::string& message, Client* client) {
-    std::string userIdent = client->getNickname() + "!" + client->getUsername() + "@" + client->getHostname();
-    return ":" + userIdent + " PRIVMSG " + targetsStr + " :" + message;
+// Channel names match exactly, as in the channel map; nicknames ignore
+// case, as in the nickname index.
+static bool sameTarget(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    if (a[0] == '#') {
+        return a == b;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool alreadyListed(const std::vector<std::string>& names, const std::string& name) {
+    for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        if (sameTarget(*it, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Splits the comma-separated target list, dropping empty and repeated names
+// and everything past MAXTARGETS. The list is short, so duplicates are found
+// by a linear scan rather than a set.
+static std::vector<std::string> collectTargetNames(const std::string& targetsStr, Client* client, Server* server,
+                                                   bool notice) {
+    std::vector<std::string> names;
+    std::list<std::string> parts = Utils::split(targetsStr, ',');
+    for (std::list<std::string>::iterator it = parts.begin(); it != parts.end(); ++it) {
+        if (it->empty() || alreadyListed(names, *it)) {
+            continue;
+        }
+        if (names.size() == server->getMaxTargets()) {
+            sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_TOOMANYTARGETS + " " +
+                                                 client->getNickname() + " " + *it +
+                                                 " :Too many recipients. Only " +
+                                                 Utils::intToString(server->getMaxTargets()) + " processed");
+            break;
+        }
+        names.push_back(*it);
+    }
+    return names;
 }
 
-static void processChannelMessage(const std::string& target, const std::string& fullMsg, Client* client, Server* server) {
+static bool resolveChannelTarget(MessageTarget& target, Client* client, Server* server, bool notice) {
     std::map<std::string, Channel*>& channels = server->getChannels();
-    std::map<std::string, Channel*>::iterator chanIt = channels.find(target);
+    std::map<std::string, Channel*>::iterator chanIt = channels.find(*target.name);
     if (chanIt == channels.end()) {
-        client->sendReply(std::string(IRC_SERVER) + " " + ERR_NOSUCHCHANNEL + " " +
-                          client->getNickname() + " " + target + " :No such channel");
-        return;
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_NOSUCHCHANNEL + " " +
+                                             client->getNickname() + " " + *target.name + " :No such channel");
+        return false;
     }
-    Channel* channel = chanIt->second;
-    if (!channel->isMember(client)) {
-        client->sendReply(std::string(IRC_SERVER) + " " + ERR_CANNOTSENDTOCHAN + " " +
-                          client->getNickname() + " " + target + " :Cannot send to channel");
-        return;
+    if (!chanIt->second->isMember(client)) {
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_CANNOTSENDTOCHAN + " " +
+                                             client->getNickname() + " " + *target.name +
+                                             " :Cannot send to channel");
+        return false;
     }
-    channel->broadcast(fullMsg, client);
+    target.channel = chanIt->second;
+    return true;
 }
 
-static void processUserMessage(const std::string& target, const std::string& fullMsg, Client* client, Server* server) {
-    std::map<int, Client*>& clients = server->getClients();
-    bool found = false;
-    for (std::map<int, Client*>::iterator clientIt = clients.begin(); clientIt != clients.end(); ++clientIt) {
-        if (clientIt->second->getNickname() == target) {
-            clientIt->second->sendReply(fullMsg);
-            found = true;
-            break;
+static bool resolveUserTarget(MessageTarget& target, Client* client, Server* server, bool notice) {
+    target.user = server->getClientByNickname(*target.name);
+    if (!target.user) {
+        sendRoutingError(client, notice, std::string(IRC_SERVER) + " " + ERR_NOSUCHNICK + " " +
+                                             client->getNickname() + " " + *target.name + " :No such nick");
+        return false;
+    }
+    return true;
+}
+
+static std::vector<MessageTarget> resolveTargets(const std::vector<std::string>& names, Client* client,
+                                                 Server* server, bool notice) {
+    std::vector<MessageTarget> resolved;
+    for (std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        MessageTarget target;
+        target.name = &*it;
+        target.channel = NULL;
+        target.user = NULL;
+        bool found = (*it)[0] == '#' ? resolveChannelTarget(target, client, server, notice)
+                                     : resolveUserTarget(target, client, server, notice);
+        if (found) {
+            resolved.push_back(target);
         }
     }
-    if (!found) {
-        client->sendReply(std::string(IRC_SERVER) + " " + ERR_NOSUCHNICK + " " +
-                          client->getNickname() + " " + target + " :No such nick");
+    return resolved;
+}
+
+static void deliverMessage(const std::vector<MessageTarget>& targets, const std::string& verb,
+                           const std::string& message, Client* client) {
+    std::string prefix = ":" + client->getNickname() + "!" + client->getUsername() + "@" + client->getHostname() +
+                         " " + verb + " ";
+    unsigned long generation = PeerFanout::nextGeneration();
+    for (std::vector<MessageTarget>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+        std::string line;
+        line.reserve(prefix.size() + it->name->size() + message.size() + 4);
+        line.append(prefix).append(*it->name).append(" :").append(message).append(CRLF);
+        line = client->formatReply(line);
+        if (it->channel) {
+            it->channel->deliverOnce(line, generation);
+        } else if (it->user->getFanoutStamp() != generation) {
+            it->user->setFanoutStamp(generation);
+            it->user->queueOutput(line);
+        }
     }
 }
 
-void handlePrivmsg(std::list<std::string> cmdList, Client* client, Server* server) {
-    if (!CommandUtils::validateClientRegistration(client) || !validatePrivmsgParameters(cmdList, client)) {
+static void routeMessage(std::list<std::string>& cmdList, Client* client, Server* server, const std::string& verb,
+                         bool notice) {
+    if (!CommandUtils::validateClientRegistration(client) ||
+        !validateMessageParameters(cmdList, client, verb, notice)) {
         return;
     }
 
@@ -79,21 +178,20 @@ void handlePrivmsg(std::list<std::string> cmdList, Client* client, Server* serve
         message += " " + *it;
     }
 
-    if (!validateMessageLength(message, client)) {
+    if (!validateMessageLength(message, client, notice)) {
         return;
     }
 
-    std::list<std::string> targets = Utils::split(targetsStr, ',');
-    std::string fullMsg = constructFullMessage(targetsStr, message, client);
+    std::vector<std::string> names = collectTargetNames(targetsStr, client, server, notice);
+    deliverMessage(resolveTargets(names, client, server, notice), verb, message, client);
 
-    for (std::list<std::string>::iterator targetIt = targets.begin(); targetIt != targets.end(); ++targetIt) {
-        std::string target = *targetIt;
-        if (target[0] == '#') {
-            processChannelMessage(target, fullMsg, client, server);
-        } else {
-            processUserMessage(target, fullMsg, client, server);
-        }
-    }
+    Logger::info(client->getNickname() + " sent " + verb + " to " + targetsStr + ": " + message);
+}
+
+void handlePrivmsg(std::list<std::string> cmdList, Client* client, Server* server) {
+    routeMessage(cmdList, client, server, "PRIVMSG", false);
+}
 
-    Logger::info(client->getNickname() + " sent PRIVMSG to " + targetsStr + ": " + message);
+void handleNotice(std::list<std::string> cmdList, Client* client, Server* server) {
+    routeMessage(cmdList, client, server, "NOTICE", true);
 }
@@ -25,30 +25,12 @@ std::string buildQuitPrefix(Client* client, const std::string& message) {
            client->getHostname() + " QUIT :" + message;
 }
 
-std::set<Channel*> findClientChannels(Client* client, Server* server) {
-    std::set<Channel*> clientChannels;
-    std::map<std::string, Channel*>& channels = server->getChannels();
-
-    for (std::map<std::string, Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
-        if (it->second->isMember(client)) {
-            clientChannels.insert(it->second);
-        }
-    }
-    return clientChannels;
-}
-
-void broadcastQuitToChannels(const std::set<Channel*>& channels, const std::string& prefix, Client* client) {
-    for (std::set<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
-        (*it)->broadcast(prefix, client);
-    }
-}
-
 void sendErrorClosingLink(Client* client, const std::string& message) {
     client->sendReply("ERROR :Closing link: " + message);
 }
 
-void removeClientFromChannels(const std::set<Channel*>& channels, Client* client, Server* server) {
-    for (std::set<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+void removeClientFromChannels(const std::vector<Channel*>& channels, Client* client, Server* server) {
+    for (std::vector<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
         (*it)->removeMember(client);
         if ((*it)->getMemberCount() == 0) {
             server->removeChannel((*it)->getName());
@@ -73,9 +55,9 @@ void handleQuit(std::list<std::string> cmdList, Client* client, Server* server)
     std::string message = extractQuitMessage(cmdList);
     std::string prefix = buildQuitPrefix(client, message);
 
-    std::set<Channel*> clientChannels = findClientChannels(client, server);
+    std::vector<Channel*> clientChannels = PeerFanout::sharedChannels(server, client);
 
-    broadcastQuitToChannels(clientChannels, prefix, client);
+    PeerFanout::send(clientChannels, client, prefix, true);
     sendErrorClosingLink(client, message);
     removeClientFromChannels(clientChannels, client, server);
     disconnectClient(client, server, message);
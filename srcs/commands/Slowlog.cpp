@@ -0,0 +1,49 @@
+#include "Includes.hpp"
+
+static void sendSlowlogNotice(Client* client, const std::string& text) {
+    client->sendReply(std::string(IRC_SERVER) + " NOTICE " + client->getNickname() + " :" + text);
+}
+
+static size_t parseCount(const std::string& countStr, size_t defaultCount) {
+    if (countStr.empty() || countStr.find_first_not_of("0123456789") != std::string::npos) {
+        return defaultCount;
+    }
+    return static_cast<size_t>(std::strtoul(countStr.c_str(), NULL, 10));
+}
+
+static void sendSlowlogEntries(Client* client, SlowLog& slowLog, size_t count) {
+    const std::deque<SlowLogEntry>& entries = slowLog.getEntries();
+    std::ostringstream header;
+    header << "SLOWLOG " << entries.size() << "/" << slowLog.getMaxEntries()
+           << " entries, threshold " << slowLog.getThresholdUs() << "us";
+    sendSlowlogNotice(client, header.str());
+
+    size_t sent = 0;
+    for (std::deque<SlowLogEntry>::const_iterator it = entries.begin();
+         it != entries.end() && sent < count; ++it, ++sent) {
+        sendSlowlogNotice(client, "SLOWLOG " + SlowLog::formatEntry(*it));
+    }
+    sendSlowlogNotice(client, "SLOWLOG End of slow log");
+}
+
+void handleSlowlog(std::list<std::string> cmdList, Client* client, Server* server) {
+    if (!CommandUtils::validateClientRegistration(client) || !CommandUtils::validateIrcOperator(client)) {
+        return;
+    }
+
+    SlowLog& slowLog = server->getSlowLog();
+    std::list<std::string>::iterator it = cmdList.begin();
+    ++it;
+    if (it != cmdList.end() && *it == "RESET") {
+        slowLog.reset();
+        sendSlowlogNotice(client, "SLOWLOG Slow log cleared");
+        Logger::info("Slow log cleared by " + client->getNickname());
+        return;
+    }
+
+    size_t count = slowLog.getMaxEntries();
+    if (it != cmdList.end()) {
+        count = parseCount(*it, count);
+    }
+    sendSlowlogEntries(client, slowLog, count);
+}
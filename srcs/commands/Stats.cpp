@@ -0,0 +1,31 @@
+#include "Includes.hpp"
+
+static void sendStatsLine(Client* client, const std::string& text) {
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_STATSDEBUG + " " + client->getNickname() + " :" + text);
+}
+
+static void sendTickStats(Client* client, Server* server) {
+    TickProfiler& profiler = server->getProfiler();
+    sendStatsLine(client, TickProfiler::formatWindow(profiler.aggregate(1), "1s"));
+    sendStatsLine(client, TickProfiler::formatWindow(profiler.aggregate(10), "10s"));
+    sendStatsLine(client, TickProfiler::formatWindow(profiler.aggregate(TICK_WINDOW_COUNT), "60s"));
+    sendStatsLine(client, TickProfiler::formatWindow(profiler.getTotals(), "total"));
+}
+
+void handleStats(std::list<std::string> cmdList, Client* client, Server* server) {
+    if (!CommandUtils::validateClientRegistration(client) ||
+        !CommandUtils::validateParameters(cmdList, client, "STATS", 2) ||
+        !CommandUtils::validateIrcOperator(client)) {
+        return;
+    }
+
+    std::list<std::string>::iterator it = cmdList.begin();
+    ++it;
+    std::string query = *it;
+
+    if (query == "t") {
+        sendTickStats(client, server);
+    }
+    client->sendReply(std::string(IRC_SERVER) + " " + RPL_ENDOFSTATS + " " + client->getNickname() + " " +
+                      query + " :End of STATS report");
+}
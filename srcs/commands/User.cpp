@@ -33,6 +33,10 @@ static void maybeRegister(Client* client, Server* server) {
         client->sendReply(IRC_SERVER " " RPL_YOURHOST " " + nick + " :Your host is ircserv, running version 1.0");
         client->sendReply(IRC_SERVER " " RPL_CREATED " " + nick + " :This server was created " + server->getCreatedTime());
         client->sendReply(IRC_SERVER " " RPL_MYINFO " " + nick + " ircserv 1.0 " "" " itkol");
+        std::string maxTargets = Utils::intToString(server->getMaxTargets());
+        client->sendReply(IRC_SERVER " " RPL_ISUPPORT " " + nick + " MAXTARGETS=" + maxTargets +
+                          " TARGMAX=PRIVMSG:" + maxTargets + ",NOTICE:" + maxTargets +
+                          " :are supported by this server");
     }
 }
 
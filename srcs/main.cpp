@@ -8,7 +8,12 @@ int main(int argc, char** argv)
         }
         Server server(argv[1], argv[2]);
         Utils::setupSignalHandler();
-        server.serverInit();
+        int upgradeLink = HotUpgrade::inheritedLink();
+        if (upgradeLink >= 0) {
+            server.serverResume(upgradeLink);
+        } else {
+            server.serverInit();
+        }
         server.serverRun();
     } catch (const std::exception& e) {
         Logger::error(e);